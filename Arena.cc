@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+#include "Arena.h"
+#include "Metrics.h"
+
+// Constants
+#define ARENA_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+// Allocations that do not fit in the arena are chained here and freed on reset
+typedef struct Overflow_chunk {
+    struct Overflow_chunk * next;
+    alignas(ARENA_ALIGNMENT) unsigned char data[1];
+} Overflow_chunk;
+
+alignas(ARENA_ALIGNMENT) static unsigned char arena[ARENA_SIZE];
+static size_t arena_used = 0;
+static Overflow_chunk * overflow_chunks = NULL;
+
+/**
+ * @brief Allocate scratch memory for the command being run. Only for use by the thread running
+ * commands.
+ *
+ * @param size - The number of bytes to allocate
+ * @return Memory aligned to 16 bytes, valid until the next arena_reset()
+ */
+void * arena_allocate(size_t size) {
+    size_t start = (arena_used + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    if (start + size <= ARENA_SIZE) {
+        arena_used = start + size;
+        return arena + start;
+    }
+
+    // A very long command line; fall back to the heap
+    Overflow_chunk * chunk = (Overflow_chunk *) malloc(offsetof(Overflow_chunk, data) + size);
+    if (chunk == NULL) {
+        throw std::bad_alloc();
+    }
+    metrics_count_allocation();
+    chunk->next = overflow_chunks;
+    overflow_chunks = chunk;
+    return chunk->data;
+}
+
+/**
+ * @brief Reclaim everything allocated from the arena. Called between commands.
+ */
+void arena_reset() {
+    arena_used = 0;
+    while (overflow_chunks != NULL) {
+        Overflow_chunk * next = overflow_chunks->next;
+        free(overflow_chunks);
+        overflow_chunks = next;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+void * arena_allocate(size_t size);
+void arena_reset();
+
+/**
+ * @brief Allocator handing out memory from the command arena. Memory is never freed one object at
+ * a time; it is all reclaimed by arena_reset() between commands, so anything allocated with it must
+ * not outlive the command it was allocated for.
+ */
+template <typename T>
+class Arena_allocator {
+public:
+    typedef T value_type;
+
+    Arena_allocator() {}
+    template <typename U> Arena_allocator(const Arena_allocator<U> &) {}
+
+    T * allocate(size_t count) { return static_cast<T *>(arena_allocate(count * sizeof(T))); }
+    void deallocate(T *, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const Arena_allocator<T> &, const Arena_allocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const Arena_allocator<T> &, const Arena_allocator<U> &) { return false; }
+
+// Strings and lists that only live for the length of a command
+typedef std::basic_string<char, std::char_traits<char>, Arena_allocator<char>> Arena_string;
+typedef std::vector<Arena_string, Arena_allocator<Arena_string>> Command_arguments;
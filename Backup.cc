@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Backup.h"
+#include "BlockMap.h"
+#include "BlockPool.h"
+#include "IO.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+// Constants
+#define CHANGES_MAGIC "FSCB"    // Starts the changed block file of a disk
+#define DELTA_MAGIC "FSDL"      // Starts a delta
+
+// The start of a delta. It is followed by the block map file of the disk, if it has one, and then
+// by every changed block in block order.
+typedef struct {
+    char magic[4];
+    uint32_t base_generation;   // The checkpoint the delta applies to, 0 for a delta holding every block
+    uint32_t generation;        // The checkpoint it brings a disk to
+    uint32_t block_count;       // Blocks of the whole disk
+    uint32_t block_map_size;    // Bytes of block map file, 0 if the disk has none
+    uint8_t changed[Standard_geometry::block_count / 8];
+} Delta_header;
+
+/**
+ * @brief The name of the file holding the changed blocks of a disk: the disk's name with ".changes"
+ * added
+ */
+static void changes_path(const std::string & disk_name, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%s.changes", disk_name.c_str());
+}
+
+/**
+ * @brief Check whether a block is marked in a bitmap of blocks
+ */
+static bool is_block_marked(const uint8_t * bits, int block_number) {
+    return (bits[block_number / 8] >> (block_number % 8)) & 1;
+}
+
+/**
+ * @brief Write the checkpoint and changed blocks of a disk back to its file
+ */
+static void save_changed_blocks(Changed_blocks * changes) {
+    if (pwrite(changes->fd, &changes->generation, sizeof(changes->generation), 4) != (ssize_t) sizeof(changes->generation) ||
+        pwrite(changes->fd, changes->changed, sizeof(changes->changed), 4 + sizeof(changes->generation)) != (ssize_t) sizeof(changes->changed)) {
+        std::cerr << "Error: Writing changed blocks to disk\n";
+    }
+}
+
+/**
+ * @brief Read the changed blocks of a disk, the first time the disk is opened in a run. Its file is
+ * kept open so that blocks can be marked as they are written.
+ *
+ * @param disk_name - The name of the disk
+ * @return The disk's changed blocks, or NULL if the disk was never exported
+ */
+Changed_blocks * load_changed_blocks(const std::string & disk_name) {
+    char path[PATH_MAX];
+    changes_path(disk_name, path);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            std::cerr << "Error: Opening changed blocks of " << disk_name << std::endl;
+        }
+        return NULL;
+    }
+
+    Changed_blocks * changes = new Changed_blocks;
+    char magic[4];
+    if (pread(fd, magic, 4, 0) != 4 || memcmp(magic, CHANGES_MAGIC, 4) != 0 ||
+        pread(fd, &changes->generation, sizeof(changes->generation), 4) != (ssize_t) sizeof(changes->generation) ||
+        pread(fd, changes->changed, sizeof(changes->changed), 4 + sizeof(changes->generation)) != (ssize_t) sizeof(changes->changed)) {
+        std::cerr << "Error: Reading changed blocks of " << disk_name << std::endl;
+        close(fd);
+        delete changes;
+        return NULL;
+    }
+    changes->fd = fd;
+    return changes;
+}
+
+/**
+ * @brief Start tracking the blocks written to a disk, at checkpoint 0 with nothing changed
+ *
+ * @param disk_name - The name of the disk
+ * @return The disk's changed blocks, or NULL if they could not be stored
+ */
+Changed_blocks * create_changed_blocks(const std::string & disk_name) {
+    char path[PATH_MAX];
+    changes_path(disk_name, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || pwrite(fd, CHANGES_MAGIC, 4, 0) != 4) {
+        std::cerr << "Error: Creating changed blocks of " << disk_name << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    Changed_blocks * changes = new Changed_blocks;
+    changes->fd = fd;
+    changes->generation = 0;
+    memset(changes->changed, 0, sizeof(changes->changed));
+    save_changed_blocks(changes);
+    return changes;
+}
+
+/**
+ * @brief Mark blocks as written since the last checkpoint. The file is only written when a block
+ * is marked for the first time, so rewriting the same blocks costs nothing more.
+ *
+ * @param changes - The disk's changed blocks
+ * @param block_number - The first block written
+ * @param count - The number of blocks written
+ */
+void mark_changed_blocks(Changed_blocks * changes, int block_number, int count) {
+    bool marked = false;
+    for (int block = block_number; block < block_number + count && block < Standard_geometry::block_count; block++) {
+        if (!is_block_marked(changes->changed, block)) {
+            changes->changed[block / 8] |= 1 << (block % 8);
+            marked = true;
+        }
+    }
+    if (marked) {
+        save_changed_blocks(changes);
+    }
+}
+
+/**
+ * @brief Find the next run of marked blocks
+ *
+ * @param bits - The bitmap of blocks
+ * @param block_count - The number of blocks
+ * @param block_number - The block to start looking at
+ * @param run - Set to the length of the run
+ * @return The first block of the run, or -1 if no block is marked from block_number on
+ */
+static int next_marked_run(const uint8_t * bits, int block_count, int block_number, int * run) {
+    while (block_number < block_count && !is_block_marked(bits, block_number)) {
+        block_number++;
+    }
+    if (block_number == block_count) {
+        return -1;
+    }
+    *run = 0;
+    while (block_number + *run < block_count && is_block_marked(bits, block_number + *run)) {
+        (*run)++;
+    }
+    return block_number;
+}
+
+/**
+ * @brief Write a delta of a disk: the blocks written since its last checkpoint, and its block map,
+ * to a file. A disk that was never exported has every block in its first delta. A new checkpoint is
+ * taken once the delta is written.
+ *
+ * @param disk_name - The disk
+ * @param delta_path - The file to write the delta to
+ * @return True if the delta was written
+ */
+bool export_delta(const std::string & disk_name, const char * delta_path) {
+    Trace_span span("export_delta");
+    Disk disk;
+    if (!open_disk(disk_name, O_RDONLY, &disk)) {
+        std::cerr << "Error: Cannot open disk " << disk_name << std::endl;
+        return false;
+    }
+
+    Delta_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, 4);
+    header.block_count = std::min(count_disk_blocks(&disk), Standard_geometry::block_count);
+    if (disk.changes != NULL) {
+        header.base_generation = disk.changes->generation;
+        memcpy(header.changed, disk.changes->changed, sizeof(header.changed));
+    } else {
+        for (int block = 0; block < (int) header.block_count; block++) {
+            header.changed[block / 8] |= 1 << (block % 8);
+        }
+    }
+    header.generation = header.base_generation + 1;
+
+    // The block map goes along whole: it is small, and the blocks mean nothing without it
+    static uint8_t map_bytes[sizeof(Block_map)];
+    char path[PATH_MAX];
+    block_map_path(disk_name, path);
+    int map_fd = open(path, O_RDONLY);
+    if (map_fd >= 0) {
+        ssize_t size = read(map_fd, map_bytes, sizeof(map_bytes));
+        header.block_map_size = size > 0 ? size : 0;
+        close(map_fd);
+    }
+
+    int fd = open(delta_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header) &&
+              write(fd, map_bytes, header.block_map_size) == (ssize_t) header.block_map_size;
+    uint8_t * extent = extent_buffer();
+    int exported = 0;
+    int run = 0;
+    for (int block = next_marked_run(header.changed, header.block_count, 0, &run); ok && block >= 0;
+         block = next_marked_run(header.changed, header.block_count, block + run, &run)) {
+        read_from_blocks(&disk, extent, block, run);
+        ok = write(fd, extent, (size_t) run * BLOCK_SIZE) == (ssize_t) run * BLOCK_SIZE;
+        exported += run;
+    }
+    close_disk(&disk);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        std::cerr << "Error: Writing delta " << delta_path << std::endl;
+        return false;
+    }
+
+    Changed_blocks * changes = track_changes(disk_name);
+    if (changes != NULL) {
+        changes->generation = header.generation;
+        memset(changes->changed, 0, sizeof(changes->changed));
+        save_changed_blocks(changes);
+    }
+    metrics_add(COUNTER_DELTA_BLOCKS_EXPORTED, exported);
+    return true;
+}
+
+/**
+ * @brief Replay a delta onto a disk that is not mounted, bringing it to the delta's checkpoint. A
+ * delta holding every block can be applied to any disk, and creates the disk if there is none. Any
+ * other delta must follow the last one applied to the disk, with nothing written to it since.
+ *
+ * @param delta_path - The file holding the delta
+ * @param disk_name - The disk to apply it to
+ * @return True if the delta was applied
+ */
+bool apply_delta(const char * delta_path, const std::string & disk_name) {
+    Trace_span span("apply_delta");
+    int fd = open(delta_path, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open delta " << delta_path << std::endl;
+        return false;
+    }
+
+    Delta_header header;
+    static uint8_t map_bytes[sizeof(Block_map)];
+    if (read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) || memcmp(header.magic, DELTA_MAGIC, 4) != 0 ||
+        header.block_count > (uint32_t) Standard_geometry::block_count || header.block_map_size > sizeof(map_bytes) ||
+        read(fd, map_bytes, header.block_map_size) != (ssize_t) header.block_map_size) {
+        std::cerr << "Error: " << delta_path << " is not a delta\n";
+        close(fd);
+        return false;
+    }
+
+    struct stat disk_stat;
+    if (header.base_generation == 0 && stat(disk_name.c_str(), &disk_stat) != 0) {
+        int disk_fd = open(disk_name.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (disk_fd < 0 || ftruncate(disk_fd, (off_t) header.block_count * BLOCK_SIZE) != 0) {
+            std::cerr << "Error: Cannot create disk " << disk_name << std::endl;
+            close(fd);
+            if (disk_fd >= 0) {
+                close(disk_fd);
+            }
+            return false;
+        }
+        close(disk_fd);
+    }
+
+    Disk disk;
+    if (!open_disk(disk_name, O_RDWR, &disk)) {
+        std::cerr << "Error: Cannot find disk " << disk_name << std::endl;
+        close(fd);
+        return false;
+    }
+    if (header.base_generation != 0) {
+        bool follows = disk.changes != NULL && disk.changes->generation == header.base_generation;
+        for (int i = 0; follows && i < (int) sizeof(disk.changes->changed); i++) {
+            follows = disk.changes->changed[i] == 0;
+        }
+        if (!follows) {
+            std::cerr << "Error: " << delta_path << " does not follow the last delta applied to " << disk_name << std::endl;
+            close_disk(&disk);
+            close(fd);
+            return false;
+        }
+    }
+
+    uint8_t * extent = extent_buffer();
+    bool ok = true;
+    int applied = 0;
+    int run = 0;
+    for (int block = next_marked_run(header.changed, header.block_count, 0, &run); ok && block >= 0;
+         block = next_marked_run(header.changed, header.block_count, block + run, &run)) {
+        ok = read(fd, extent, (size_t) run * BLOCK_SIZE) == (ssize_t) run * BLOCK_SIZE;
+        if (ok) {
+            write_to_blocks(&disk, extent, block, run);
+            applied += run;
+        }
+    }
+    close_disk(&disk);
+    close(fd);
+    if (!ok) {
+        std::cerr << "Error: " << delta_path << " is truncated\n";
+        return false;
+    }
+
+    char path[PATH_MAX];
+    block_map_path(disk_name, path);
+    if (header.block_map_size == 0) {
+        unlink(path);
+    } else {
+        int map_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (map_fd < 0 || write(map_fd, map_bytes, header.block_map_size) != (ssize_t) header.block_map_size) {
+            std::cerr << "Error: Writing block map of " << disk_name << std::endl;
+        }
+        if (map_fd >= 0) {
+            close(map_fd);
+        }
+    }
+
+    // The disk is now at the delta's checkpoint; the blocks just written are not changes of its own
+    Changed_blocks * changes = track_changes(disk_name);
+    if (changes != NULL) {
+        changes->generation = header.generation;
+        memset(changes->changed, 0, sizeof(changes->changed));
+        save_changed_blocks(changes);
+    }
+    metrics_add(COUNTER_DELTA_BLOCKS_APPLIED, applied);
+    return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+// The blocks of a disk written since its last checkpoint, for incremental backups. A disk gets this
+// when it is first exported, and it is kept in a file next to the disk since the superblock has no
+// room for it.
+typedef struct {
+    int fd;                                               // The file, open for the whole run
+    uint32_t generation;                                  // The checkpoint the disk is at
+    uint8_t changed[Standard_geometry::block_count / 8];  // One bit per block, set once it is written
+} Changed_blocks;
+
+Changed_blocks * load_changed_blocks(const std::string & disk_name);
+Changed_blocks * create_changed_blocks(const std::string & disk_name);
+void mark_changed_blocks(Changed_blocks * changes, int block_number, int count);
+bool export_delta(const std::string & disk_name, const char * delta_path);
+bool apply_delta(const char * delta_path, const std::string & disk_name);
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <vector>
+
+#include "Batch.h"
+#include "Arena.h"
+#include "Engine.h"
+#include "Headroom.h"
+#include "IO.h"
+#include "Trace.h"
+
+// A run of free blocks that files of a batch can still be placed in
+typedef struct {
+    int start;
+    int length;
+} Batch_extent;
+
+/**
+ * @brief List the runs of free blocks of a free block list, in block order
+ *
+ * @param free_list - The superblock whose free block list is read
+ * @param disk_geometry - The engine for the disk
+ * @param extents - Set to the runs; room for one run every other block is enough
+ * @return The number of runs
+ */
+static int collect_extents(Super_block * free_list, const Geometry_engine * disk_geometry, Batch_extent * extents) {
+    int extent_count = 0;
+    for (int block = 1; block < disk_geometry->block_count; block++) {
+        if (!is_block_free(block, free_list)) {
+            continue;
+        }
+        if (extent_count > 0 && extents[extent_count - 1].start + extents[extent_count - 1].length == block) {
+            extents[extent_count - 1].length++;
+        } else {
+            extents[extent_count].start = block;
+            extents[extent_count].length = 1;
+            extent_count++;
+        }
+    }
+    return extent_count;
+}
+
+/**
+ * @brief Place files in runs of free blocks, largest file first, each in the shortest run it fits
+ * in (the first such run when several are as short). A file that fills a run exactly leaves no gap
+ * behind, and small files go in the gaps left between larger ones instead of splitting long runs.
+ *
+ * @param extents - The runs of free blocks, shrunk as files are placed in them
+ * @param extent_count - The number of runs
+ * @param sizes - The size of every file; 0 for a directory, which needs no blocks
+ * @param order - The files, largest first
+ * @param count - The number of files
+ * @param first_blocks - Set to the first block of every file placed
+ * @return True if every file found room
+ */
+static bool pack_files(Batch_extent * extents, int extent_count, const int * sizes, const int * order, int count, int * first_blocks) {
+    for (int i = 0; i < count; i++) {
+        int file = order[i];
+        if (sizes[file] == 0) {
+            first_blocks[file] = 0;
+            continue;
+        }
+        Batch_extent * best = NULL;
+        for (int e = 0; e < extent_count; e++) {
+            if (extents[e].length >= sizes[file] && (best == NULL || extents[e].length < best->length)) {
+                best = &extents[e];
+            }
+        }
+        if (best == NULL) {
+            return false;
+        }
+        first_blocks[file] = best->start;
+        best->start += sizes[file];
+        best->length -= sizes[file];
+    }
+    return true;
+}
+
+/**
+ * @brief Choose where every file of a batch of new files goes, all at once, so that they pack into
+ * the free space of the disk instead of taking the first run long enough in the order they were
+ * listed. Blocks reserved as headroom for growing files (see Headroom.cc) are passed over unless
+ * the batch does not fit without them, in which case the reservations the batch uses shrink, as
+ * for a single new file. Nothing is allocated; the caller allocates the blocks chosen.
+ *
+ * @param super_block - The superblock of the disk
+ * @param disk_geometry - The engine for the disk
+ * @param sizes - The size of every file of the batch; 0 for a directory
+ * @param count - The number of files
+ * @param first_blocks - Set to the first block of every file, 0 for a directory
+ * @return True if every file found room. False otherwise, with nothing changed.
+ */
+bool plan_batch_blocks(Super_block * super_block, const Geometry_engine * disk_geometry, const int * sizes, int count, int * first_blocks) {
+    Trace_span span("plan_batch_blocks", 0, count);
+    std::vector<int, Arena_allocator<int>> order(count);
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    // Files of the same size keep the order they were listed in
+    std::sort(order.begin(), order.end(), [sizes](int a, int b) {
+        return sizes[a] != sizes[b] ? sizes[a] > sizes[b] : a < b;
+    });
+
+    Batch_extent extents[Standard_geometry::block_count / 2 + 1];
+    Super_block masked;
+    mask_reserved_blocks(super_block, &masked);
+    if (pack_files(extents, collect_extents(&masked, disk_geometry, extents), sizes, order.data(), count, first_blocks)) {
+        return true;
+    }
+
+    if (!pack_files(extents, collect_extents(super_block, disk_geometry, extents), sizes, order.data(), count, first_blocks)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        if (sizes[i] > 0) {
+            reclaim_headroom(super_block, first_blocks[i], sizes[i]);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "FileSystem.h"
+
+bool plan_batch_blocks(Super_block * super_block, const Geometry_engine * disk_geometry, const int * sizes, int count, int * first_blocks);
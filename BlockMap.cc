@@ -0,0 +1,368 @@
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "BlockMap.h"
+#include "BlockPool.h"
+#include "Compression.h"
+#include "InodeHelper.h"
+#include "IO.h"
+
+// Starts the block map file of a disk
+#define BLOCK_MAP_MAGIC "FSBM"
+
+/**
+ * @brief The name of the file holding the block map of a disk: the disk's name with ".blockmap"
+ * added. Built in a caller's buffer so that saving the map does not allocate.
+ *
+ * @param disk_name - The name of the disk
+ * @param path - Set to the name of the file
+ */
+void block_map_path(const std::string & disk_name, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%s.blockmap", disk_name.c_str());
+}
+
+/**
+ * @brief The parts of a block map that are saved, in the order they are stored in its file. The
+ * last two parts, for compressed files, are only stored while there are any.
+ */
+static int block_map_parts(Block_map * map, char magic[4], struct iovec parts[6]) {
+    parts[0].iov_base = magic;
+    parts[0].iov_len = 4;
+    parts[1].iov_base = map->mapped.bits;
+    parts[1].iov_len = sizeof(map->mapped.bits);
+    parts[2].iov_base = map->references;
+    parts[2].iov_len = sizeof(map->references);
+    parts[3].iov_base = map->remap;
+    parts[3].iov_len = sizeof(map->remap);
+    parts[4].iov_base = map->compressed.bits;
+    parts[4].iov_len = sizeof(map->compressed.bits);
+    parts[5].iov_base = map->fragment;
+    parts[5].iov_len = sizeof(map->fragment);
+    return count_inodes(map->compressed) > 0 ? 6 : 4;
+}
+
+/**
+ * @brief The total size of some parts of a block map
+ */
+static ssize_t parts_size(const struct iovec * parts, int part_count) {
+    ssize_t size = 0;
+    for (int i = 0; i < part_count; i++) {
+        size += parts[i].iov_len;
+    }
+    return size;
+}
+
+/**
+ * @brief Read the block map of a disk being loaded. A disk without a block map file has no clones.
+ *
+ * @param disk_name - The name of the disk
+ * @param super_block - The disk's superblock, allocated with allocate_super_block()
+ * @return False if the disk has a block map file that cannot be read
+ */
+bool load_block_map(const std::string & disk_name, Super_block * super_block) {
+    char path[PATH_MAX];
+    block_map_path(disk_name, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+
+    Block_map * map = block_map(super_block);
+    memset(map, 0, sizeof(Block_map));
+    char magic[4];
+    struct iovec parts[6];
+    block_map_parts(map, magic, parts);
+    bool loaded = readv(fd, parts, 4) == parts_size(parts, 4) && memcmp(magic, BLOCK_MAP_MAGIC, 4) == 0;
+    if (loaded) {
+        ssize_t compressed_size = readv(fd, parts + 4, 2);
+        loaded = compressed_size == 0 || compressed_size == parts_size(parts + 4, 2);
+    }
+    close(fd);
+    if (!loaded) {
+        memset(map, 0, sizeof(Block_map));
+    }
+    return loaded;
+}
+
+/**
+ * @brief Write the block map of a disk back to its file. The map is written to a temporary file
+ * that is renamed over the old one, so the file always holds a whole map. Once no file is mapped any
+ * more, the file is removed and the disk is back to the plain format.
+ *
+ * @param disk_name - The name of the disk
+ * @param super_block - The disk's superblock
+ */
+void save_block_map(const std::string & disk_name, Super_block * super_block) {
+    Block_map * map = block_map(super_block);
+    char path[PATH_MAX];
+    block_map_path(disk_name, path);
+    map->dirty = false;
+    if (count_inodes(map->mapped) == 0) {
+        unlink(path);
+        return;
+    }
+
+    char magic[4];
+    memcpy(magic, BLOCK_MAP_MAGIC, 4);
+    struct iovec parts[6];
+    int part_count = block_map_parts(map, magic, parts);
+    char temporary_path[PATH_MAX + 16];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d", path, (int) getpid());
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0 && writev(fd, parts, part_count) == (ssize_t) parts_size(parts, part_count) && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!written || rename(temporary_path, path) != 0) {
+        std::cerr << "Error: Writing block map of " << disk_name << std::endl;
+        unlink(temporary_path);
+    }
+}
+
+/**
+ * @brief Check whether a file shares its blocks through the block map
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @return True if the file is mapped
+ */
+bool is_mapped(Super_block * super_block, int inode_index) {
+    return is_in_set(block_map(super_block)->mapped, inode_index);
+}
+
+/**
+ * @brief Check whether more than one file block is stored in a block
+ *
+ * @param super_block - The superblock of the disk
+ * @param block_number - The block
+ * @return True if writing the block through one file would change another
+ */
+bool is_block_shared(Super_block * super_block, int block_number) {
+    return block_number < Standard_geometry::block_count && block_map(super_block)->references[block_number] > 1;
+}
+
+/**
+ * @brief Find the block of the disk that stores a block of a file
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param block_num - The block of the file
+ * @return The block of the disk
+ */
+int physical_block(Super_block * super_block, int inode_index, int block_num) {
+    Block_map * map = block_map(super_block);
+    int start_block = super_block->inode[inode_index].start_block;
+    if (!is_in_set(map->mapped, inode_index) || map->remap[inode_index][block_num] == 0) {
+        return start_block + block_num;
+    }
+    return map->remap[inode_index][block_num];
+}
+
+/**
+ * @brief Check whether a file can share its blocks: the blocks of a file that runs past the end of
+ * the disk cannot be reference counted
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @return True if the file is mapped or can be
+ */
+bool can_map(Super_block * super_block, int inode_index) {
+    const Inode & inode = super_block->inode[inode_index];
+    return is_mapped(super_block, inode_index) || inode.start_block + get_inode_size(inode) <= Standard_geometry::block_count;
+}
+
+/**
+ * @brief Make a file that owns its extent a mapped file, holding one reference to each block of its
+ * extent. Does nothing to a file that is mapped already.
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ */
+void map_file(Super_block * super_block, int inode_index) {
+    Block_map * map = block_map(super_block);
+    if (is_in_set(map->mapped, inode_index)) {
+        return;
+    }
+    const Inode & inode = super_block->inode[inode_index];
+    for (int i = 0; i < get_inode_size(inode); i++) {
+        map->references[inode.start_block + i] = 1;
+    }
+    memset(map->remap[inode_index], 0, sizeof(map->remap[inode_index]));
+    memset(map->fragment[inode_index], 0, sizeof(map->fragment[inode_index]));
+    map->mapped.bits[inode_index / 64] |= 1ULL << (inode_index % 64);
+    map->dirty = true;
+}
+
+/**
+ * @brief Map a new clone onto the blocks of its source. The clone's inode must already have the
+ * source's start block and size.
+ *
+ * @param super_block - The superblock holding both files
+ * @param source_index - The inode of the file cloned
+ * @param clone_index - The inode of the clone
+ */
+void map_clone(Super_block * super_block, int source_index, int clone_index) {
+    Block_map * map = block_map(super_block);
+    int size = get_inode_size(super_block->inode[source_index]);
+    map_file(super_block, source_index);
+
+    memcpy(map->remap[clone_index], map->remap[source_index], sizeof(map->remap[clone_index]));
+    memcpy(map->fragment[clone_index], map->fragment[source_index], sizeof(map->fragment[clone_index]));
+    for (int i = 0; i < size; i++) {
+        map->references[physical_block(super_block, source_index, i)]++;
+    }
+    map->mapped.bits[clone_index / 64] |= 1ULL << (clone_index % 64);
+    if (is_in_set(map->compressed, source_index)) {
+        map->compressed.bits[clone_index / 64] |= 1ULL << (clone_index % 64);
+    }
+    map->dirty = true;
+}
+
+/**
+ * @brief Store a block of a mapped file in a block of its own, after the file wrote it while it was
+ * shared. The new block must be free; it is allocated here.
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param block_num - The block of the file
+ * @param block_number - The block of the disk to store it in from now on
+ */
+void remap_block(Super_block * super_block, int inode_index, int block_num, int block_number) {
+    Block_map * map = block_map(super_block);
+    map->references[physical_block(super_block, inode_index, block_num)]--;
+    allocate_block_in_free_list(block_number, super_block);
+    map->references[block_number] = 1;
+    map->remap[inode_index][block_num] = block_number;
+    map->fragment[inode_index][block_num] = 0;
+    map->dirty = true;
+}
+
+/**
+ * @brief Store a block of a mapped file in a block that already holds the same content, dropping
+ * its reference to the block it was stored in
+ *
+ * @param disk_name - The disk holding the file
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param block_num - The block of the file
+ * @param block_number - The block of the disk to store it in from now on. Must be in use, by
+ * mapped files only.
+ */
+void share_block(const std::string & disk_name, Super_block * super_block, int inode_index, int block_num, int block_number) {
+    Block_map * map = block_map(super_block);
+    int old_block = physical_block(super_block, inode_index, block_num);
+    map->references[block_number]++;
+    map->remap[inode_index][block_num] = block_number == super_block->inode[inode_index].start_block + block_num ? 0 : block_number;
+    if (--map->references[old_block] == 0) {
+        Disk disk;
+        open_disk(disk_name, O_RDWR, &disk);
+        write_to_block(&disk, zero_block(), old_block);
+        close_disk(&disk);
+        free_block_in_free_list(old_block, super_block);
+    }
+    map->dirty = true;
+}
+
+/**
+ * @brief Forget what is known about the content of a block, when it is allocated or freed
+ *
+ * @param super_block - The superblock of the disk
+ * @param block_number - The block
+ */
+void forget_block_contents(Super_block * super_block, int block_number) {
+    if (block_number < Standard_geometry::block_count) {
+        Block_map * map = block_map(super_block);
+        map->fingerprinted[block_number] = false;
+        map->zero[block_number] = false;
+    }
+}
+
+/**
+ * @brief Account for the blocks a mapped file grew into in place, right after its extent
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param old_size - The size of the file before it grew
+ * @param new_size - The size of the file now
+ */
+void map_grown_blocks(Super_block * super_block, int inode_index, int old_size, int new_size) {
+    Block_map * map = block_map(super_block);
+    int start_block = super_block->inode[inode_index].start_block;
+    for (int i = old_size; i < new_size; i++) {
+        map->references[start_block + i] = 1;
+        map->remap[inode_index][i] = 0;
+        map->fragment[inode_index][i] = 0;
+    }
+    map->dirty = true;
+}
+
+/**
+ * @brief Drop a mapped file's references to its blocks from the given block of the file on, when
+ * the file shrinks or is deleted. A block nothing refers to any more is cleared and freed. Dropping
+ * every block leaves the file unmapped.
+ *
+ * @param disk_name - The disk holding the file
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param first_block - The first block of the file to drop
+ */
+void release_mapped_blocks(const std::string & disk_name, Super_block * super_block, int inode_index, int first_block) {
+    Block_map * map = block_map(super_block);
+    int size = get_inode_size(super_block->inode[inode_index]);
+    Disk disk;
+    open_disk(disk_name, O_RDWR, &disk);
+    for (int i = first_block; i < size; i++) {
+        int block_number = physical_block(super_block, inode_index, i);
+        if (--map->references[block_number] == 0) {
+            write_to_block(&disk, zero_block(), block_number);
+            free_block_in_free_list(block_number, super_block);
+        }
+        map->remap[inode_index][i] = 0;
+        map->fragment[inode_index][i] = 0;
+    }
+    close_disk(&disk);
+
+    if (first_block == 0) {
+        map->mapped.bits[inode_index / 64] &= ~(1ULL << (inode_index % 64));
+        map->compressed.bits[inode_index / 64] &= ~(1ULL << (inode_index % 64));
+    }
+    map->dirty = true;
+}
+
+/**
+ * @brief Copy a mapped file into a run of free blocks of its own, so that it owns its extent again
+ * and is no longer mapped. Packed blocks of a compressed file are stored whole again. The run is
+ * allocated here.
+ *
+ * @param disk_name - The disk holding the file
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param destination_block - The first block of the run
+ * @param destination_size - The length of the run, at least the size of the file
+ */
+void move_mapped_file(const std::string & disk_name, Super_block * super_block, int inode_index, int destination_block, int destination_size) {
+    Inode * inode = &(super_block->inode[inode_index]);
+    int size = get_inode_size(*inode);
+    for (int i = 0; i < destination_size; i++) {
+        allocate_block_in_free_list(destination_block + i, super_block);
+    }
+
+    Disk disk;
+    open_disk(disk_name, O_RDWR, &disk);
+    uint8_t * extent = extent_buffer();
+    for (int i = 0; i < size; i++) {
+        read_file_block(&disk, super_block, inode_index, i, extent + (size_t) i * BLOCK_SIZE);
+    }
+    write_to_blocks(&disk, extent, destination_block, size);
+    close_disk(&disk);
+
+    release_mapped_blocks(disk_name, super_block, inode_index, 0);
+    inode->start_block = destination_block;
+    mirror_update_inode(super_block, inode);
+}
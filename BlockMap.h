@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <limits.h>
+#include <stdint.h>
+
+#include "FileSystem.h"
+#include "InodeMirror.h"
+
+// A block of a compressed file packed into a block with others is at a multiple of FRAGMENT_ALIGNMENT
+// bytes into it. Its fragment holds that multiple above its length, which takes FRAGMENT_LENGTH_BITS.
+#define FRAGMENT_ALIGNMENT 16
+#define FRAGMENT_LENGTH_BITS 10
+
+// The blocks that files share, for disks with clones. A file is mapped once it shares blocks with
+// another file: each of its blocks may then be stored outside its extent, and the blocks of mapped
+// files are reference counted. A file that is not mapped owns its extent outright, as every file
+// always has. None of this fits in the superblock, so it is kept in a file next to the disk.
+// Compressed files are mapped too, with several of their blocks packed into one (see Compression.cc).
+typedef struct {
+    bool dirty;                                                  // Changed since it was last saved
+    Inode_set mapped;
+    uint8_t references[Standard_geometry::block_count];          // Blocks of mapped files stored in each block
+    uint8_t remap[MIRROR_SLOTS][Standard_geometry::block_count]; // Where block k of a mapped file is stored, or 0 for its start block + k
+    Inode_set compressed;                                        // Mapped files that may have packed blocks; only saved if any
+    uint16_t fragment[MIRROR_SLOTS][Standard_geometry::block_count]; // Where in its block block k of a mapped file is packed, or 0 if stored whole
+
+    // Not saved: what is known about the content of blocks in use, for deduplication. Forgotten
+    // whenever a block is allocated or freed, which every change of content other than a write
+    // through fs_write() goes with.
+    bool fingerprinted[Standard_geometry::block_count];
+    bool zero[Standard_geometry::block_count];             // Holds only zeros
+    uint64_t fingerprint[Standard_geometry::block_count];
+} Block_map;
+
+Block_map * block_map(Super_block * super_block);
+void block_map_path(const std::string & disk_name, char path[PATH_MAX]);
+bool load_block_map(const std::string & disk_name, Super_block * super_block);
+void save_block_map(const std::string & disk_name, Super_block * super_block);
+bool is_mapped(Super_block * super_block, int inode_index);
+bool is_block_shared(Super_block * super_block, int block_number);
+int physical_block(Super_block * super_block, int inode_index, int block_num);
+bool can_map(Super_block * super_block, int inode_index);
+void map_file(Super_block * super_block, int inode_index);
+void map_clone(Super_block * super_block, int source_index, int clone_index);
+void remap_block(Super_block * super_block, int inode_index, int block_num, int block_number);
+void share_block(const std::string & disk_name, Super_block * super_block, int inode_index, int block_num, int block_number);
+void forget_block_contents(Super_block * super_block, int block_number);
+void map_grown_blocks(Super_block * super_block, int inode_index, int old_size, int new_size);
+void release_mapped_blocks(const std::string & disk_name, Super_block * super_block, int inode_index, int first_block);
+void move_mapped_file(const std::string & disk_name, Super_block * super_block, int inode_index, int destination_block, int destination_size);
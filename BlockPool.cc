@@ -0,0 +1,79 @@
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+
+#include "BlockPool.h"
+
+// Number of blocks carved out of each aligned allocation. Every block starts on a boundary of
+// BLOCK_ALIGNMENT, so blocks are spaced that far apart and the rest of each slot goes unused.
+#define POOL_CHUNK_BLOCKS 16
+#define POOL_SLOT_SIZE (BLOCK_SIZE > BLOCK_ALIGNMENT ? BLOCK_SIZE : BLOCK_ALIGNMENT)
+
+// Free blocks are chained through their first bytes
+typedef struct Free_block {
+    struct Free_block * next;
+} Free_block;
+
+static Free_block * free_blocks = NULL;
+static std::mutex pool_mutex;
+
+/**
+ * @brief Take a block from the pool. The block is aligned to BLOCK_ALIGNMENT and zeroed.
+ * The pool grows by a chunk of aligned blocks when it runs out; blocks are never given back
+ * to the system.
+ *
+ * @return The block. Must be handed back with release_block().
+ */
+uint8_t * acquire_block() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (free_blocks == NULL) {
+        void * chunk = NULL;
+        if (posix_memalign(&chunk, BLOCK_ALIGNMENT, (size_t) POOL_SLOT_SIZE * POOL_CHUNK_BLOCKS) != 0) {
+            abort();
+        }
+        for (int i = 0; i < POOL_CHUNK_BLOCKS; i++) {
+            Free_block * block = (Free_block *) ((uint8_t *) chunk + i * POOL_SLOT_SIZE);
+            block->next = free_blocks;
+            free_blocks = block;
+        }
+    }
+
+    uint8_t * block = (uint8_t *) free_blocks;
+    free_blocks = free_blocks->next;
+    memset(block, 0, BLOCK_SIZE);
+    return block;
+}
+
+/**
+ * @brief Give a block back to the pool
+ *
+ * @param block - A block obtained from acquire_block()
+ */
+void release_block(uint8_t * block) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    Free_block * free_block = (Free_block *) block;
+    free_block->next = free_blocks;
+    free_blocks = free_block;
+}
+
+/**
+ * @brief A shared aligned run of zeros, used to clear blocks on the disk. It is as long as the whole
+ * disk, so any range of blocks can be cleared with one write. Must not be written to.
+ *
+ * @return The zero blocks
+ */
+const uint8_t * zero_block() {
+    alignas(BLOCK_ALIGNMENT) static const uint8_t zeros[Standard_geometry::block_count * BLOCK_SIZE] = {0};
+    return zeros;
+}
+
+/**
+ * @brief A shared aligned buffer as long as the whole disk, used to move a file's blocks in one
+ * transfer. Only for use by the thread running commands, and only within a single operation.
+ *
+ * @return The extent buffer
+ */
+uint8_t * extent_buffer() {
+    alignas(BLOCK_ALIGNMENT) static uint8_t extent[Standard_geometry::block_count * BLOCK_SIZE];
+    return extent;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+// Alignment of every pooled block. Covers both 512 byte and 4 KB logical sector sizes,
+// which is what O_DIRECT needs for its buffers.
+#define BLOCK_ALIGNMENT 4096
+
+uint8_t * acquire_block();
+void release_block(uint8_t * block);
+const uint8_t * zero_block();
+uint8_t * extent_buffer();
+
+/**
+ * @brief A zeroed, aligned block borrowed from the block pool for the lifetime of the object.
+ * Used in place of stack buffers so that every buffer handed to the disk is suitably aligned.
+ */
+class Pooled_block {
+public:
+    Pooled_block() : data(acquire_block()) {}
+    ~Pooled_block() { release_block(data); }
+
+    uint8_t * const data;
+
+private:
+    Pooled_block(const Pooled_block &);
+    Pooled_block & operator=(const Pooled_block &);
+};
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+#include "BlockPool.h"
+#include "Checksum.h"
+#include "IO.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+// Constants
+#define CHECKSUMS_MAGIC "FSCS"          // Starts the checksum file of a disk
+#define CHECKSUMS_OFFSET 4              // Where the checksum of block 0 is stored in the file
+#define CRC32C_POLYNOMIAL 0x82F63B78    // Castagnoli, bit reversed
+#define SCRUB_MAX_THREADS 8
+#define SCRUB_MIN_BLOCKS_PER_THREAD 16
+
+// Whether disks mounted from now on get a checksum region if they have none
+static bool checksums_wanted = false;
+
+/**
+ * @brief Give every disk mounted from now on a checksum region, for the rest of the run. Disks that
+ * already have one keep it up to date whether or not this is on.
+ *
+ * @param enabled - True to add checksums to disks that are mounted
+ */
+void set_checksums(bool enabled) {
+    checksums_wanted = enabled;
+}
+
+/**
+ * @brief Check whether disks mounted from now on get a checksum region
+ *
+ * @return True if --checksums was given
+ */
+bool checksums_enabled() {
+    return checksums_wanted;
+}
+
+/**
+ * @brief The name of the file holding the checksums of a disk: the disk's name with ".checksums"
+ * added
+ */
+static void checksums_path(const std::string & disk_name, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%s.checksums", disk_name.c_str());
+}
+
+// The byte at a time table for the software CRC32C
+typedef struct {
+    uint32_t entries[256];
+} Crc32c_table;
+
+/**
+ * @brief Build the table of the software CRC32C, the first time it is needed
+ */
+static const Crc32c_table & crc32c_table() {
+    static const Crc32c_table table = [] {
+        Crc32c_table built;
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+            }
+            built.entries[byte] = crc;
+        }
+        return built;
+    }();
+    return table;
+}
+
+/**
+ * @brief CRC32C a byte at a time through a table, for processors without SSE4.2
+ */
+static uint32_t crc32c_software(uint32_t crc, const uint8_t * data, size_t size) {
+    const Crc32c_table & table = crc32c_table();
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief CRC32C with the SSE4.2 crc32 instruction, 8 bytes at a time. Compiled for SSE4.2 whatever
+ * the rest of the program is compiled for, so it must only be called once the processor is known
+ * to have it.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t * data, size_t size) {
+    uint64_t wide = crc;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t) wide;
+    for (; i < size; i++) {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * @brief Compute the CRC32C (Castagnoli) of some bytes, with the SSE4.2 crc32 instruction when the
+ * processor has it and a table otherwise
+ *
+ * @param data - The bytes
+ * @param size - The number of bytes
+ * @return The checksum
+ */
+uint32_t crc32c(const uint8_t * data, size_t size) {
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return ~crc32c_sse42(~0U, data, size);
+    }
+#endif
+    return ~crc32c_software(~0U, data, size);
+}
+
+/**
+ * @brief Compute the checksums of consecutive blocks
+ */
+static void checksum_blocks(const uint8_t * blocks, int count, uint32_t * crc) {
+    uint64_t started = metrics_now();
+    for (int i = 0; i < count; i++) {
+        crc[i] = crc32c(blocks + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    metrics_add(COUNTER_CHECKSUM_NS, metrics_now() - started);
+    metrics_add(COUNTER_CHECKSUM_BYTES, (uint64_t) count * BLOCK_SIZE);
+}
+
+/**
+ * @brief Read the checksum region of a disk, the first time the disk is opened in a run. Its file
+ * is kept open so that the checksums of blocks written can be stored as they change.
+ *
+ * @param disk_name - The name of the disk
+ * @return The disk's checksums, or NULL if the disk has no checksum region
+ */
+Block_checksums * load_block_checksums(const std::string & disk_name) {
+    char path[PATH_MAX];
+    checksums_path(disk_name, path);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            std::cerr << "Error: Opening checksums of " << disk_name << std::endl;
+        }
+        return NULL;
+    }
+
+    Block_checksums * checksums = new Block_checksums;
+    char magic[4];
+    if (pread(fd, magic, 4, 0) != 4 || memcmp(magic, CHECKSUMS_MAGIC, 4) != 0 ||
+        pread(fd, checksums->crc, sizeof(checksums->crc), CHECKSUMS_OFFSET) != (ssize_t) sizeof(checksums->crc)) {
+        std::cerr << "Error: Reading checksums of " << disk_name << std::endl;
+        close(fd);
+        delete checksums;
+        return NULL;
+    }
+    checksums->fd = fd;
+    return checksums;
+}
+
+/**
+ * @brief Give a disk a checksum region, computed from its current content
+ *
+ * @param disk_name - The name of the disk
+ * @param blocks - Every block of the disk
+ * @param count - The number of blocks of the disk
+ * @return The disk's new checksums, or NULL if they could not be stored
+ */
+Block_checksums * create_block_checksums(const std::string & disk_name, const uint8_t * blocks, int count) {
+    char path[PATH_MAX];
+    checksums_path(disk_name, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Creating checksums of " << disk_name << std::endl;
+        return NULL;
+    }
+
+    Block_checksums * checksums = new Block_checksums;
+    memset(checksums->crc, 0, sizeof(checksums->crc));
+    checksum_blocks(blocks, std::min(count, Standard_geometry::block_count), checksums->crc);
+    if (pwrite(fd, CHECKSUMS_MAGIC, 4, 0) != 4 ||
+        pwrite(fd, checksums->crc, sizeof(checksums->crc), CHECKSUMS_OFFSET) != (ssize_t) sizeof(checksums->crc)) {
+        std::cerr << "Error: Writing checksums of " << disk_name << std::endl;
+        close(fd);
+        unlink(path);
+        delete checksums;
+        return NULL;
+    }
+    checksums->fd = fd;
+    return checksums;
+}
+
+/**
+ * @brief Store the checksums of blocks just written to a disk, in memory and in the checksum file
+ * with a single write
+ *
+ * @param checksums - The disk's checksums
+ * @param buff - The blocks written
+ * @param block_number - The first block written
+ * @param count - The number of blocks written
+ */
+void update_block_checksums(Block_checksums * checksums, const uint8_t * buff, int block_number, int count) {
+    count = std::min(count, Standard_geometry::block_count - block_number);
+    if (count <= 0) {
+        return;
+    }
+    checksum_blocks(buff, count, &checksums->crc[block_number]);
+    off_t offset = CHECKSUMS_OFFSET + (off_t) sizeof(uint32_t) * block_number;
+    if (pwrite(checksums->fd, &checksums->crc[block_number], sizeof(uint32_t) * count, offset) != (ssize_t) (sizeof(uint32_t) * count)) {
+        std::cerr << "Error: Writing checksums of blocks to disk\n";
+    }
+}
+
+/**
+ * @brief Check blocks just read from a disk against their checksums
+ *
+ * @param checksums - The disk's checksums
+ * @param buff - The blocks read
+ * @param block_number - The first block read
+ * @param count - The number of blocks read
+ * @param failed - Indexed by block number. Set for every block that does not match its checksum;
+ * left alone for the others.
+ * @return The number of blocks that do not match their checksums
+ */
+int verify_block_checksums(const Block_checksums * checksums, const uint8_t * buff, int block_number, int count, bool * failed) {
+    count = std::min(count, Standard_geometry::block_count - block_number);
+    uint32_t crc[Standard_geometry::block_count];
+    if (count <= 0) {
+        return 0;
+    }
+    checksum_blocks(buff, count, crc);
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        if (crc[i] != checksums->crc[block_number + i]) {
+            failed[block_number + i] = true;
+            failures++;
+        }
+    }
+    metrics_add(COUNTER_CHECKSUM_ERRORS, failures);
+    return failures;
+}
+
+/**
+ * @brief Verify every block of a disk against its checksum. The disk is split into ranges that are
+ * read and verified by several threads at once, each with its own handle on the disk. The blocks
+ * are read into the extent buffer, which the thread running commands waits on meanwhile.
+ *
+ * @param disk_name - The disk
+ * @param failed - Set for every block that does not match its checksum, cleared for the others
+ * @return The number of blocks verified, or -1 if the disk has no checksum region
+ */
+int scrub_disk(const std::string & disk_name, bool failed[Standard_geometry::block_count]) {
+    Trace_span span("scrub");
+    Disk disk;
+    open_disk(disk_name, O_RDONLY, &disk);
+    const Block_checksums * checksums = disk.checksums;
+    int block_count = std::min(count_disk_blocks(&disk), Standard_geometry::block_count);
+    close_disk(&disk);
+    if (checksums == NULL) {
+        return -1;
+    }
+
+    memset(failed, 0, Standard_geometry::block_count * sizeof(bool));
+    int hardware_threads = std::max(1, (int) std::thread::hardware_concurrency());
+    int thread_count = std::max(1, std::min(std::min(hardware_threads, SCRUB_MAX_THREADS), block_count / SCRUB_MIN_BLOCKS_PER_THREAD));
+    uint8_t * blocks = extent_buffer();
+
+    // Each thread verifies its own range, so they only ever write their own entries of failed
+    auto scrub_range = [&](int first_block, int count) {
+        Disk range_disk;
+        if (!open_disk(disk_name, O_RDONLY, &range_disk)) {
+            std::fill(failed + first_block, failed + first_block + count, true);
+            return;
+        }
+        // Read without verifying on the way, so that every failure is reported here
+        range_disk.checksums = NULL;
+        read_from_blocks(&range_disk, blocks + (size_t) first_block * BLOCK_SIZE, first_block, count);
+        close_disk(&range_disk);
+        verify_block_checksums(checksums, blocks + (size_t) first_block * BLOCK_SIZE, first_block, count, failed);
+    };
+
+    std::thread threads[SCRUB_MAX_THREADS];
+    int range_size = (block_count + thread_count - 1) / thread_count;
+    for (int i = 1; i < thread_count; i++) {
+        int first_block = i * range_size;
+        int count = std::min(range_size, block_count - first_block);
+        if (count > 0) {
+            threads[i] = std::thread(scrub_range, first_block, count);
+        }
+    }
+    scrub_range(0, std::min(range_size, block_count));
+    for (int i = 1; i < thread_count; i++) {
+        if (threads[i].joinable()) {
+            threads[i].join();
+        }
+    }
+    return block_count;
+}
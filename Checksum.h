@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+// The checksum region of a disk: the CRC32C of every block, kept in a file next to the disk since
+// the superblock has no room for it. Loaded once per run and updated with every block written.
+typedef struct {
+    int fd;                                         // The checksum file, open for the whole run
+    uint32_t crc[Standard_geometry::block_count];
+} Block_checksums;
+
+void set_checksums(bool enabled);
+bool checksums_enabled();
+uint32_t crc32c(const uint8_t * data, size_t size);
+Block_checksums * load_block_checksums(const std::string & disk_name);
+Block_checksums * create_block_checksums(const std::string & disk_name, const uint8_t * blocks, int count);
+void update_block_checksums(Block_checksums * checksums, const uint8_t * buff, int block_number, int count);
+int verify_block_checksums(const Block_checksums * checksums, const uint8_t * buff, int block_number, int count, bool * failed);
+int scrub_disk(const std::string & disk_name, bool failed[Standard_geometry::block_count]);
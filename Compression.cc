@@ -0,0 +1,406 @@
+#include <iostream>
+#include <fcntl.h>
+#include <string.h>
+
+#include "BlockMap.h"
+#include "BlockPool.h"
+#include "Compression.h"
+#include "Engine.h"
+#include "FreeSpace.h"
+#include "Headroom.h"
+#include "InodeHelper.h"
+#include "InodeMirror.h"
+#include "Metrics.h"
+
+// Constants
+#define MIN_MATCH 4                                     // Shortest repeat worth a back reference
+#define MATCH_HASH_BITS 10                              // Positions remembered while compressing a block
+#define MAX_FRAGMENT_LENGTH (BLOCK_SIZE - BLOCK_SIZE / 8) // A block that compresses worse is stored whole
+
+/**
+ * @brief Read 4 bytes of a block as one word
+ */
+static inline uint32_t load_word(const uint8_t * p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/**
+ * @brief Append the part of a length that does not fit in the 4 bits of a token: bytes of 255
+ * while more follows, then the rest
+ */
+static bool put_length(uint8_t * out, int * used, int capacity, int length) {
+    for (; length >= 255; length -= 255) {
+        if (*used >= capacity) {
+            return false;
+        }
+        out[(*used)++] = 255;
+    }
+    if (*used >= capacity) {
+        return false;
+    }
+    out[(*used)++] = length;
+    return true;
+}
+
+/**
+ * @brief Append a sequence to a compressed block: a token with the lengths of its literals and of
+ * its match, the literals, and the offset back to the match. The last sequence of a block has only
+ * literals, and no offset.
+ */
+static bool put_sequence(uint8_t * out, int * used, int capacity, const uint8_t * literals, int literal_length, int offset, int match_length) {
+    if (*used >= capacity) {
+        return false;
+    }
+    uint8_t * token = &out[(*used)++];
+    int match_code = match_length > 0 ? match_length - MIN_MATCH : 0;
+    *token = (literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (literal_length >= 15 && !put_length(out, used, capacity, literal_length - 15)) {
+        return false;
+    }
+    if (*used + literal_length > capacity) {
+        return false;
+    }
+    memcpy(out + *used, literals, literal_length);
+    *used += literal_length;
+    if (match_length == 0) {
+        return true;
+    }
+
+    if (*used + 2 > capacity) {
+        return false;
+    }
+    out[(*used)++] = offset & 0xFF;
+    out[(*used)++] = offset >> 8;
+    return match_code < 15 || put_length(out, used, capacity, match_code - 15);
+}
+
+/**
+ * @brief Compress a block with a small LZ77 coder. Repeats of at least 4 bytes are found through a
+ * hash of the 4 bytes at every position, and replaced by how far back they are and how long.
+ *
+ * @param block - The block to compress
+ * @param out - Where the compressed block is written
+ * @param capacity - The most that may be written to out
+ * @return The length of the compressed block, or -1 if it does not fit in capacity
+ */
+int compress_block(const uint8_t block[BLOCK_SIZE], uint8_t * out, int capacity) {
+    uint16_t last_seen[1 << MATCH_HASH_BITS];  // Position + 1 of the last 4 bytes with each hash, 0 for none
+    memset(last_seen, 0, sizeof(last_seen));
+    int used = 0;
+    int anchor = 0;  // Start of the literals not written yet
+    int position = 0;
+    while (position + MIN_MATCH <= BLOCK_SIZE) {
+        uint32_t word = load_word(block + position);
+        uint32_t hash = (word * 2654435761U) >> (32 - MATCH_HASH_BITS);
+        int candidate = last_seen[hash] - 1;
+        last_seen[hash] = position + 1;
+        if (candidate < 0 || load_word(block + candidate) != word) {
+            position++;
+            continue;
+        }
+
+        int length = MIN_MATCH;
+        while (position + length < BLOCK_SIZE && block[candidate + length] == block[position + length]) {
+            length++;
+        }
+        if (!put_sequence(out, &used, capacity, block + anchor, position - anchor, position - candidate, length)) {
+            return -1;
+        }
+        position += length;
+        anchor = position;
+    }
+    if (anchor < BLOCK_SIZE && !put_sequence(out, &used, capacity, block + anchor, BLOCK_SIZE - anchor, 0, 0)) {
+        return -1;
+    }
+    return used;
+}
+
+/**
+ * @brief Read a length past the 4 bits of a token, as written by put_length()
+ */
+static bool get_length(const uint8_t * in, int length, int * position, int * value) {
+    while (true) {
+        if (*position >= length) {
+            return false;
+        }
+        uint8_t byte = in[(*position)++];
+        *value += byte;
+        if (byte != 255) {
+            return true;
+        }
+        if (*value > BLOCK_SIZE) {
+            return false;
+        }
+    }
+}
+
+/**
+ * @brief Decompress a block compressed with compress_block(). Damaged input is detected rather
+ * than read or written out of bounds.
+ *
+ * @param in - The compressed block
+ * @param length - The length of the compressed block
+ * @param block - Set to the block
+ * @return False if the input is not a whole compressed block
+ */
+bool decompress_block(const uint8_t * in, int length, uint8_t block[BLOCK_SIZE]) {
+    int position = 0;
+    int written = 0;
+    while (position < length) {
+        uint8_t token = in[position++];
+        int literal_length = token >> 4;
+        if (literal_length == 15 && !get_length(in, length, &position, &literal_length)) {
+            return false;
+        }
+        if (position + literal_length > length || written + literal_length > BLOCK_SIZE) {
+            return false;
+        }
+        memcpy(block + written, in + position, literal_length);
+        position += literal_length;
+        written += literal_length;
+        if (written == BLOCK_SIZE) {
+            return position == length;
+        }
+
+        if (position + 2 > length) {
+            return false;
+        }
+        int offset = in[position] | in[position + 1] << 8;
+        position += 2;
+        int match_length = token & 15;
+        if (match_length == 15 && !get_length(in, length, &position, &match_length)) {
+            return false;
+        }
+        match_length += MIN_MATCH;
+        if (offset == 0 || offset > written || written + match_length > BLOCK_SIZE) {
+            return false;
+        }
+        // The match may overlap what it produces, so it is copied a byte at a time
+        for (int i = 0; i < match_length; i++, written++) {
+            block[written] = block[written - offset];
+        }
+        if (written == BLOCK_SIZE) {
+            return position == length;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Check whether a file was compressed with Z and may have packed blocks
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @return True if the file is compressed
+ */
+bool is_compressed(Super_block * super_block, int inode_index) {
+    return is_in_set(block_map(super_block)->compressed, inode_index);
+}
+
+/**
+ * @brief Read a block of a file, wherever it is stored: a packed block of a compressed file is
+ * decompressed out of the block it shares with others.
+ *
+ * @param disk - The disk holding the file, opened
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param block_num - The block of the file
+ * @param buff - Set to the content of the block
+ * @return False if a packed block could not be decompressed, with an error printed
+ */
+bool read_file_block(Disk * disk, Super_block * super_block, int inode_index, int block_num, uint8_t buff[BLOCK_SIZE]) {
+    int block_number = physical_block(super_block, inode_index, block_num);
+    uint16_t fragment = is_mapped(super_block, inode_index) ? block_map(super_block)->fragment[inode_index][block_num] : 0;
+    if (fragment == 0) {
+        read_from_block(disk, buff, block_number);
+        return true;
+    }
+
+    Pooled_block packed;
+    read_from_block(disk, packed.data, block_number);
+    uint64_t started = metrics_now();
+    int offset = (fragment >> FRAGMENT_LENGTH_BITS) * FRAGMENT_ALIGNMENT;
+    int length = fragment & ((1 << FRAGMENT_LENGTH_BITS) - 1);
+    bool decompressed = offset + length <= BLOCK_SIZE && decompress_block(packed.data + offset, length, buff);
+    metrics_add(COUNTER_DECOMPRESSION_NS, metrics_now() - started);
+    metrics_add(COUNTER_COMPRESSED_READS, 1);
+    if (!decompressed) {
+        const char * name = super_block->inode[inode_index].name;
+        std::cerr << "Error: Block " << block_num << " of " << std::string(name, strnlen(name, 5));
+        std::cerr << " is damaged and cannot be decompressed\n";
+        memset(buff, 0, BLOCK_SIZE);
+    }
+    return decompressed;
+}
+
+/**
+ * @brief Mark a packed block of a compressed file as stored whole, because it is about to be
+ * written. A written block is not compressed again until the next Z.
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param block_num - The block of the file
+ * @return Where the block was packed, to undo this with repack_block() if the write fails; 0 if
+ * it was stored whole already
+ */
+uint16_t store_block_whole(Super_block * super_block, int inode_index, int block_num) {
+    Block_map * map = block_map(super_block);
+    uint16_t fragment = is_in_set(map->compressed, inode_index) ? map->fragment[inode_index][block_num] : 0;
+    if (fragment != 0) {
+        map->fragment[inode_index][block_num] = 0;
+        map->dirty = true;
+        metrics_add(COUNTER_COMPRESSED_WRITES, 1);
+    }
+    return fragment;
+}
+
+/**
+ * @brief Put back where a block is packed, after store_block_whole() for a write that failed
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param block_num - The block of the file
+ * @param fragment - What store_block_whole() returned
+ */
+void repack_block(Super_block * super_block, int inode_index, int block_num, uint16_t fragment) {
+    block_map(super_block)->fragment[inode_index][block_num] = fragment;
+}
+
+/**
+ * @brief The buffer that the packed blocks of a file are assembled in
+ */
+static uint8_t * packing_buffer() {
+    alignas(BLOCK_ALIGNMENT) static uint8_t packed[Standard_geometry::block_count * BLOCK_SIZE];
+    return packed;
+}
+
+/**
+ * @brief Compress a file. Every block is compressed on its own, and the blocks that shrink enough
+ * are packed, in order, into as few blocks as they fit in, each at a multiple of 16 bytes. Blocks
+ * that do not shrink enough are stored whole. The file becomes a mapped file whose blocks are
+ * stored in the new blocks, and the blocks it held before are released. A file that would not take
+ * fewer blocks is left as it is.
+ *
+ * @param disk_name - The disk holding the file
+ * @param super_block - The superblock holding the file
+ * @param disk_geometry - The engine for the disk
+ * @param inode_index - The file's inode
+ * @param report - Set to how many blocks the file takes before and after
+ * @return False if the file could not be compressed, with an error printed
+ */
+bool compress_file(const std::string & disk_name, Super_block * super_block, const Geometry_engine * disk_geometry, int inode_index, Compression_report * report) {
+    Block_map * map = block_map(super_block);
+    Inode * inode = &(super_block->inode[inode_index]);
+    int size = get_inode_size(*inode);
+    bool mapped = is_mapped(super_block, inode_index);
+
+    // What the file stores in each block of the disk now, and how many of those blocks it alone uses
+    uint8_t stored_here[Standard_geometry::block_count] = {0};
+    report->size = size;
+    report->blocks_before = 0;
+    report->blocks_freed = 0;
+    int releasable = 0;
+    for (int k = 0; k < size; k++) {
+        int block_number = physical_block(super_block, inode_index, k);
+        if (stored_here[block_number]++ == 0) {
+            report->blocks_before++;
+        }
+    }
+    for (int b = 1; b < Standard_geometry::block_count; b++) {
+        if (stored_here[b] > 0 && (!mapped || map->references[b] == stored_here[b])) {
+            releasable++;
+        }
+    }
+
+    uint8_t * extent = extent_buffer();
+    Disk disk;
+    open_disk(disk_name, O_RDWR, &disk);
+    for (int k = 0; k < size; k++) {
+        if (!read_file_block(&disk, super_block, inode_index, k, extent + (size_t) k * BLOCK_SIZE)) {
+            close_disk(&disk);
+            return false;
+        }
+    }
+
+    // Where each block of the file goes: which of the new blocks, and where in it if packed
+    uint8_t slot[Standard_geometry::block_count];
+    uint16_t fragment[Standard_geometry::block_count];
+    uint8_t * packed = packing_buffer();
+    int block_count = 0;
+    int open_pack = -1;  // The new block being packed
+    int pack_used = 0;
+    uint64_t started = metrics_now();
+    for (int k = 0; k < size; k++) {
+        const uint8_t * data = extent + (size_t) k * BLOCK_SIZE;
+        uint8_t compressed[BLOCK_SIZE];
+        int length = compress_block(data, compressed, MAX_FRAGMENT_LENGTH);
+        if (length < 0) {
+            memcpy(packed + (size_t) block_count * BLOCK_SIZE, data, BLOCK_SIZE);
+            slot[k] = block_count++;
+            fragment[k] = 0;
+            continue;
+        }
+        int offset = (pack_used + FRAGMENT_ALIGNMENT - 1) / FRAGMENT_ALIGNMENT * FRAGMENT_ALIGNMENT;
+        if (open_pack < 0 || offset + length > BLOCK_SIZE) {
+            open_pack = block_count++;
+            memset(packed + (size_t) open_pack * BLOCK_SIZE, 0, BLOCK_SIZE);
+            offset = 0;
+        }
+        memcpy(packed + (size_t) open_pack * BLOCK_SIZE + offset, compressed, length);
+        pack_used = offset + length;
+        slot[k] = open_pack;
+        fragment[k] = (offset / FRAGMENT_ALIGNMENT) << FRAGMENT_LENGTH_BITS | length;
+    }
+    metrics_add(COUNTER_COMPRESSION_NS, metrics_now() - started);
+
+    report->blocks_after = report->blocks_before;
+    if (block_count >= report->blocks_before) {
+        close_disk(&disk);
+        return true;
+    }
+    int free_before = free_space_summary(super_block).free_blocks;
+    if (block_count > free_before + releasable) {
+        std::cerr << "Error: Cannot allocate " << block_count << " on " << disk_name << std::endl;
+        close_disk(&disk);
+        return false;
+    }
+
+    // The file's blocks are in memory, so its old blocks can go before the new ones are taken
+    drop_headroom(super_block, inode_index);
+    map_file(super_block, inode_index);
+    release_mapped_blocks(disk_name, super_block, inode_index, 0);
+
+    uint8_t new_blocks[Standard_geometry::block_count];
+    int first_block = find_unreserved_run(super_block, disk_geometry, block_count, 1, disk_geometry->block_count);
+    if (first_block >= 0) {
+        for (int j = 0; j < block_count; j++) {
+            new_blocks[j] = first_block + j;
+            allocate_block_in_free_list(first_block + j, super_block);
+        }
+        write_to_blocks(&disk, packed, first_block, block_count);
+    } else {
+        for (int j = 0; j < block_count; j++) {
+            new_blocks[j] = find_unreserved_run(super_block, disk_geometry, 1, 1, disk_geometry->block_count);
+            allocate_block_in_free_list(new_blocks[j], super_block);
+            write_to_block(&disk, packed + (size_t) j * BLOCK_SIZE, new_blocks[j]);
+        }
+    }
+    close_disk(&disk);
+
+    map->mapped.bits[inode_index / 64] |= 1ULL << (inode_index % 64);
+    map->compressed.bits[inode_index / 64] |= 1ULL << (inode_index % 64);
+    for (int k = 0; k < size; k++) {
+        int block_number = new_blocks[slot[k]];
+        map->references[block_number]++;
+        map->remap[inode_index][k] = block_number == inode->start_block + k ? 0 : block_number;
+        map->fragment[inode_index][k] = fragment[k];
+    }
+    map->dirty = true;
+
+    report->blocks_after = block_count;
+    report->blocks_freed = free_space_summary(super_block).free_blocks - free_before;
+    metrics_add(COUNTER_COMPRESSION_BLOCKS_SAVED, report->blocks_freed > 0 ? report->blocks_freed : 0);
+    return true;
+}
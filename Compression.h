@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#include "FileSystem.h"
+#include "IO.h"
+
+// What compressing a file changed
+typedef struct {
+    int size;           // Blocks of the file
+    int blocks_before;  // Blocks of the disk its blocks were stored in
+    int blocks_after;   // Blocks of the disk they are stored in now
+    int blocks_freed;   // Blocks of the disk that became free
+} Compression_report;
+
+int compress_block(const uint8_t block[BLOCK_SIZE], uint8_t * out, int capacity);
+bool decompress_block(const uint8_t * in, int length, uint8_t block[BLOCK_SIZE]);
+bool is_compressed(Super_block * super_block, int inode_index);
+bool read_file_block(Disk * disk, Super_block * super_block, int inode_index, int block_num, uint8_t buff[BLOCK_SIZE]);
+uint16_t store_block_whole(Super_block * super_block, int inode_index, int block_num);
+void repack_block(Super_block * super_block, int inode_index, int block_num, uint16_t fragment);
+bool compress_file(const std::string & disk_name, Super_block * super_block, const Geometry_engine * disk_geometry, int inode_index, Compression_report * report);
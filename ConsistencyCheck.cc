@@ -1,53 +1,82 @@
-#include <set>
-#include <vector>
-#include <map>
-#include <algorithm>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "BlockMap.h"
+#include "Checksum.h"
 #include "IO.h"
 #include "InodeHelper.h"
+#include "InodeMirror.h"
 #include "ConsistencyCheck.h"
 
+// Starts the clean marker of a disk
+#define CLEAN_MARKER_MAGIC "FSCL"
+
+// What a disk looked like when it last passed its checks. The checks only look at the superblock
+// and the block map, so a disk whose superblock and block map are the same passes them again.
+typedef struct {
+    char magic[4];
+    int32_t block_count;
+    uint32_t super_block_crc;
+    uint32_t block_map_crc;
+} Clean_marker;
+
 
 /**
  * @brief Performs the first consistency check. Blocks that are marked free in the free-space list
  * cannot be allocated to any file. Similarly, blocks marked in use in the free-space list must be
- * allocated to exactly one file.
+ * allocated to exactly one file. A block that mapped files share (see BlockMap.cc) must be used by
+ * as many file blocks as its reference count says, all of them of mapped files, and a block of a
+ * compressed file packed into it must lie within it.
  *
  * @param super_block - The super_block to check
  * @return True if the consistency check passes. False otherwise
  */
-bool consistency_check_1(Super_block * super_block) {
-    std::set<int> free_blocks;
-    std::set<int> used_blocks;
-
-    int block_number = 1;
-    while (block_number < 128) {
-        if (is_block_free(block_number, super_block)) {
-            free_blocks.insert(block_number);
-        } else {
-            used_blocks.insert(block_number);
-        }
-
-        block_number++;
-    }
+template <typename G>
+static bool consistency_check_1(Super_block * super_block) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    const Block_map * map = block_map(super_block);
+    // How many files that own their extent claim each block. Only whether it is 0, 1 or more matters.
+    uint8_t owners[Standard_geometry::block_count] = {0};
+    // How many blocks of mapped files are stored in each block
+    int references[Standard_geometry::block_count] = {0};
 
-    std::vector<int> inode_used_blocks;
-    for (int i = 0; i < 126; i ++) {
-        Inode inode = super_block->inode[i];
-        if (is_inode_used(inode)) {
-            int fileSize = get_inode_size(inode);
-            for (int j = inode.start_block; j < inode.start_block + fileSize; j++) {
-                if (free_blocks.find(j) != free_blocks.end()) {
+    for (int i = next_inode(mirror->used, 0); i >= 0 && i < G::inode_count; i = next_inode(mirror->used, i + 1)) {
+        int start_block = mirror->start[i];
+        bool mapped = is_in_set(map->mapped, i);
+        for (int k = 0; k < mirror->size[i]; k++) {
+            int j = mapped ? physical_block(super_block, i, k) : start_block + k;
+            if (j >= G::block_count) {
+                if (mapped) {
                     return false;
                 }
-                inode_used_blocks.push_back(j);
+                continue;
+            }
+            if (j >= 1 && is_block_free(j, super_block)) {
+                return false;
+            }
+            // A packed block must lie within the block it is packed in
+            uint16_t fragment = mapped ? map->fragment[i][k] : 0;
+            if (fragment != 0 && (fragment >> FRAGMENT_LENGTH_BITS) * FRAGMENT_ALIGNMENT + (fragment & ((1 << FRAGMENT_LENGTH_BITS) - 1)) > BLOCK_SIZE) {
+                return false;
+            }
+            if (mapped) {
+                references[j]++;
+            } else if (owners[j] < 2) {
+                owners[j]++;
             }
         }
     }
 
-    for (auto f: used_blocks) {
-        if ( f != 0 && std::count(inode_used_blocks.begin(), inode_used_blocks.end(), f) != 1) {
+    for (int block_number = 1; block_number < G::block_count; block_number++) {
+        if (is_block_free(block_number, super_block)) {
+            continue;
+        }
+        bool owned = owners[block_number] == 1 && references[block_number] == 0;
+        bool shared = owners[block_number] == 0 && references[block_number] > 0 && references[block_number] == map->references[block_number];
+        if (!owned && !shared) {
             return false;
         }
     }
@@ -62,28 +91,22 @@ bool consistency_check_1(Super_block * super_block) {
  * @param super_block - The super_block to check
  * @return True if the consistency check passes. False otherwise
  */
-bool consistency_check_2(Super_block * super_block) {
-    // Maps directories to the files/directories within them
-    std::map<uint8_t, std::vector<Inode>> directory;
+template <typename G>
+static bool consistency_check_2(Super_block * super_block) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    // The name key of the first named file/directory found in each directory, by the index of the directory
+    bool directory_seen[ROOT + 1] = {false};
+    uint64_t first_in_directory[ROOT + 1];
 
-    for (int i = 0; i < 126; i++) {
-        Inode inode = super_block->inode[i];
-        uint8_t parent_dir = get_parent_dir(inode);
-
-        if (is_name_set(inode)) {
-            auto it = directory.find(parent_dir);
-            if (it != directory.end()) {
-                std::vector<Inode> directoryContents = it->second;
-                for (size_t i = 0; i < directoryContents.size(); i++) {
-                    if (strncmp(directoryContents[0].name, inode.name, 5) == 0) {
-                        return false;
-                    }
-                }
-                directoryContents.push_back(inode);
-            } else {
-                std::vector<Inode> directoryContents;
-                directoryContents.push_back(inode);
-                directory.insert({parent_dir, directoryContents});
+    for (int i = 0; i < G::inode_count; i++) {
+        uint8_t parent_dir = mirror->parent[i];
+
+        if (is_name_set(super_block->inode[i])) {
+            if (!directory_seen[parent_dir]) {
+                directory_seen[parent_dir] = true;
+                first_in_directory[parent_dir] = mirror->name_key[i];
+            } else if (first_in_directory[parent_dir] == mirror->name_key[i]) {
+                return false;
             }
         }
     }
@@ -98,8 +121,9 @@ bool consistency_check_2(Super_block * super_block) {
  * @param super_block - The super_block to check
  * @return True if the consistency check passes. False otherwise
  */
-bool consistency_check_3(Super_block * super_block) {
-    for (int i = 0; i < 126; i++) {
+template <typename G>
+static bool consistency_check_3(Super_block * super_block) {
+    for (int i = 0; i < G::inode_count; i++) {
         Inode inode = super_block->inode[i];
 
         if (is_inode_used(inode)) {
@@ -125,15 +149,16 @@ bool consistency_check_3(Super_block * super_block) {
 
 /**
  * @brief Performs the fourth consistency check. The start block of every inode that is marked as a
- * file must have a value between 1 and 127 inclusive.
+ * file must have a value between 1 and the last block of the disk (127) inclusive.
  *
  * @param super_block - The super_block to check
  * @return True if the consistency check passes. False otherwise.
  */
-bool consistency_check_4(Super_block * super_block) {
-    for (int i = 0; i < 126; i++) {
-        Inode inode = super_block->inode[i];
-        if (is_inode_used(inode) && !is_inode_dir(inode) && (inode.start_block < 1 || inode.start_block > 127)) {
+template <typename G>
+static bool consistency_check_4(Super_block * super_block) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    for (int i = next_inode(mirror->used, 0); i >= 0 && i < G::inode_count; i = next_inode(mirror->used, i + 1)) {
+        if (!is_in_set(mirror->directories, i) && (mirror->start[i] < 1 || mirror->start[i] > G::block_count - 1)) {
             return false;
         }
     }
@@ -147,10 +172,11 @@ bool consistency_check_4(Super_block * super_block) {
  * @param super_block - The super_block to check
  * @return True if the consistency check passes. False otherwise.
  */
-bool consistency_check_5(Super_block * super_block) {
-    for (int i = 0; i < 126; i++) {
-        Inode inode = super_block->inode[i];
-        if (is_inode_used(inode) && is_inode_dir(inode) && (inode.start_block != 0 || get_inode_size(inode) != 0)) {
+template <typename G>
+static bool consistency_check_5(Super_block * super_block) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    for (int i = next_inode(mirror->directories, 0); i >= 0 && i < G::inode_count; i = next_inode(mirror->directories, i + 1)) {
+        if (mirror->start[i] != 0 || mirror->size[i] != 0) {
             return false;
         }
     }
@@ -159,25 +185,22 @@ bool consistency_check_5(Super_block * super_block) {
 
 /**
  * @brief Performs the sixth consistency check. For every inode, the index of its
- * parent inode cannot be 126. Moreover, if the index of the parent inode is between
- * 0 and 125 inclusive, then the parent inode must be in use and marked as a directory.
+ * parent inode cannot be the inode count (126). Moreover, if the index of the parent inode is
+ * a valid inode index, then the parent inode must be in use and marked as a directory.
  *
  * @param super_block - The super_block to check
  * @return True if the consistency check passes. False otherwise.
  */
-bool consistency_check_6(Super_block * super_block) {
-    for (int i = 0; i < 126; i++) {
-        Inode inode = super_block->inode[i];
-        if (is_inode_used(inode)) {
-            uint8_t parent_dir = get_parent_dir(inode);
-            if (parent_dir == 126) {
-                return false;
-            } else if (parent_dir >= 0 && parent_dir <= 125) {
-                Inode parent_inode = super_block->inode[parent_dir];
-                if (!is_inode_used(parent_inode) || !is_inode_dir(parent_inode)) {
-                    return false;
-                }
-            }
+template <typename G>
+static bool consistency_check_6(Super_block * super_block) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    for (int i = next_inode(mirror->used, 0); i >= 0 && i < G::inode_count; i = next_inode(mirror->used, i + 1)) {
+        uint8_t parent_dir = mirror->parent[i];
+        if (parent_dir == G::inode_count) {
+            return false;
+        } else if (parent_dir < G::inode_count && !is_in_set(mirror->directories, parent_dir)) {
+            // The parent inode must be in use and marked as a directory
+            return false;
         }
     }
     return true;
@@ -185,27 +208,106 @@ bool consistency_check_6(Super_block * super_block) {
 
 /**
  * @brief Checks if the provided super_block is consistent. Performs 6 different
- * checks. Returns the error code of the check that failed.
+ * checks. Returns the error code of the check that failed. Instantiated for each
+ * supported geometry G, so that every loop has a constant bound.
  *
  * @param super_block - The super_block to check
  * @return The error code of the check that failed
  */
+template <typename G>
 int check_consistency(Super_block * super_block) {
     int errorCode = 0;
 
-    if (!consistency_check_1(super_block)) {
+    if (!consistency_check_1<G>(super_block)) {
         errorCode = 1;
-    } else if (!consistency_check_2(super_block)) {
+    } else if (!consistency_check_2<G>(super_block)) {
         errorCode = 2;
-    } else if (!consistency_check_3(super_block)) {
+    } else if (!consistency_check_3<G>(super_block)) {
         errorCode = 3;
-    } else if (!consistency_check_4(super_block)) {
+    } else if (!consistency_check_4<G>(super_block)) {
         errorCode = 4;
-    } else if (!consistency_check_5(super_block)) {
+    } else if (!consistency_check_5<G>(super_block)) {
         errorCode = 5;
-    } else if (!consistency_check_6(super_block)) {
+    } else if (!consistency_check_6<G>(super_block)) {
         errorCode = 6;
     }
 
     return errorCode;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Describe a loaded disk for its clean marker
+ */
+static void describe_disk(Super_block * super_block, int block_count, Clean_marker * marker) {
+    const Block_map * map = block_map(super_block);
+    memcpy(marker->magic, CLEAN_MARKER_MAGIC, 4);
+    marker->block_count = block_count;
+    marker->super_block_crc = crc32c((const uint8_t *) super_block, BLOCK_SIZE);
+    marker->block_map_crc = crc32c((const uint8_t *) map->mapped.bits, sizeof(map->mapped.bits)) ^
+                            crc32c(map->references, sizeof(map->references)) ^
+                            crc32c((const uint8_t *) map->remap, sizeof(map->remap)) ^
+                            crc32c((const uint8_t *) map->fragment, sizeof(map->fragment));
+}
+
+/**
+ * @brief The name of the file holding the clean marker of a disk: the disk's name with ".clean" added
+ */
+static void clean_marker_path(const std::string & disk_name, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%s.clean", disk_name.c_str());
+}
+
+/**
+ * @brief Check whether a loaded disk is the same as when it last passed the consistency checks, so
+ * that they can be skipped
+ *
+ * @param disk_name - The name of the disk
+ * @param super_block - The disk's superblock, with its block map loaded
+ * @param block_count - The number of blocks of the disk
+ * @return True if the disk has a clean marker that matches it
+ */
+bool is_marked_clean(const std::string & disk_name, Super_block * super_block, int block_count) {
+    char path[PATH_MAX];
+    clean_marker_path(disk_name, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    Clean_marker stored;
+    bool read_whole = read(fd, &stored, sizeof(stored)) == (ssize_t) sizeof(stored);
+    close(fd);
+
+    Clean_marker current;
+    describe_disk(super_block, block_count, &current);
+    return read_whole && memcmp(&stored, &current, sizeof(current)) == 0;
+}
+
+/**
+ * @brief Record that a loaded disk passed the consistency checks. The marker is written to a
+ * temporary file first and renamed into place, so that processes mounting the disk at the same
+ * time never see half of one.
+ *
+ * @param disk_name - The name of the disk
+ * @param super_block - The disk's superblock, with its block map loaded
+ * @param block_count - The number of blocks of the disk
+ */
+void mark_clean(const std::string & disk_name, Super_block * super_block, int block_count) {
+    Clean_marker marker;
+    describe_disk(super_block, block_count, &marker);
+
+    char path[PATH_MAX];
+    char temporary_path[PATH_MAX + 16];
+    clean_marker_path(disk_name, path);
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d", path, (int) getpid());
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    bool written = write(fd, &marker, sizeof(marker)) == (ssize_t) sizeof(marker);
+    close(fd);
+    if (!written || rename(temporary_path, path) != 0) {
+        unlink(temporary_path);
+    }
+}
+
+template int check_consistency<Standard_geometry>(Super_block * super_block);
+template int check_consistency<Runtime_geometry>(Super_block * super_block);
@@ -1,12 +1,19 @@
 #pragma once
 
+#include <string>
+
 #include "FileSystem.h"
 
+bool is_marked_clean(const std::string & disk_name, Super_block * super_block, int block_count);
+void mark_clean(const std::string & disk_name, Super_block * super_block, int block_count);
+
 /**
  * @brief Checks if the provided super_block is consistent. Performs 6 different
- * checks. Returns the error code of the check that failed.
+ * checks. Returns the error code of the check that failed. Instantiated for each
+ * supported geometry G.
  *
  * @param super_block - The super_block to check
  * @return The error code of the check that failed
  */
-int check_consistency(Super_block * super_block);
\ No newline at end of file
+template <typename G>
+int check_consistency(Super_block * super_block);
@@ -0,0 +1,260 @@
+#include <fcntl.h>
+#include <string.h>
+
+#include "BlockMap.h"
+#include "BlockPool.h"
+#include "Dedup.h"
+#include "InodeMirror.h"
+#include "IO.h"
+#include "Metrics.h"
+
+// Whether fs_write() looks for blocks that already hold what it writes
+static bool dedup_enabled = false;
+
+/**
+ * @brief Turn deduplication of writes on or off for the rest of the run
+ *
+ * @param enabled - True to deduplicate writes
+ */
+void set_dedup(bool enabled) {
+    dedup_enabled = enabled;
+}
+
+/**
+ * @brief Hash the content of a block into 64 bits. Four independent lanes of multiply and xor-shift
+ * over the block's 8 byte words, folded together at the end.
+ *
+ * @param block - The block
+ * @return The block's fingerprint
+ */
+uint64_t fingerprint_block(const uint8_t block[BLOCK_SIZE]) {
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    uint64_t lanes[4] = {1, 2, 3, 4};
+    for (int i = 0; i < BLOCK_SIZE / 8; i += 4) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, block + (i + lane) * 8, 8);
+            lanes[lane] = (lanes[lane] ^ word) * multiplier;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ lanes[lane]) * multiplier;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+/**
+ * @brief Find the file that owns the block of its extent outright, for a block that no mapped file
+ * stores a block in
+ *
+ * @param super_block - The superblock of the disk
+ * @param block_number - The block
+ * @return The file's inode, or -1 if the block is not in the extent of such a file
+ */
+static int find_extent_owner(Super_block * super_block, int block_number) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    for (int i = next_inode(mirror->used, 0); i >= 0; i = next_inode(mirror->used, i + 1)) {
+        if (!is_mapped(super_block, i) && mirror->start[i] <= block_number && block_number < mirror->start[i] + mirror->size[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Make sure a block in use can be shared: it has to be stored in by mapped files only.
+ * The file owning it outright, if any, becomes mapped.
+ *
+ * @param super_block - The superblock of the disk
+ * @param block_number - The block
+ * @return False if the block cannot be shared
+ */
+static bool prepare_to_share(Super_block * super_block, int block_number) {
+    if (block_map(super_block)->references[block_number] > 0) {
+        return true;
+    }
+    int owner = find_extent_owner(super_block, block_number);
+    if (owner < 0 || !can_map(super_block, owner)) {
+        return false;
+    }
+    map_file(super_block, owner);
+    return true;
+}
+
+/**
+ * @brief Try to write a block of a file without storing it again. A block of zeros written over a
+ * block known to hold zeros is not written at all. A block whose content is already stored in
+ * another block, by fingerprint and then by comparing the content, is shared with that block and
+ * the file's own copy is released. Does nothing unless deduplication is on.
+ *
+ * @param disk_name - The disk holding the file
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ * @param block_num - The block of the file written
+ * @param buff - The content written
+ * @return True if the write was handled, false if the block still has to be written
+ */
+bool dedup_write(const std::string & disk_name, Super_block * super_block, int inode_index, int block_num, const uint8_t buff[BLOCK_SIZE]) {
+    if (!dedup_enabled) {
+        return false;
+    }
+
+    uint64_t started = metrics_now();
+    Block_map * map = block_map(super_block);
+    int block_number = physical_block(super_block, inode_index, block_num);
+    bool zero = memcmp(buff, zero_block(), BLOCK_SIZE) == 0;
+    bool skip = zero && block_number < Disk_geometry::block_count && map->zero[block_number];
+    uint64_t fingerprint = skip ? 0 : fingerprint_block(buff);
+    int match = -1;
+    for (int b = 1; !skip && b < Disk_geometry::block_count; b++) {
+        if (b != block_number && map->fingerprinted[b] && map->fingerprint[b] == fingerprint) {
+            match = b;
+            break;
+        }
+    }
+    metrics_add(COUNTER_DEDUP_CPU_NS, metrics_now() - started);
+    metrics_add(COUNTER_DEDUP_WRITES, 1);
+
+    if (skip) {
+        metrics_add(COUNTER_ZERO_WRITES_SKIPPED, 1);
+        return true;
+    }
+    if (match < 0 || !can_map(super_block, inode_index)) {
+        return false;
+    }
+
+    // A fingerprint only says the content is probably the same
+    if (!(zero && map->zero[match])) {
+        Pooled_block stored;
+        Disk disk;
+        open_disk(disk_name, O_RDONLY, &disk);
+        read_from_block(&disk, stored.data, match);
+        close_disk(&disk);
+        if (memcmp(stored.data, buff, BLOCK_SIZE) != 0) {
+            return false;
+        }
+    }
+
+    if (!prepare_to_share(super_block, match)) {
+        return false;
+    }
+    map_file(super_block, inode_index);
+    share_block(disk_name, super_block, inode_index, block_num, match);
+    metrics_add(COUNTER_DEDUP_BLOCKS_SAVED, 1);
+    write_superblock_to_disk(disk_name, super_block);
+    return true;
+}
+
+/**
+ * @brief Record the content of a block that fs_write() just wrote, so that later writes of the
+ * same content can share it. Without deduplication, the block's old content is just forgotten.
+ *
+ * @param super_block - The superblock of the disk
+ * @param block_number - The block written
+ * @param buff - What was written to it
+ */
+void note_block_contents(Super_block * super_block, int block_number, const uint8_t buff[BLOCK_SIZE]) {
+    forget_block_contents(super_block, block_number);
+    if (!dedup_enabled || block_number >= Disk_geometry::block_count) {
+        return;
+    }
+    Block_map * map = block_map(super_block);
+    map->fingerprinted[block_number] = true;
+    map->fingerprint[block_number] = fingerprint_block(buff);
+    map->zero[block_number] = memcmp(buff, zero_block(), BLOCK_SIZE) == 0;
+}
+
+/**
+ * @brief Record that newly allocated blocks hold zeros, as every free block does
+ *
+ * @param super_block - The superblock of the disk
+ * @param first_block - The first block allocated
+ * @param count - The number of blocks allocated
+ */
+void note_zero_blocks(Super_block * super_block, int first_block, int count) {
+    if (!dedup_enabled) {
+        return;
+    }
+    for (int block = first_block; block < first_block + count && block < Disk_geometry::block_count; block++) {
+        note_block_contents(super_block, block, zero_block());
+    }
+}
+
+/**
+ * @brief Deduplicate a whole disk: every block in use is read and fingerprinted, and every block of
+ * a file whose content is also stored in an earlier block is shared with that block instead. Works
+ * whether or not writes are being deduplicated.
+ *
+ * @param disk_name - The disk
+ * @param super_block - The disk's superblock
+ * @return The number of blocks freed
+ */
+int dedup_disk(const std::string & disk_name, Super_block * super_block) {
+    Block_map * map = block_map(super_block);
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    Disk disk;
+    open_disk(disk_name, O_RDONLY, &disk);
+    uint8_t * extent = extent_buffer();
+    read_from_blocks(&disk, extent, 0, Disk_geometry::block_count);
+    close_disk(&disk);
+
+    // Each block in use is matched with the first block before it that holds the same content and
+    // can be shared
+    uint64_t started = metrics_now();
+    uint8_t canonical[Standard_geometry::block_count];
+    bool shareable[Standard_geometry::block_count];
+    for (int b = 1; b < Disk_geometry::block_count; b++) {
+        canonical[b] = b;
+        shareable[b] = false;
+        if (is_block_free(b, super_block)) {
+            continue;
+        }
+        const uint8_t * data = extent + (size_t) b * BLOCK_SIZE;
+        map->fingerprinted[b] = true;
+        map->fingerprint[b] = fingerprint_block(data);
+        map->zero[b] = memcmp(data, zero_block(), BLOCK_SIZE) == 0;
+        if (map->references[b] > 0) {
+            shareable[b] = true;
+        } else {
+            int owner = find_extent_owner(super_block, b);
+            shareable[b] = owner >= 0 && can_map(super_block, owner);
+        }
+        for (int q = 1; shareable[b] && q < b; q++) {
+            if (shareable[q] && canonical[q] == q && map->fingerprint[q] == map->fingerprint[b] &&
+                memcmp(extent + (size_t) q * BLOCK_SIZE, data, BLOCK_SIZE) == 0) {
+                canonical[b] = q;
+                break;
+            }
+        }
+    }
+    metrics_add(COUNTER_DEDUP_CPU_NS, metrics_now() - started);
+
+    int freed = 0;
+    for (int i = next_inode(mirror->used, 0); i >= 0; i = next_inode(mirror->used, i + 1)) {
+        if (is_in_set(mirror->directories, i) || !can_map(super_block, i)) {
+            continue;
+        }
+        for (int k = 0; k < mirror->size[i]; k++) {
+            int block_number = physical_block(super_block, i, k);
+            int shared = canonical[block_number];
+            if (shared == block_number) {
+                continue;
+            }
+            prepare_to_share(super_block, shared);
+            map_file(super_block, i);
+            if (map->references[block_number] == 1) {
+                freed++;
+            }
+            share_block(disk_name, super_block, i, k, shared);
+        }
+    }
+
+    metrics_add(COUNTER_DEDUP_BLOCKS_SAVED, freed);
+    if (map->dirty) {
+        write_superblock_to_disk(disk_name, super_block);
+    }
+    return freed;
+}
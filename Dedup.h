@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+void set_dedup(bool enabled);
+uint64_t fingerprint_block(const uint8_t block[BLOCK_SIZE]);
+bool dedup_write(const std::string & disk_name, Super_block * super_block, int inode_index, int block_num, const uint8_t buff[BLOCK_SIZE]);
+void note_block_contents(Super_block * super_block, int block_number, const uint8_t buff[BLOCK_SIZE]);
+void note_zero_blocks(Super_block * super_block, int first_block, int count);
+int dedup_disk(const std::string & disk_name, Super_block * super_block);
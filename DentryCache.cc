@@ -0,0 +1,91 @@
+#include "DentryCache.h"
+#include "InodeMirror.h"
+#include "Metrics.h"
+
+// Constants
+#define DENTRY_SETS 64   // Must be a power of two
+#define DENTRY_WAYS 4    // Entries per set; the least recently used one is replaced
+
+// A directory found by name: the directory named name_key in parent is the inode directory
+typedef struct {
+    const Super_block * super_block;  // NULL if the entry is empty
+    uint64_t name_key;
+    uint32_t last_used;
+    uint8_t parent;
+    uint8_t directory;
+} Dentry;
+
+// The directories looked up while resolving paths, on every mounted disk
+static Dentry dentries[DENTRY_SETS][DENTRY_WAYS];
+static uint32_t dentry_clock = 0;
+
+/**
+ * @brief The set of the cache a directory name belongs in
+ */
+static Dentry * dentry_set(const Super_block * super_block, uint8_t parent, uint64_t key) {
+    uint64_t hash = ((uintptr_t) super_block >> 4) ^ ((uint64_t) parent << 40) ^ key;
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return dentries[(hash >> 32) & (DENTRY_SETS - 1)];
+}
+
+/**
+ * @brief Find a directory by name, through the cache. Entries are checked against the inode mirror
+ * when they are used, so one whose directory was deleted or reused since is never returned.
+ *
+ * @param super_block - The superblock of the disk
+ * @param parent - The directory to look in, as the index of its inode or ROOT
+ * @param name - The name of the directory, up to 5 characters
+ * @return The index of the directory's inode, or -1 if there is no such directory
+ */
+int dentry_find_directory(Super_block * super_block, uint8_t parent, const char * name) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    uint64_t key = name_key(name);
+    Dentry * set = dentry_set(super_block, parent, key);
+    dentry_clock++;
+
+    Dentry * victim = &set[0];
+    for (int way = 0; way < DENTRY_WAYS; way++) {
+        Dentry * dentry = &set[way];
+        if (dentry->super_block == super_block && dentry->parent == parent && dentry->name_key == key) {
+            int directory = dentry->directory;
+            if (is_in_set(mirror->directories, directory) && mirror->parent[directory] == parent && mirror->name_key[directory] == key) {
+                dentry->last_used = dentry_clock;
+                metrics_add(COUNTER_DENTRY_HITS, 1);
+                return directory;
+            }
+            // Stale: the directory is gone, so this is where the lookup goes
+            dentry->super_block = NULL;
+        }
+        if (dentry->super_block == NULL || (victim->super_block != NULL && dentry->last_used < victim->last_used)) {
+            victim = dentry;
+        }
+    }
+
+    metrics_add(COUNTER_DENTRY_MISSES, 1);
+    int directory = mirror_find_child(super_block, parent, name, DIRECTORY_INODE);
+    if (directory >= 0) {
+        victim->super_block = super_block;
+        victim->name_key = key;
+        victim->parent = parent;
+        victim->directory = directory;
+        victim->last_used = dentry_clock;
+    }
+    return directory;
+}
+
+/**
+ * @brief Drop a directory from the cache, when it is deleted
+ *
+ * @param super_block - The superblock of the disk
+ * @param parent - The directory it was in, as the index of its inode or ROOT
+ * @param name - The name of the directory
+ */
+void dentry_forget(Super_block * super_block, uint8_t parent, const char * name) {
+    uint64_t key = name_key(name);
+    Dentry * set = dentry_set(super_block, parent, key);
+    for (int way = 0; way < DENTRY_WAYS; way++) {
+        if (set[way].super_block == super_block && set[way].parent == parent && set[way].name_key == key) {
+            set[way].super_block = NULL;
+        }
+    }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+int dentry_find_directory(Super_block * super_block, uint8_t parent, const char * name);
+void dentry_forget(Super_block * super_block, uint8_t parent, const char * name);
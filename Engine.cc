@@ -0,0 +1,104 @@
+#include "ConsistencyCheck.h"
+#include "Engine.h"
+
+int Runtime_geometry::block_size = Standard_geometry::block_size;
+int Runtime_geometry::block_count = Standard_geometry::block_count;
+int Runtime_geometry::inode_count = Standard_geometry::inode_count;
+
+/**
+ * @brief Check a block's bit in the free block list. The same test as is_block_free(), but visible
+ * to the compiler here so that it is inlined into the scanning loops.
+ */
+static inline bool block_bit_clear(const Super_block * super_block, int block_number) {
+    return !((super_block->free_block_list[block_number / 8] >> (7 - block_number % 8)) & 1);
+}
+
+/**
+ * @brief Find the first run of free blocks of the given length. The free block list is walked a
+ * byte at a time up to the geometry's block count, a compile-time constant for every geometry but
+ * the generic one, and a byte of eight free blocks adds to the run in one step.
+ *
+ * @param super_block - The superblock to search
+ * @param size - The number of contiguous blocks needed
+ * @param start_block - Block to start the search at
+ * @param end_block - Block to end the search at, at most the number of blocks of the disk
+ * @return The first block of the run, or -1 if there is no such run.
+ */
+template <typename G>
+int find_free_run(const Super_block * super_block, int size, int start_block, int end_block) {
+    int run_length = 0;
+    for (int byte = start_block / 8; byte < (G::block_count + 7) / 8; byte++) {
+        int first_block = byte * 8;
+        if (super_block->free_block_list[byte] == 0 && first_block >= start_block && first_block + 8 <= end_block) {
+            if (size > run_length && run_length + 8 >= size) {
+                return first_block - run_length;
+            }
+            run_length += 8;
+            continue;
+        }
+        for (int block_number = first_block < start_block ? start_block : first_block; block_number < first_block + 8; block_number++) {
+            if (block_number >= end_block) {
+                return -1;
+            }
+            if (block_bit_clear(super_block, block_number)) {
+                run_length++;
+            } else {
+                run_length = 0;
+            }
+            if (run_length == size) {
+                return block_number - size + 1;
+            }
+        }
+    }
+    return -1;
+}
+
+template int find_free_run<Standard_geometry>(const Super_block *, int, int, int);
+template int find_free_run<Runtime_geometry>(const Super_block *, int, int, int);
+
+/**
+ * @brief Build the engine for a geometry out of the routines instantiated for it
+ */
+template <typename G>
+static Geometry_engine make_engine(const char * name, int block_size, int block_count, int inode_count) {
+    Geometry_engine engine = {
+        name, block_size, block_count, inode_count,
+        &check_consistency<G>, &find_free_run<G>
+    };
+    return engine;
+}
+
+// Every supported geometry, smallest disk first. The generic build has a single engine that
+// reads its geometry at run time.
+static const Geometry_engine engines[] = {
+#ifdef GENERIC_GEOMETRY
+    make_engine<Runtime_geometry>("generic", Standard_geometry::block_size, Standard_geometry::block_count, Standard_geometry::inode_count),
+#else
+    make_engine<Standard_geometry>("standard", Standard_geometry::block_size, Standard_geometry::block_count, Standard_geometry::inode_count),
+#endif
+};
+
+/**
+ * @brief Choose the engine for a disk being mounted. The superblock does not record the disk's
+ * geometry, so it is told by how many blocks the disk holds: the largest geometry that fits is
+ * chosen. A disk smaller than every geometry gets the first one, as it always has.
+ *
+ * @param disk - The disk being mounted
+ * @return The engine for the disk
+ */
+const Geometry_engine * select_geometry_engine(Disk * disk) {
+    int disk_blocks = count_disk_blocks(disk);
+    const Geometry_engine * selected = &engines[0];
+    for (auto & engine: engines) {
+        if (engine.block_count <= disk_blocks) {
+            selected = &engine;
+        }
+    }
+
+#ifdef GENERIC_GEOMETRY
+    Runtime_geometry::block_size = selected->block_size;
+    Runtime_geometry::block_count = selected->block_count;
+    Runtime_geometry::inode_count = selected->inode_count;
+#endif
+    return selected;
+}
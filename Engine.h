@@ -0,0 +1,20 @@
+#pragma once
+
+#include "FileSystem.h"
+#include "IO.h"
+
+// The routines that scan a whole superblock, compiled for one geometry. A disk is handled by the
+// engine of its geometry, chosen when it is mounted.
+typedef struct Geometry_engine {
+    const char * name;
+    int block_size;
+    int block_count;
+    int inode_count;
+    int (*check_consistency)(Super_block * super_block);
+    int (*find_free_run)(const Super_block * super_block, int size, int start_block, int end_block);
+} Geometry_engine;
+
+template <typename G>
+int find_free_run(const Super_block * super_block, int size, int start_block, int end_block);
+
+const Geometry_engine * select_geometry_engine(Disk * disk);
@@ -2,23 +2,69 @@
 #include <fstream>
 #include <iostream>
 #include <vector>
-#include <map>
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
 #include "FileSystem.h"
+#include "Backup.h"
+#include "Batch.h"
+#include "BlockMap.h"
+#include "BlockPool.h"
+#include "Checksum.h"
+#include "Compression.h"
 #include "ConsistencyCheck.h"
+#include "Dedup.h"
+#include "DentryCache.h"
+#include "Engine.h"
+#include "FreeSpace.h"
+#include "Headroom.h"
+#include "ImageBuilder.h"
 #include "InodeHelper.h"
+#include "InodeMirror.h"
 #include "IO.h"
+#include "Metrics.h"
+#include "Output.h"
+#include "ReadAhead.h"
+#include "Server.h"
+#include "Trace.h"
+#include "Volume.h"
 #include "Util.h"
 
 // Global variables
 Super_block * super_block = NULL;
+const Geometry_engine * geometry = NULL;
 std::string disk_name = "";
 uint8_t current_directory = ROOT;
-uint8_t buffer[BLOCK_SIZE] = {0};
+uint8_t * buffer = acquire_block();
+bool read_only_mounts = false; // --read-only: every disk is mounted read-only and cannot be changed
+bool compact_on_failure = false; // --compact-on-failure: compact a disk before failing an allocation
+bool serving_sessions = false; // --serve: disks mounted again are shared as loaded, not read again
+
+// Disks mounted during this run. They stay loaded, so every mount of a disk shares its superblock;
+// in server mode, mounting them again is free.
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    Super_block * super_block;
+    const Geometry_engine * geometry;
+} Mounted_disk;
+std::vector<Mounted_disk> mounted_disks;
+
+// The mount table. Maps the names mounts are addressed by to mounted disks; several names can
+// refer to the same disk.
+typedef struct {
+    std::string name;
+    std::string disk_name;
+    Super_block * super_block;
+    const Geometry_engine * geometry;
+} Mount;
+std::vector<Mount> mount_table;
 
 // void print_superblock() {
 //     int fd2 = open(disk_name.c_str(), O_RDONLY);
@@ -45,96 +91,489 @@ uint8_t buffer[BLOCK_SIZE] = {0};
 // }
 
 /**
- * @brief A wrapper for the stoi function that returns -1 if an exception is thrown.
+ * @brief Converts a string to an integer like stoi, but returns -1 instead of throwing when the
+ * string does not start with a number or the number is out of range.
  * 
  * @param str - The string to convert to an integer
- * @return The integer conversion of the string, or -1 if an exception was thrown.
+ * @return The integer conversion of the string, or -1 if it could not be converted.
  */
-int safe_stoi(const std::string& str) {
-    int value;
-    try {
-        value = stoi(str);
-    } catch (...) {
-        value = -1;
+int safe_stoi(const char * str) {
+    char * end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (end == str || errno == ERANGE || value < INT_MIN || value > INT_MAX) {
+        return -1;
     }
-    return value;
+    return (int) value;
+}
+
+// A file or directory named by a path: the directory it is in and its name there
+typedef struct {
+    uint8_t directory;
+    char name[6]; // Zero filled and terminated
+} Path_operand;
+
+// Makes a directory the current working directory for as long as it exists, to run a command on a
+// file or directory that a path named in another directory
+class Directory_scope {
+public:
+    explicit Directory_scope(uint8_t directory) : saved(current_directory) { current_directory = directory; }
+    ~Directory_scope() { current_directory = saved; }
+
+private:
+    uint8_t saved;
+    Directory_scope(const Directory_scope &);
+    Directory_scope & operator=(const Directory_scope &);
+};
+
+/**
+ * @brief Checks that an operand is a path: names of 1 to 5 characters separated by slashes,
+ * starting with a slash if the path starts at the root directory. A plain name is a path.
+ *
+ * @param path - The operand as written in the command
+ * @return True if the operand is a path
+ */
+bool is_valid_path(const char * path) {
+    size_t length = 0;
+    for (const char * p = path; ; p++) {
+        if (*p == '/' || *p == 0) {
+            if (length > 5) {
+                return false;
+            }
+            length = 0;
+            if (*p == 0) {
+                break;
+            }
+        } else {
+            length++;
+        }
+    }
+    return *path != 0;
+}
+
+/**
+ * @brief Resolves the directories of a path, down to the directory holding its last name. Every
+ * directory on the way is found through the dentry cache (see DentryCache.cc), so resolving the
+ * same path again costs one cache hit per directory. "." and ".." are followed as in fs_cd(); a
+ * path ending with a slash names the directory itself, as ".".
+ *
+ * @param disk_super_block - The superblock of the disk the path is on
+ * @param start_directory - Where a path that does not start with a slash starts
+ * @param path - The path, already checked with is_valid_path()
+ * @param operand - Set to the directory holding the last name, and that name
+ * @return True if every directory on the way exists. False otherwise, with an error printed.
+ */
+bool resolve_path(Super_block * disk_super_block, uint8_t start_directory, const char * path, Path_operand * operand) {
+    uint8_t directory = path[0] == '/' ? ROOT : start_directory;
+    const char * last_slash = strrchr(path, '/');
+    const char * last_name = last_slash == NULL ? path : last_slash + 1;
+
+    const char * component = path;
+    while (component < last_name) {
+        const char * slash = strchr(component, '/');
+        char name[6] = {0};
+        memcpy(name, component, std::min((size_t) 5, (size_t) (slash - component)));
+        if (name[0] == 0 || strcmp(name, ".") == 0) {
+            // Stay in the same directory
+        } else if (strcmp(name, "..") == 0) {
+            if (directory != ROOT) {
+                directory = get_parent_dir(disk_super_block->inode[directory]);
+            }
+        } else {
+            int found = dentry_find_directory(disk_super_block, directory, name);
+            if (found < 0) {
+                std::cerr << "Error: Directory " << name << " does not exist\n";
+                return false;
+            }
+            directory = found;
+        }
+        component = slash + 1;
+    }
+
+    memset(operand->name, 0, sizeof(operand->name));
+    strncpy(operand->name, *last_name != 0 ? last_name : ".", 5);
+    operand->directory = directory;
+    return true;
 }
 
 /**
- * @brief Gets a vector of contiguous blocks, starting at the start block and ending 1 before the
- * end block. Looks through the free list of the superblock.
+ * @brief Finds the first run of contiguous free blocks, starting at the start block and ending 1
+ * before the end block. Looks through the free list of the superblock. A search from block 1 is
+ * looking for somewhere to put a file, and passes over blocks reserved as headroom for growing
+ * files (see Headroom.cc) unless nothing else is left; any other search is a file growing in place,
+ * where the only reservation it can meet is its own.
  * 
  * @param size - The size or number of blocks to find
  * @param start_block - Block to start the search at - default is 1
- * @param end_block - Block to end the search at - default is 128
- * @return The vector of contiguous blocks. Can be empty.
+ * @param end_block - Block to end the search at - default and at most the end of the disk
+ * @param disk_super_block - The superblock to search - default is the current disk's
+ * @param disk_geometry - The engine for the searched disk - default is the current disk's
+ * @return The first block of the run, or -1 if there is no such run.
  */
-std::vector<int> get_contiguous_blocks(int size, int start_block = 1, int end_block = 128) {
+int get_contiguous_blocks(int size, int start_block = 1, int end_block = -1, Super_block * disk_super_block = NULL, const Geometry_engine * disk_geometry = NULL) {
+    Trace_span span("get_contiguous_blocks", start_block, size);
+    if (disk_super_block == NULL) {
+        disk_super_block = super_block;
+        disk_geometry = geometry;
+    }
+    if (end_block < 0 || end_block > disk_geometry->block_count) {
+        end_block = disk_geometry->block_count;
+    }
+
     // Find the first set of contiguous blocks that can be allocated by scanning
-    // data blocks from 1 to 127.
-    std::vector<int> contiguous_blocks;
-    int block_number = start_block;
-    while (block_number < end_block) {
-        if (is_block_free(block_number, super_block)) {
-            contiguous_blocks.push_back(block_number);
-        } else {
-            contiguous_blocks.clear();
+    // data blocks from start_block up to end_block.
+    if (start_block == 1) {
+        return find_unreserved_run(disk_super_block, disk_geometry, size, start_block, end_block);
+    }
+    return disk_geometry->find_free_run(disk_super_block, size, start_block, end_block);
+}
+
+/**
+ * @brief Verifies every block of a disk with checksums, and reports every block that fails
+ *
+ * @param scrubbed_disk_name - The disk to verify
+ * @return The number of blocks that failed, or -1 if the disk has no checksums
+ */
+int scrub_and_report(const std::string & scrubbed_disk_name) {
+    bool failed[Standard_geometry::block_count];
+    int scrubbed = scrub_disk(scrubbed_disk_name, failed);
+    int failures = 0;
+    for (int block = 0; block < scrubbed; block++) {
+        if (failed[block]) {
+            std::cerr << "Error: Block " << block << " of " << scrubbed_disk_name << " failed its checksum\n";
+            failures++;
         }
-        if ((int) contiguous_blocks.size() == size) {
-            return contiguous_blocks;
+    }
+    return scrubbed < 0 ? -1 : failures;
+}
+
+/**
+ * @brief Reads the superblock of a disk and checks that the file system on it is consistent. The
+ * blocks of a disk with checksums are verified too; with --checksums, a disk without them gets
+ * them. The disk is locked for the rest of the run, shared with other read-only mounts when
+ * mounted with --read-only.
+ *
+ * @param new_disk_name - The name of the disk to read
+ * @param disk_geometry - Set to the engine for the disk's geometry
+ * @param loaded - True if the disk is loaded already, so its lock is kept whatever happens
+ * @return The disk's superblock, or NULL if the disk could not be read or is inconsistent
+ */
+static Super_block * read_disk(char *new_disk_name, const Geometry_engine ** disk_geometry, bool loaded) {
+    // A striped volume can only be mounted with all of its own members
+    if (!check_disk_members(new_disk_name)) {
+        return NULL;
+    }
+
+    // Other processes must not change the disk while it is mounted here
+    if (!lock_disk(new_disk_name, read_only_mounts)) {
+        return NULL;
+    }
+
+    Disk disk;
+    if (!open_disk(new_disk_name, O_RDONLY, &disk)) {
+        std::cout << "Error\n";
+        if (!loaded) {
+            unlock_disk(new_disk_name);
+        }
+        return NULL;
+    }
+
+    // Read the superblock
+    Super_block * temp_super_block = allocate_super_block();
+    bool read = read_superblock_from_disk(&disk, temp_super_block);
+    if (!read) {
+        std::cerr << "Error: Reading superblock during mount was not successful\n";
+    } else {
+        mirror_rebuild(temp_super_block);
+        if (!load_block_map(new_disk_name, temp_super_block)) {
+            std::cerr << "Error: Reading block map of " << new_disk_name << " was not successful\n";
+            read = false;
+        }
+    }
+
+    // The disk's geometry decides which specialized engine handles it from now on. A read-only
+    // mount of a disk that is the same as when it last passed its checks skips them.
+    const Geometry_engine * engine = select_geometry_engine(&disk);
+    int block_count = count_disk_blocks(&disk);
+    bool clean = read && read_only_mounts && is_marked_clean(new_disk_name, temp_super_block, block_count);
+    int errorCode = !read || clean ? 0 : engine->check_consistency(temp_super_block);
+    close_disk(&disk);
+
+    if (errorCode != 0) {
+        std::cerr << "Error: File system in " << new_disk_name << " is inconsistent";
+        std::cerr << " (error code: " << errorCode << ")\n";
+    }
+    if (!read || errorCode != 0) {
+        free_super_block(temp_super_block);
+        if (!loaded) {
+            unlock_disk(new_disk_name);
         }
-        block_number++;
+        return NULL;
+    }
+    free_space_rebuild(temp_super_block);
+
+    // Blocks that fail their checksums are reported, but do not keep the rest of the disk from being used
+    if (checksums_enabled() && !read_only_mounts && !add_block_checksums(new_disk_name)) {
+        std::cerr << "Error: Cannot add checksums to " << new_disk_name << std::endl;
+    }
+    if (!clean && scrub_and_report(new_disk_name) <= 0 && read_only_mounts) {
+        mark_clean(new_disk_name, temp_super_block, block_count);
     }
-    contiguous_blocks.clear();
-    return contiguous_blocks;
+
+    *disk_geometry = engine;
+    return temp_super_block;
 }
 
 /**
- * @brief Mounts the file system residing on the virtual disk with the specified name. Involves making
- * consistency checks before the file is mounted.
- * 
- * @param new_disk_name - The name of the disk to mount
+ * @brief Loads the superblock of the disk with the specified name, reading and checking it with
+ * read_disk(). A disk stays loaded for the rest of the run, and every mount of it shares the same
+ * superblock. In server mode, a disk that was loaded before is not read or checked again, since
+ * every change to it since went through its loaded superblock. A command file mounting a disk
+ * again reads and checks it again, as it always has; the loaded superblock is replaced with what
+ * was read, so mounts made earlier see it too.
+ *
+ * @param new_disk_name - The name of the disk to load
+ * @param disk_geometry - Set to the engine for the disk's geometry
+ * @return The disk's superblock, or NULL if the disk could not be loaded
  */
-void fs_mount(char *new_disk_name) {
+Super_block * load_disk(char *new_disk_name, const Geometry_engine ** disk_geometry) {
     struct stat sb;
 
     if (stat(new_disk_name, &sb) != 0) {
         std::cerr << "Error: Cannot find disk " << new_disk_name << std::endl;
-        return;
+        return NULL;
+    }
+
+    for (auto & mounted: mounted_disks) {
+        if (mounted.device != sb.st_dev || mounted.inode != sb.st_ino) {
+            continue;
+        }
+        if (serving_sessions) {
+            // The directory index has been kept up to date through every change since; if it ever
+            // strays from the inode table, the table wins
+            if (!mirror_check_directories(mounted.super_block)) {
+                std::cerr << "Error: Directory index of " << new_disk_name << " does not match its inodes, rebuilding it\n";
+                mirror_rebuild(mounted.super_block);
+            }
+            *disk_geometry = mounted.geometry;
+            return mounted.super_block;
+        }
+
+        const Geometry_engine * engine;
+        Super_block * reread = read_disk(new_disk_name, &engine, true);
+        if (reread == NULL) {
+            return NULL;
+        }
+        copy_super_block(mounted.super_block, reread);
+        free_super_block(reread);
+        mounted.geometry = engine;
+        *disk_geometry = engine;
+        readahead_reset();
+        return mounted.super_block;
     }
 
-    int fd = open(new_disk_name, O_RDONLY);
-    if (fd < 0) {
-        printf("Error\n");
+    const Geometry_engine * engine;
+    Super_block * temp_super_block = read_disk(new_disk_name, &engine, false);
+    if (temp_super_block == NULL) {
+        return NULL;
+    }
+
+    mounted_disks.push_back({sb.st_dev, sb.st_ino, temp_super_block, engine});
+    *disk_geometry = engine;
+    readahead_reset();
+    readahead_start();
+    return temp_super_block;
+}
+
+/**
+ * @brief Looks up a mount by name in the mount table
+ *
+ * @param mount_name - The name of the mount
+ * @param length - The length of the name
+ * @return The mount, or NULL if there is no mount with that name
+ */
+Mount * find_mount(const char * mount_name, size_t length) {
+    for (auto & mount: mount_table) {
+        if (mount.name.compare(0, std::string::npos, mount_name, length) == 0) {
+            return &mount;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Mounts the file system residing on the virtual disk with the specified name. Involves making
+ * consistency checks before the file is mounted. The disk is added to the mount table under the
+ * given mount name and becomes the current disk; other mounted disks stay mounted.
+ * 
+ * @param new_disk_name - The name of the disk to mount
+ * @param mount_name - The name to mount the disk under. NULL to use the disk name.
+ */
+void fs_mount(char *new_disk_name, char *mount_name) {
+    const Geometry_engine * loaded_geometry = NULL;
+    Super_block * loaded_super_block = load_disk(new_disk_name, &loaded_geometry);
+    if (loaded_super_block == NULL) {
         return;
     }
 
-    // Read the superblock
-    Super_block * temp_super_block = new Super_block;
-    int sizeRead = read(fd, temp_super_block, BLOCK_SIZE);
-    if (sizeRead < BLOCK_SIZE) {
-        std::cerr << "Error: Reading superblock during mount was not successful\n";
-        delete temp_super_block;
-        close(fd);
+    std::string name = mount_name != NULL ? mount_name : new_disk_name;
+    Mount * mount = find_mount(name.c_str(), name.size());
+    if (mount == NULL) {
+        mount_table.push_back({name, new_disk_name, loaded_super_block, loaded_geometry});
+    } else {
+        mount->disk_name = new_disk_name;
+        mount->super_block = loaded_super_block;
+        mount->geometry = loaded_geometry;
+    }
+
+    super_block = loaded_super_block;
+    geometry = loaded_geometry;
+    disk_name = new_disk_name;
+    current_directory = ROOT;
+}
+
+/**
+ * @brief Applies a delta exported with X to a disk image. The image must not have been mounted
+ * during this run, since its loaded superblock would no longer match what is on it.
+ *
+ * @param delta_path - The file holding the delta
+ * @param target_disk_name - The disk to apply the delta to
+ */
+void fs_apply(char *delta_path, char *target_disk_name) {
+    struct stat sb;
+    if (stat(target_disk_name, &sb) == 0) {
+        for (auto & mounted: mounted_disks) {
+            if (mounted.device == sb.st_dev && mounted.inode == sb.st_ino) {
+                std::cerr << "Error: Disk " << target_disk_name << " is mounted\n";
+                return;
+            }
+        }
+    }
+    apply_delta(delta_path, target_disk_name);
+}
+
+/**
+ * @brief Makes the mounted disk with the given mount name the current disk. The current working
+ * directory is set to its root.
+ *
+ * @param mount_name - The name of the mount to switch to
+ */
+void fs_use(char *mount_name) {
+    Mount * mount = find_mount(mount_name, strlen(mount_name));
+    if (mount == NULL) {
+        std::cerr << "Error: Mount " << mount_name << " does not exist\n";
         return;
     }
 
-    int errorCode = check_consistency(temp_super_block);
+    super_block = mount->super_block;
+    geometry = mount->geometry;
+    disk_name = mount->disk_name;
+    current_directory = ROOT;
+}
 
-    if (errorCode == 0) {
-        if (super_block != NULL) {
-            delete super_block;
+/**
+ * @brief Slides files left over the free blocks before them, the file with the lowest starting block
+ * first, until the largest free extent of the disk is long enough. Moving every file that can move
+ * leaves no free block between the used blocks, and between the superblock and the used blocks.
+ *
+ * @param wanted - The length of free extent wanted. INT_MAX moves every file that can move.
+ * @return The number of blocks moved
+ */
+static int compact_files(int wanted) {
+    // Sort the inodes based on position (lower starting blocks should go first)
+    // Indexed by starting block; the first inode found keeps a starting block shared by directories
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    Inode * sortedInodes[Standard_geometry::block_count] = {NULL};
+    for (int i = next_inode(mirror->used, 0); i >= 0; i = next_inode(mirror->used, i + 1)) {
+        if (sortedInodes[mirror->start[i]] == NULL) {
+            sortedInodes[mirror->start[i]] = &(super_block->inode[i]);
         }
-        super_block = temp_super_block;
-        disk_name = new_disk_name;
-        current_directory = ROOT;
-    } else {
-        std::cerr << "Error: File system in " << new_disk_name << " is inconsistent";
-        std::cerr << " (error code: " << errorCode << ")\n";
-        delete temp_super_block;
     }
 
-    close(fd);
+    Disk disk;
+    disk.member_count = 0;
+    bool opened = false;
+    int moved = 0;
+
+    uint8_t * extent = extent_buffer();
+
+    for (int start_block = 0; start_block < Disk_geometry::block_count; start_block++) {
+        // The free space is kept up to date as files move, so this costs nothing to ask
+        if (free_space_summary(super_block).largest_extent >= wanted) {
+            break;
+        }
+        Inode * inode = sortedInodes[start_block];
+        // A mapped file stays where it is: its clones start at the same block
+        if (inode == NULL || is_mapped(super_block, inode - super_block->inode)) {
+            continue;
+        }
+        uint8_t new_start_block = start_block;
+        while (new_start_block > 0) {
+            if (!is_block_free(new_start_block - 1, super_block)) {
+                break;
+            }
+            new_start_block--;
+        }
+        // Can't move this file left
+        if (new_start_block == start_block) {
+            continue;
+        }
+        if (!opened) {
+            open_disk(disk_name, O_RDWR, &disk);
+            opened = true;
+        }
+
+        // Move the whole file in one read and one write, then clear the blocks it left behind
+        int size = get_inode_size(*inode);
+        int old_end = inode->start_block + size;
+        int first_left = std::max((int) inode->start_block, new_start_block + size);
+        read_from_blocks(&disk, extent, inode->start_block, size);
+        write_to_blocks(&disk, extent, new_start_block, size);
+        if (first_left < old_end) {
+            write_to_blocks(&disk, zero_block(), first_left, old_end - first_left);
+        }
+
+        for (int i = 0; i < size; i++) {
+            free_block_in_free_list(inode->start_block + i, super_block);
+            allocate_block_in_free_list(new_start_block + i, super_block);
+        }
+
+        inode->start_block = new_start_block;
+        mirror_update_inode(super_block, inode);
+        moved += size;
+    }
+
+    if (opened) {
+        close_disk(&disk);
+    }
+    return moved;
+}
+
+/**
+ * @brief With --compact-on-failure, make room for an allocation that found no free extent long
+ * enough, by compacting the disk only until such an extent appears. Nothing is moved when the disk
+ * does not have enough free blocks for the allocation in all.
+ *
+ * @param wanted - The length of free extent the allocation needs
+ * @param needed - The number of free blocks the allocation needs
+ * @return True if files were moved, so that the allocation is worth trying again
+ */
+static bool compact_for_allocation(int wanted, int needed) {
+    if (!compact_on_failure || free_space_summary(super_block).free_blocks < needed) {
+        return false;
+    }
+
+    Trace_span span("compaction", 0, wanted);
+    int moved = compact_files(wanted);
+    if (moved == 0) {
+        return false;
+    }
+    // As with O, files were packed over the headroom they had
+    drop_all_headroom(super_block);
+    write_superblock_to_disk(disk_name, super_block);
+    metrics_add(COUNTER_COMPACTIONS, 1);
+    metrics_add(COUNTER_COMPACTION_BLOCKS_MOVED, moved);
+    return true;
 }
 
 /**
@@ -146,20 +585,16 @@ void fs_mount(char *new_disk_name) {
  */
 void fs_create(char name[5], int size) {
     // Need to find first available inode
-    Inode * available_inode = NULL;
-    for (int i = 0; i < 126; i++) {
-        available_inode = &(super_block->inode[i]);
-        if (!is_inode_used(*available_inode)) {
-            break;
-        } else {
-            available_inode = NULL;
-        }
-    }
+    trace_begin("find_free_inode");
+    int available_index = mirror_find_free_inode(super_block);
+    Inode * available_inode = available_index < 0 ? NULL : &(super_block->inode[available_index]);
+    trace_end();
 
     // No available inodes were found
     if (available_inode == NULL) {
         std::cerr << "Error: Superblock in disk " << disk_name;
         std::cerr << " is full, cannot create " << name << std::endl;
+        metrics_add(COUNTER_INODE_ALLOCATION_FAILURES, 1);
         return;
     }
 
@@ -171,28 +606,33 @@ void fs_create(char name[5], int size) {
     }
 
     // New file/directory needs to have unique name within current working directory
-    for (int i = 0; i < 126; i++) {
-        Inode inode = super_block->inode[i];
-        if (is_inode_used(inode) && get_parent_dir(inode) == current_directory && strncmp(inode.name, name, 5) == 0) {
-            std::cerr << "Error: File or directory " << name;
-            std::cerr << " already exists\n";
-            return;
-        }
+    trace_begin("lookup");
+    int existing = mirror_find_child(super_block, current_directory, name, ANY_INODE);
+    trace_end();
+    if (existing >= 0) {
+        std::cerr << "Error: File or directory " << name;
+        std::cerr << " already exists\n";
+        return;
     }
 
     // If it's a file, we have to allocate space
-    std::vector<int> contiguous_blocks;
+    int first_block = -1;
     if (size != 0) {
-        contiguous_blocks = get_contiguous_blocks(size);
+        first_block = get_contiguous_blocks(size);
+        if (first_block < 0 && compact_for_allocation(size, size)) {
+            first_block = get_contiguous_blocks(size);
+        }
 
-        if (contiguous_blocks.empty()) {
+        if (first_block < 0) {
             std::cerr << "Error: Cannot allocate " << size << " on " << disk_name << std::endl;
+            metrics_add(COUNTER_BLOCK_ALLOCATION_FAILURES, 1);
             return;
         }
 
-        for (auto block: contiguous_blocks) {
+        for (int block = first_block; block < first_block + size; block++) {
             allocate_block_in_free_list(block, super_block);
         }
+        note_zero_blocks(super_block, first_block, size);
     }
 
     available_inode->dir_parent = current_directory;
@@ -201,11 +641,70 @@ void fs_create(char name[5], int size) {
         available_inode->start_block = 0;
     } else {// It's a file, first bit of dir_parent should be 0
         available_inode->dir_parent &= ~(1UL << 7);
-        available_inode->start_block = contiguous_blocks[0];
+        available_inode->start_block = first_block;
     }
 
     set_inode_size(available_inode, size);
     strncpy(available_inode->name, name, 5);
+    mirror_update_inode(super_block, available_inode);
+
+    write_superblock_to_disk(disk_name, super_block);
+}
+
+/**
+ * @brief Creates a clone of a file in the current working directory. The clone shares all of the
+ * file's blocks instead of copying them; writing a block through either file later gives that file
+ * its own copy of the block (see BlockMap.cc).
+ *
+ * @param source_directory - The directory holding the file to clone
+ * @param source - The name of the file to clone
+ * @param name - The name of the clone
+ */
+void fs_clone(uint8_t source_directory, char source[5], char name[5]) {
+    trace_begin("lookup");
+    int source_index = mirror_find_child(super_block, source_directory, source, FILE_INODE);
+    trace_end();
+
+    if (source_index < 0) {
+        std::cerr << "Error: File " << source << " does not exist\n";
+        return;
+    }
+
+    trace_begin("find_free_inode");
+    int available_index = mirror_find_free_inode(super_block);
+    Inode * available_inode = available_index < 0 ? NULL : &(super_block->inode[available_index]);
+    trace_end();
+
+    if (available_inode == NULL) {
+        std::cerr << "Error: Superblock in disk " << disk_name;
+        std::cerr << " is full, cannot create " << name << std::endl;
+        metrics_add(COUNTER_INODE_ALLOCATION_FAILURES, 1);
+        return;
+    }
+
+    trace_begin("lookup");
+    int existing = mirror_find_child(super_block, current_directory, name, ANY_INODE);
+    trace_end();
+    if (strncmp(name, ".", 5) == 0 || strncmp(name, "..", 5) == 0 || existing >= 0) {
+        std::cerr << "Error: File or directory " << name;
+        std::cerr << " already exists\n";
+        return;
+    }
+
+    const Inode * source_inode = &(super_block->inode[source_index]);
+    if (source_inode->start_block + get_inode_size(*source_inode) > Disk_geometry::block_count) {
+        std::cerr << "Error: File " << source << " cannot be cloned\n";
+        return;
+    }
+
+    available_inode->dir_parent = current_directory;
+    available_inode->dir_parent &= ~(1UL << 7);
+    available_inode->start_block = source_inode->start_block;
+    set_inode_size(available_inode, get_inode_size(*source_inode));
+    strncpy(available_inode->name, name, 5);
+    mirror_update_inode(super_block, available_inode);
+    map_clone(super_block, source_index, available_index);
+    metrics_add(COUNTER_CLONES, 1);
 
     write_superblock_to_disk(disk_name, super_block);
 }
@@ -217,15 +716,10 @@ void fs_create(char name[5], int size) {
  * @param name - The name of the file/directory to delete
  */
 void fs_delete(char name[5]) {
-    Inode * inode = NULL;
-    int inodeIndex;
-    for (inodeIndex = 0; inodeIndex < 126; inodeIndex++) {
-        inode = &(super_block->inode[inodeIndex]);
-        if (is_inode_used(*inode) && get_parent_dir(*inode) == current_directory && strncmp(inode->name, name, 5) == 0) {
-            break;
-        }
-        inode = NULL;
-    }
+    trace_begin("lookup");
+    int inodeIndex = mirror_find_child(super_block, current_directory, name, ANY_INODE);
+    Inode * inode = inodeIndex < 0 ? NULL : &(super_block->inode[inodeIndex]);
+    trace_end();
 
     if (inode == NULL) {
         std::cerr << "Error: File or directory " << name << " does not exist\n";
@@ -233,6 +727,7 @@ void fs_delete(char name[5]) {
     }
 
     if (is_inode_dir(*inode)) {
+        dentry_forget(super_block, current_directory, name);
         delete_directory(inodeIndex, disk_name, super_block);
     } else {
         delete_file(inode, disk_name, super_block);
@@ -241,6 +736,132 @@ void fs_delete(char name[5]) {
     write_superblock_to_disk(disk_name, super_block);
 }
 
+/**
+ * @brief Creates a batch of files and directories at once. The whole batch is checked before
+ * anything changes, so it is created whole or not at all. The entries get the free inodes in
+ * order, as creating them one by one would give them, while their blocks are planned together
+ * (see Batch.cc) to pack into the free space. The superblock is written once for the whole batch.
+ * Every entry must go in a directory that exists before the batch.
+ *
+ * @param paths - Where every entry goes, with its path resolved
+ * @param sizes - The size of every entry. 0 if it's a directory.
+ * @param count - The number of entries
+ */
+void fs_create_batch(const Path_operand * paths, const int * sizes, int count) {
+    trace_begin("lookup");
+    for (int i = 0; i < count; i++) {
+        const char * name = paths[i].name;
+        bool exists = strncmp(name, ".", 5) == 0 || strncmp(name, "..", 5) == 0 ||
+                      mirror_find_child(super_block, paths[i].directory, name, ANY_INODE) >= 0;
+        for (int j = 0; j < i && !exists; j++) {
+            exists = paths[j].directory == paths[i].directory && strncmp(paths[j].name, name, 5) == 0;
+        }
+        if (exists) {
+            trace_end();
+            std::cerr << "Error: File or directory " << name;
+            std::cerr << " already exists\n";
+            return;
+        }
+    }
+    trace_end();
+
+    // The free inodes are found in one pass over the mirror
+    trace_begin("find_free_inode");
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    std::vector<int, Arena_allocator<int>> inodes(count);
+    int found = 0;
+    for (int i = 0; i < Disk_geometry::inode_count && found < count; i++) {
+        if (!is_in_set(mirror->used, i)) {
+            inodes[found++] = i;
+        }
+    }
+    trace_end();
+    if (found < count) {
+        std::cerr << "Error: Superblock in disk " << disk_name;
+        std::cerr << " is full, cannot create " << paths[found].name << std::endl;
+        metrics_add(COUNTER_INODE_ALLOCATION_FAILURES, 1);
+        return;
+    }
+
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += sizes[i];
+    }
+    std::vector<int, Arena_allocator<int>> first_blocks(count);
+    bool placed = plan_batch_blocks(super_block, geometry, sizes, count, first_blocks.data());
+    if (!placed && compact_for_allocation(total, total)) {
+        placed = plan_batch_blocks(super_block, geometry, sizes, count, first_blocks.data());
+    }
+    if (!placed) {
+        std::cerr << "Error: Cannot allocate " << total << " on " << disk_name << std::endl;
+        metrics_add(COUNTER_BLOCK_ALLOCATION_FAILURES, 1);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        for (int block = first_blocks[i]; block < first_blocks[i] + sizes[i]; block++) {
+            allocate_block_in_free_list(block, super_block);
+        }
+        if (sizes[i] != 0) {
+            note_zero_blocks(super_block, first_blocks[i], sizes[i]);
+        }
+
+        Inode * inode = &(super_block->inode[inodes[i]]);
+        inode->dir_parent = paths[i].directory;
+        if (sizes[i] == 0) {// It's a directory, first bit of dir_parent should be 1
+            inode->dir_parent |= 1UL << 7;
+        } else {// It's a file, first bit of dir_parent should be 0
+            inode->dir_parent &= ~(1UL << 7);
+        }
+        inode->start_block = first_blocks[i];
+        set_inode_size(inode, sizes[i]);
+        strncpy(inode->name, paths[i].name, 5);
+        mirror_update_inode(super_block, inode);
+    }
+    metrics_add(COUNTER_BATCH_ENTRIES, count);
+
+    write_superblock_to_disk(disk_name, super_block);
+}
+
+/**
+ * @brief Deletes a batch of files and directories at once, as fs_delete() would one by one, and
+ * writes the superblock once for the whole batch. Nothing is deleted unless every entry exists.
+ * An entry already deleted by an earlier one, such as a file in a directory the batch deleted
+ * first, is passed over.
+ *
+ * @param paths - Every entry to delete, with its path resolved
+ * @param count - The number of entries
+ */
+void fs_delete_batch(const Path_operand * paths, int count) {
+    trace_begin("lookup");
+    std::vector<int, Arena_allocator<int>> inodes(count);
+    for (int i = 0; i < count; i++) {
+        inodes[i] = mirror_find_child(super_block, paths[i].directory, paths[i].name, ANY_INODE);
+        if (inodes[i] < 0) {
+            trace_end();
+            std::cerr << "Error: File or directory " << paths[i].name << " does not exist\n";
+            return;
+        }
+    }
+    trace_end();
+
+    for (int i = 0; i < count; i++) {
+        Inode * inode = &(super_block->inode[inodes[i]]);
+        if (!is_inode_used(*inode)) {
+            continue;
+        }
+        if (is_inode_dir(*inode)) {
+            dentry_forget(super_block, paths[i].directory, paths[i].name);
+            delete_directory(inodes[i], disk_name, super_block);
+        } else {
+            delete_file(inode, disk_name, super_block);
+        }
+    }
+    metrics_add(COUNTER_BATCH_ENTRIES, count);
+
+    write_superblock_to_disk(disk_name, super_block);
+}
+
 /**
  * @brief Opens the file with the given name and reads the block num-th block of the file into the buffer.
  * 
@@ -248,14 +869,10 @@ void fs_delete(char name[5]) {
  * @param block_num - The block of the file to read into the buffer
  */
 void fs_read(char name[5], int block_num) {
-    Inode * inode = NULL;
-    for (int i = 0; i < 126; i++) {
-        inode = &(super_block->inode[i]);
-        if (is_inode_used(*inode) && !is_inode_dir(*inode) && get_parent_dir(*inode) == current_directory && strncmp(inode->name, name, 5) == 0) {
-            break;
-        }
-        inode = NULL;
-    }
+    trace_begin("lookup");
+    int inodeIndex = mirror_find_child(super_block, current_directory, name, FILE_INODE);
+    Inode * inode = inodeIndex < 0 ? NULL : &(super_block->inode[inodeIndex]);
+    trace_end();
 
     if (inode == NULL) {
         std::cerr << "Error: File " << name << " does not exist\n";
@@ -267,27 +884,33 @@ void fs_read(char name[5], int block_num) {
         return;
     }
 
-    int fd = open(disk_name.c_str(), O_RDWR);
-    read_from_block(fd, buffer, inode->start_block + block_num);
-    close(fd);
+    if (is_mapped(super_block, inodeIndex)) {
+        // Read ahead follows extents, which a mapped file's blocks need not be in
+        Disk disk;
+        open_disk(disk_name, O_RDONLY, &disk);
+        read_file_block(&disk, super_block, inodeIndex, block_num, buffer);
+        close_disk(&disk);
+    } else {
+        readahead_read(disk_name, inodeIndex, inode, block_num, buffer);
+    }
+    output_block(buffer, BLOCK_SIZE);
 }
 
 /**
  * @brief Opens the file with the given name and writes the content of the buffer to the
- * block num-th block of the file.
+ * block num-th block of the file. A block the file shares with a clone is not changed: the file
+ * gets a new block of its own instead. With --dedup, content already stored in another block is
+ * shared with it instead of being written again (see Dedup.cc). A block of a compressed file is
+ * stored whole once it is written.
  *  
  * @param name - The name of the file/directory to write to
  * @param block_num - The block of the file to write to
  */
 void fs_write(char name[5], int block_num) {
-    Inode * inode = NULL;
-    for (int i = 0; i < 126; i++) {
-        inode = &(super_block->inode[i]);
-        if (is_inode_used(*inode) && !is_inode_dir(*inode) && get_parent_dir(*inode) == current_directory && strncmp(inode->name, name, 5) == 0) {
-            break;
-        }
-        inode = NULL;
-    }
+    trace_begin("lookup");
+    int inodeIndex = mirror_find_child(super_block, current_directory, name, FILE_INODE);
+    Inode * inode = inodeIndex < 0 ? NULL : &(super_block->inode[inodeIndex]);
+    trace_end();
 
     if (inode == NULL) {
         std::cerr << "Error: File " << name << " does not exist\n";
@@ -298,9 +921,37 @@ void fs_write(char name[5], int block_num) {
         std::cerr << "Error: " << name << " does not have block " << block_num << std::endl;
         return;
     }
-    int fd = open(disk_name.c_str(), O_RDWR);
-    write_to_block(fd, buffer, inode->start_block + block_num);
-    close(fd);
+
+    // A packed block of a compressed file is written whole, like any other
+    uint16_t unpacked = store_block_whole(super_block, inodeIndex, block_num);
+    if (dedup_write(disk_name, super_block, inodeIndex, block_num, buffer)) {
+        return;
+    }
+
+    int block_number = physical_block(super_block, inodeIndex, block_num);
+    bool copied = false;
+    if (is_block_shared(super_block, block_number)) {
+        // Copy on write: the block gets a block of its own, which the whole buffer is written to
+        block_number = get_contiguous_blocks(1);
+        if (block_number < 0) {
+            repack_block(super_block, inodeIndex, block_num, unpacked);
+            std::cerr << "Error: Cannot allocate 1 on " << disk_name << std::endl;
+            metrics_add(COUNTER_BLOCK_ALLOCATION_FAILURES, 1);
+            return;
+        }
+        remap_block(super_block, inodeIndex, block_num, block_number);
+        metrics_add(COUNTER_COPY_ON_WRITE_BLOCKS, 1);
+        copied = true;
+    }
+
+    Disk disk;
+    open_disk(disk_name, O_RDWR, &disk);
+    write_to_block(&disk, buffer, block_number);
+    close_disk(&disk);
+    note_block_contents(super_block, block_number, buffer);
+    if (copied || unpacked != 0) {
+        write_superblock_to_disk(disk_name, super_block);
+    }
 }
 
 /**
@@ -314,246 +965,598 @@ void fs_buff(uint8_t buff[BLOCK_SIZE], int size) {
     for (int i = 0; i < BLOCK_SIZE; i++) {
         buffer[i] = 0;
     }
-    memcpy(buffer, buff, size);
+    memcpy(buffer, buff, size);
+}
+
+/**
+ * @brief Lists all files and directories that exist in the current directory, including
+ * special directories . and .. which represent the current working directory and the parent
+ * directory of the current working directory, respectively.
+ */
+void fs_ls() {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+
+    trace_begin("scan_directory");
+    Inode_set current_contents = mirror_children(mirror, current_directory);
+    trace_end();
+    int current_count = count_inodes(current_contents);
+
+    // In the case of the root directory, its parent is itself
+    int parent_count = current_count;
+    if (current_directory != ROOT) {
+        parent_count = count_inodes(mirror_children(mirror, mirror->parent[current_directory]));
+    }
+
+    char line[32];
+    snprintf(line, sizeof(line), "%-5s %3d\n", ".", current_count + 2);
+    std::cout << line;
+    output_entry(".", current_count + 2, true);
+    snprintf(line, sizeof(line), "%-5s %3d\n", "..", parent_count + 2);
+    std::cout << line;
+    output_entry("..", parent_count + 2, true);
+
+    for (int i = next_inode(current_contents, 0); i >= 0; i = next_inode(current_contents, i + 1)) {
+        Inode * inode = &(super_block->inode[i]);
+        if (is_inode_dir(*inode)) {
+            int entries = count_inodes(mirror_children(mirror, i)) + 2;
+            snprintf(line, sizeof(line), "%-5.5s %3d\n", inode->name, entries);
+            output_entry(inode->name, entries, true);
+        } else {
+            snprintf(line, sizeof(line), "%-5.5s %3d KB\n", inode->name, get_inode_size(*inode));
+            output_entry(inode->name, get_inode_size(*inode), false);
+        }
+        std::cout << line;
+    }
+
+}
+
+// The files to move out of the way of a file growing in place, and where to
+typedef struct {
+    int count;
+    int blocks_copied;
+    uint8_t inode[Standard_geometry::block_count];
+    uint8_t destination[Standard_geometry::block_count];
+} Neighbor_moves;
+
+/**
+ * @brief Plan how to make room for a file to grow in place by moving the files in the blocks it
+ * grows into. Each of them is placed in the first free run outside those blocks and outside any
+ * file's headroom, in inode order.
+ *
+ * @param inode_index - The growing file
+ * @param new_size - The size the file grows to
+ * @param moves - Set to the planned moves
+ * @return True if every file in the way has somewhere to go
+ */
+bool plan_neighbor_moves(int inode_index, int new_size, Neighbor_moves * moves) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    int range_start = mirror->start[inode_index] + mirror->size[inode_index];
+    int range_end = mirror->start[inode_index] + new_size;
+    moves->count = 0;
+    moves->blocks_copied = 0;
+    if (range_end > Disk_geometry::block_count) {
+        return false;
+    }
+
+    // The blocks the neighbors can go to
+    Super_block scratch;
+    mask_reserved_blocks(super_block, &scratch);
+    int used_in_range = 0;
+    for (int block = range_start; block < range_end; block++) {
+        if (!is_block_free(block, super_block)) {
+            used_in_range++;
+        }
+        scratch.free_block_list[block / 8] |= 1 << (7 - block % 8);
+    }
+
+    int covered = 0;
+    for (int i = next_inode(mirror->used, 0); i >= 0; i = next_inode(mirror->used, i + 1)) {
+        int start = mirror->start[i];
+        int size = mirror->size[i];
+        if (i == inode_index || size == 0 || is_in_set(mirror->directories, i) ||
+            start >= range_end || start + size <= range_start) {
+            continue;
+        }
+        if (is_mapped(super_block, i)) {
+            // Its blocks are shared or scattered, so it cannot be moved as one extent
+            return false;
+        }
+        int destination = geometry->find_free_run(&scratch, size, 1, geometry->block_count);
+        if (destination < 0) {
+            return false;
+        }
+        for (int block = destination; block < destination + size; block++) {
+            scratch.free_block_list[block / 8] |= 1 << (7 - block % 8);
+        }
+        covered += std::min(start + size, range_end) - std::max(start, range_start);
+        moves->inode[moves->count] = i;
+        moves->destination[moves->count] = destination;
+        moves->count++;
+        moves->blocks_copied += size;
+    }
+
+    // Blocks marked used that no file owns cannot be moved out of the way
+    return covered == used_in_range;
+}
+
+/**
+ * @brief Carry out the moves planned by plan_neighbor_moves()
+ *
+ * @param moves - The planned moves
+ */
+void move_neighbors(const Neighbor_moves & moves) {
+    for (int k = 0; k < moves.count; k++) {
+        Inode * neighbor = &(super_block->inode[moves.inode[k]]);
+        int size = get_inode_size(*neighbor);
+        drop_headroom(super_block, moves.inode[k]);
+        for (int block = neighbor->start_block; block < neighbor->start_block + size; block++) {
+            free_block_in_free_list(block, super_block);
+        }
+        move_file_to_blocks(neighbor, disk_name, super_block, moves.destination[k], size);
+        metrics_add(COUNTER_NEIGHBOR_RELOCATIONS, 1);
+    }
+}
+
+/**
+ * @brief Changes the size of the file with the given name to a new size. A file that cannot grow
+ * in place is moved, unless moving the files in its way copies fewer blocks. With --grow-headroom,
+ * a file that grows gets free blocks reserved after it, so that its next grows can stay in place.
+ * 
+ * @param name - The name of the file to resize
+ * @param new_size - The desired new size of the file
+ */
+void fs_resize(char name[5], int new_size) {
+    trace_begin("lookup");
+    int inodeIndex = mirror_find_child(super_block, current_directory, name, FILE_INODE);
+    Inode * inode = inodeIndex < 0 ? NULL : &(super_block->inode[inodeIndex]);
+    trace_end();
+
+    if (inode == NULL) {
+        std::cerr << "Error: File " << name << " does not exist\n";
+        return;
+    }
+
+    int current_size = get_inode_size(*inode);
+    bool mapped = is_mapped(super_block, inodeIndex);
+    if (new_size < current_size && mapped) {
+        drop_headroom(super_block, inodeIndex);
+        release_mapped_blocks(disk_name, super_block, inodeIndex, new_size);
+    } else if (new_size < current_size) {
+        drop_headroom(super_block, inodeIndex);
+        Disk disk;
+        open_disk(disk_name, O_RDWR, &disk);
+        write_to_blocks(&disk, zero_block(), inode->start_block + new_size, current_size - new_size);
+        for (int i = inode->start_block + new_size; i < inode->start_block + current_size; i++) {
+            free_block_in_free_list(i, super_block);
+        }
+        close_disk(&disk);
+    } else if (new_size > current_size) {
+        bool had_headroom = inode_mirror(super_block)->headroom[inodeIndex] > 0;
+        int grow_start = inode->start_block + current_size;
+        // A file cannot grow in place past the end of the disk, whose blocks have no bits
+        bool in_place = inode->start_block + new_size <= Disk_geometry::block_count &&
+                        get_contiguous_blocks(new_size - current_size, grow_start, inode->start_block + new_size) >= 0;
+
+        if (in_place) {
+            if (had_headroom) {
+                metrics_add(COUNTER_RELOCATIONS_AVOIDED, 1);
+            }
+        } else {
+            // Not enough blocks in the next blocks. Either the file moves or the files in its way
+            // do, whichever copies fewer blocks; moving the file wins ties.
+            Neighbor_moves moves;
+            bool neighbors_movable = plan_neighbor_moves(inodeIndex, new_size, &moves);
+            if (neighbors_movable && moves.blocks_copied < current_size) {
+                move_neighbors(moves);
+                in_place = true;
+            } else if (mapped) {
+                // Its blocks may be shared, so they stay allocated while it is copied into blocks of its own
+                drop_headroom(super_block, inodeIndex);
+                int first_block = find_growing_run(super_block, geometry, new_size);
+                if (first_block >= 0) {
+                    move_mapped_file(disk_name, super_block, inodeIndex, first_block, new_size);
+                    metrics_add(COUNTER_RELOCATIONS, 1);
+                } else if (!neighbors_movable) {
+                    if (compact_for_allocation(new_size, new_size)) {
+                        fs_resize(name, new_size);
+                        return;
+                    }
+                    std::cerr << "Error: File " << name << " cannot expand to size " << new_size << std::endl;
+                    metrics_add(COUNTER_BLOCK_ALLOCATION_FAILURES, 1);
+                    return;
+                } else {
+                    move_neighbors(moves);
+                    in_place = true;
+                }
+            } else {
+                drop_headroom(super_block, inodeIndex);
+                for (int i = inode->start_block; i < inode->start_block + current_size; i++) {
+                    free_block_in_free_list(i, super_block);
+                }
+                int first_block = find_growing_run(super_block, geometry, new_size);
+                if (first_block >= 0) {
+                    move_file_to_blocks(inode, disk_name, super_block, first_block, new_size);
+                    metrics_add(COUNTER_RELOCATIONS, 1);
+                } else {
+                    for (int i = inode->start_block; i < inode->start_block + current_size; i++) {
+                        allocate_block_in_free_list(i, super_block);
+                    }
+                    if (!neighbors_movable) {
+                        if (compact_for_allocation(new_size, new_size)) {
+                            fs_resize(name, new_size);
+                            return;
+                        }
+                        std::cerr << "Error: File " << name << " cannot expand to size " << new_size << std::endl;
+                        metrics_add(COUNTER_BLOCK_ALLOCATION_FAILURES, 1);
+                        return;
+                    }
+                    move_neighbors(moves);
+                    in_place = true;
+                }
+            }
+        }
+
+        if (in_place) {// Enough blocks available
+            Disk disk;
+            open_disk(disk_name, O_RDWR, &disk);
+            write_to_blocks(&disk, zero_block(), grow_start, new_size - current_size);
+            for (int block = grow_start; block < inode->start_block + new_size; block++) {
+                allocate_block_in_free_list(block, super_block);
+            }
+            close_disk(&disk);
+            note_zero_blocks(super_block, grow_start, new_size - current_size);
+            if (mapped) {
+                map_grown_blocks(super_block, inodeIndex, current_size, new_size);
+            }
+        }
+    } else {
+        return;
+    }
+
+    set_inode_size(inode, new_size);
+    mirror_update_inode(super_block, inode);
+    if (new_size > current_size) {
+        reserve_headroom(super_block, geometry, inodeIndex);
+    }
+    write_superblock_to_disk(disk_name, super_block);
+}
+
+/**
+ * @brief Re-organizes the file blocks such that there is no free block between the used blocks,
+ * and between the superblock and the used blocks. Shifts all the blocks to the left, starting with the
+ * leftmost block
+ */
+void fs_defrag() {
+    compact_files(INT_MAX);
+
+    // Files were packed against each other, over the headroom they had
+    drop_all_headroom(super_block);
+
+    if (next_inode(inode_mirror(super_block)->used, 0) >= 0) {
+        write_superblock_to_disk(disk_name, super_block);
+    }
+}
+
+/**
+ * @brief Compresses a file in the current working directory, or stores a compressed file whole
+ * again. Compressing packs the blocks of the file that compress well into as few blocks as they fit
+ * in (see Compression.cc), and prints how many blocks the file is stored in now. Reads of a
+ * compressed file decompress its packed blocks; a block that is written is stored whole again.
+ *
+ * @param name - The name of the file
+ * @param compress - True to compress the file, false to decompress it
+ */
+void fs_compress(char name[5], bool compress) {
+    trace_begin("lookup");
+    int inodeIndex = mirror_find_child(super_block, current_directory, name, FILE_INODE);
+    Inode * inode = inodeIndex < 0 ? NULL : &(super_block->inode[inodeIndex]);
+    trace_end();
+
+    if (inode == NULL) {
+        std::cerr << "Error: File " << name << " does not exist\n";
+        return;
+    }
+
+    if (!compress) {
+        if (!is_compressed(super_block, inodeIndex)) {
+            std::cerr << "Error: File " << name << " is not compressed\n";
+            return;
+        }
+        int size = get_inode_size(*inode);
+        drop_headroom(super_block, inodeIndex);
+        int first_block = get_contiguous_blocks(size);
+        if (first_block < 0 && compact_for_allocation(size, size)) {
+            first_block = get_contiguous_blocks(size);
+        }
+        if (first_block < 0) {
+            std::cerr << "Error: Cannot allocate " << size << " on " << disk_name << std::endl;
+            metrics_add(COUNTER_BLOCK_ALLOCATION_FAILURES, 1);
+            return;
+        }
+        move_mapped_file(disk_name, super_block, inodeIndex, first_block, size);
+        write_superblock_to_disk(disk_name, super_block);
+        return;
+    }
+
+    if (!can_map(super_block, inodeIndex)) {
+        std::cerr << "Error: File " << name << " cannot be compressed\n";
+        return;
+    }
+    Compression_report report;
+    if (!compress_file(disk_name, super_block, geometry, inodeIndex, &report)) {
+        return;
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "Compressed %s: %d blocks stored in %d, %d freed\n", name,
+             report.size, report.blocks_after, report.blocks_freed);
+    std::cout << line;
+    if (report.blocks_after < report.blocks_before) {
+        write_superblock_to_disk(disk_name, super_block);
+    }
 }
 
 /**
- * @brief Lists all files and directories that exist in the current directory, including
- * special directories . and .. which represent the current working directory and the parent
- * directory of the current working directory, respectively.
+ * @brief Prints the free space of the current disk: its free blocks, the extents they form, the
+ * largest of them, and the fragmentation index (0 when the free space is one extent, approaching 1
+ * as it is scattered). The free space is kept up to date as blocks change, so the disk is not scanned.
  */
-void fs_ls() {
-    // Maps directory to its children
-    std::map<uint8_t, std::vector<uint8_t>> directory;
-
-    // Build the directory map by looping through the inodes
-    for (int i = 0; i < 126; i++) {
-        Inode * inode = &(super_block->inode[i]);
-        uint8_t parent_dir = get_parent_dir(*inode);
-
-        if (is_inode_used(*inode)) {
-            if (is_inode_dir(*inode)) {
-                auto it = directory.find(i);
-                if (it == directory.end()) {
-                    // directory is not in the map yet
-                    std::vector<uint8_t> directoryContents;
-                    directory.insert({i, directoryContents});
-                }
-            }
+void fs_statfs() {
+    Free_space space = free_space_summary(super_block);
+    char line[128];
+    snprintf(line, sizeof(line), "%d free blocks, %d free extents, largest %d, fragmentation %.3f\n",
+             space.free_blocks, space.free_extents, space.largest_extent, fragmentation_index(space));
+    std::cout << line;
+}
 
-            auto it = directory.find(parent_dir);
-            if (it != directory.end()) {
-                // directory in map
-                it->second.push_back(i);
-            } else {
-                // directory not in map
-                std::vector<uint8_t> directoryContents;
-                directoryContents.push_back(i);
-                directory.insert({parent_dir, directoryContents});
-            }
+/**
+ * @brief Changes the current working directory to the directory at the given path. A plain name is
+ * a subdirectory of the current working directory, or its parent for "..".
+ *
+ * @param path - The path of the new working directory
+ */
+void fs_cd(char * path) {
+    Path_operand operand;
+    if (!resolve_path(super_block, current_directory, path, &operand)) {
+        return;
+    }
 
+    const char * name = operand.name;
+    if (strncmp(name, ".", 5) == 0) {
+        current_directory = operand.directory;
+        return;
+    } else if (strncmp(name, "..", 5) == 0) {
+        current_directory = operand.directory;
+        if (current_directory != ROOT) {
+            current_directory = get_parent_dir(super_block->inode[current_directory]);
         }
+        return;
     }
 
-    std::vector<uint8_t> current_contents;
-    std::vector<uint8_t> parent_contents;
-
-    auto it_current = directory.find(current_directory);
-    if (it_current != directory.end()) {
-        current_contents =  it_current->second;
-    }
+    trace_begin("lookup");
+    int inodeIndex = dentry_find_directory(super_block, operand.directory, name);
+    trace_end();
 
-    // In the case of the root directory, its parent is itself
-    if (current_directory == ROOT) {
-        parent_contents = current_contents;
+    if (inodeIndex >= 0) {
+        current_directory = inodeIndex;
     } else {
-        uint8_t parent_dir = get_parent_dir(super_block->inode[current_directory]);
-        auto it_parent = directory.find(parent_dir);
-        if (it_parent != directory.end()) {
-            parent_contents =  it_parent->second;
-        }
+        std::cerr << "Error: Directory " << name << " does not exist\n";
     }
+}
 
-    printf("%-5s %3d\n", ".", (int) current_contents.size() + 2);
-    printf("%-5s %3d\n", "..", (int) parent_contents.size() + 2);
+// A file named by a copy command
+typedef struct {
+    Super_block * super_block;
+    const Geometry_engine * geometry;
+    const std::string * disk_name;
+    uint8_t directory;
+    char name[5];
+} Copy_operand;
 
-    for (auto inode_index: current_contents) {
-        Inode * inode = &(super_block->inode[inode_index]);
-        if (is_inode_dir(*inode)) {
-            int num_children = 0;
-            auto it = directory.find(inode_index);
-            if (it != directory.end()) {
-                num_children = it->second.size();
-            }
-            printf("%-5.5s %3d\n", inode->name, num_children + 2);
-        } else {
-            printf("%-5.5s %3d KB\n", inode->name, get_inode_size(*inode));
+/**
+ * @brief Resolves a copy operand of the form [mount:]path. A path without a mount is on the
+ * current disk, from its current working directory. A path with a mount is on that mount, from its
+ * root directory.
+ *
+ * @param text - The operand as written in the command
+ * @param operand - Where to store the resolved operand
+ * @return True if the operand could be resolved. False otherwise.
+ */
+bool resolve_copy_operand(const char * text, Copy_operand * operand) {
+    const char * name = text;
+    const char * separator = strchr(text, ':');
+    if (separator == NULL) {
+        if (super_block == NULL) {
+            std::cerr << "Error: No file system is mounted\n";
+            return false;
+        }
+        operand->super_block = super_block;
+        operand->geometry = geometry;
+        operand->disk_name = &disk_name;
+        operand->directory = current_directory;
+    } else {
+        Mount * mount = find_mount(text, separator - text);
+        if (mount == NULL) {
+            std::cerr << "Error: Mount ";
+            std::cerr.write(text, separator - text);
+            std::cerr << " does not exist\n";
+            return false;
         }
+        operand->super_block = mount->super_block;
+        operand->geometry = mount->geometry;
+        operand->disk_name = &mount->disk_name;
+        operand->directory = ROOT;
+        name = separator + 1;
     }
 
+    Path_operand path;
+    if (!resolve_path(operand->super_block, operand->directory, name, &path)) {
+        return false;
+    }
+    operand->directory = path.directory;
+    memcpy(operand->name, path.name, 5);
+    return true;
 }
 
 /**
- * @brief Changes the size of the file with the given name to a new size.
- * 
- * @param name - The name of the file to resize
- * @param new_size - The desired new size of the file
+ * @brief Copies a file to a new file, on the same disk or on another mounted disk. The blocks
+ * for the whole copy are allocated at once and the data is copied directly between the disk
+ * files, without going through the buffer.
+ *
+ * @param source - The file to copy, as [mount:]name
+ * @param destination - The new file to create, as [mount:]name
  */
-void fs_resize(char name[5], int new_size) {
-    Inode * inode = NULL;
-    for (int i = 0; i < 126; i++) {
-        inode = &(super_block->inode[i]);
-        if (is_inode_used(*inode) &&
-                    !is_inode_dir(*inode) &&
-                    get_parent_dir(*inode) == current_directory &&
-                    strncmp(name, inode->name, 5) == 0) {
-            break;
-        }
-        inode = NULL;
+void fs_copy(char *source, char *destination) {
+    Copy_operand from;
+    Copy_operand to;
+    if (!resolve_copy_operand(source, &from) || !resolve_copy_operand(destination, &to)) {
+        return;
     }
 
-    if (inode == NULL) {
-        std::cerr << "Error: File " << name << " does not exist\n";
+    trace_begin("lookup");
+    int source_index = mirror_find_child(from.super_block, from.directory, from.name, FILE_INODE);
+    Inode * source_inode = source_index < 0 ? NULL : &(from.super_block->inode[source_index]);
+    trace_end();
+
+    if (source_inode == NULL) {
+        std::cerr << "Error: File " << std::string(from.name, strnlen(from.name, 5)) << " does not exist\n";
         return;
     }
 
-    int current_size = get_inode_size(*inode);
-    if (new_size < current_size) {
-        uint8_t buff[BLOCK_SIZE] = {0};
-        int fd = open(disk_name.c_str(), O_RDWR);
-        for (int i = inode->start_block + new_size; i < inode->start_block + current_size; i++) {
-            write_to_block(fd, buff, i);
-            free_block_in_free_list(i, super_block);
-        }
-        close(fd);
-    } else if (new_size > current_size) {
-        std::vector<int> contiguous_blocks = get_contiguous_blocks(new_size - current_size, inode->start_block + current_size, inode->start_block + new_size);
+    std::string new_name(to.name, strnlen(to.name, 5));
+    trace_begin("find_free_inode");
+    int available_index = mirror_find_free_inode(to.super_block);
+    Inode * available_inode = available_index < 0 ? NULL : &(to.super_block->inode[available_index]);
+    trace_end();
 
-        // Not enough blocks in the next blocks
-        if (contiguous_blocks.empty()) {
-            for (int i = inode->start_block; i < inode->start_block + current_size; i++) {
-                free_block_in_free_list(i, super_block);
-            }
-            contiguous_blocks = get_contiguous_blocks(new_size);
-            if (contiguous_blocks.empty()) {
-                for (int i = inode->start_block; i < inode->start_block + current_size; i++) {
-                    allocate_block_in_free_list(i, super_block);
-                }
-                std::cerr << "Error: File " << name << " cannot expand to size " << new_size << std::endl;
-                return;
-            } else {
-                move_file_to_blocks(inode, disk_name, super_block, contiguous_blocks);
-            }
-        } else {// Enough blocks available
-            uint8_t buff[BLOCK_SIZE] = {0};
-            int fd = open(disk_name.c_str(), O_RDWR);
-            for (auto block: contiguous_blocks) {
-                write_to_block(fd, buff, block);
-                allocate_block_in_free_list(block, super_block);
-            }
-            close(fd);
-        }
-    } else {
+    if (available_inode == NULL) {
+        std::cerr << "Error: Superblock in disk " << *to.disk_name;
+        std::cerr << " is full, cannot create " << new_name << std::endl;
+        metrics_add(COUNTER_INODE_ALLOCATION_FAILURES, 1);
         return;
     }
 
-    set_inode_size(inode, new_size);
-    write_superblock_to_disk(disk_name, super_block);
-}
+    if (new_name == "." || new_name == "..") {
+        std::cerr << "Error: File or directory " << new_name << " already exists\n";
+        return;
+    }
 
-/**
- * @brief Re-organizes the file blocks such that there is no free block between the used blocks,
- * and between the superblock and the used blocks. Shifts all the blocks to the left, starting with the
- * leftmost block
- */
-void fs_defrag() {
-    // Sort the inodes based on position (lower starting blocks should go first)
-    std::map<uint8_t, Inode*> sortedInodes;
-    for (int i = 0; i < 126; i++) {
-        Inode * inode = &(super_block->inode[i]);
-        if (is_inode_used(*inode)) {
-            sortedInodes.insert({inode->start_block, inode});
-        }
+    trace_begin("lookup");
+    int existing = mirror_find_child(to.super_block, to.directory, to.name, ANY_INODE);
+    trace_end();
+    if (existing >= 0) {
+        std::cerr << "Error: File or directory " << new_name << " already exists\n";
+        return;
     }
 
-    int fd = 0;
-    if (!sortedInodes.empty()) {
-        fd = open(disk_name.c_str(), O_RDWR);
+    int size = get_inode_size(*source_inode);
+    int first_block = get_contiguous_blocks(size, 1, to.geometry->block_count, to.super_block, to.geometry);
+    if (first_block < 0) {
+        std::cerr << "Error: Cannot allocate " << size << " on " << *to.disk_name << std::endl;
+        metrics_add(COUNTER_BLOCK_ALLOCATION_FAILURES, 1);
+        return;
+    }
+    for (int block = first_block; block < first_block + size; block++) {
+        allocate_block_in_free_list(block, to.super_block);
     }
 
-    for (auto f: sortedInodes) {
-        Inode * inode = f.second;
-        uint8_t new_start_block = f.first;
-        while (new_start_block > 0) {
-            if (!is_block_free(new_start_block - 1, super_block)) {
-                break;
-            }
-            new_start_block--;
+    Disk source_disk;
+    Disk destination_disk;
+    open_disk(*from.disk_name, O_RDONLY, &source_disk);
+    open_disk(*to.disk_name, O_RDWR, &destination_disk);
+    if (is_compressed(from.super_block, source_index)) {
+        // The copy is not compressed
+        Pooled_block block;
+        for (int i = 0; i < size; i++) {
+            read_file_block(&source_disk, from.super_block, source_index, i, block.data);
+            write_to_block(&destination_disk, block.data, first_block + i);
         }
-        // Can't move this file left
-        if (new_start_block == f.first) {
-            continue;
+    } else if (is_mapped(from.super_block, source_index)) {
+        for (int i = 0; i < size; i++) {
+            copy_blocks(&source_disk, physical_block(from.super_block, source_index, i), &destination_disk, first_block + i, 1);
         }
+    } else {
+        copy_blocks(&source_disk, source_inode->start_block, &destination_disk, first_block, size);
+    }
+    close_disk(&source_disk);
+    close_disk(&destination_disk);
 
-        int size = get_inode_size(*inode);
-        for (int i = 0; i < size; i++) {
-            int old_block = inode->start_block + i;
-            int new_block = new_start_block + i;
+    available_inode->dir_parent = to.directory;
+    available_inode->dir_parent &= ~(1UL << 7);
+    available_inode->start_block = first_block;
+    set_inode_size(available_inode, size);
+    strncpy(available_inode->name, to.name, 5);
+    mirror_update_inode(to.super_block, available_inode);
 
-            uint8_t buff[BLOCK_SIZE] = {0};
-            read_from_block(fd, buff, old_block);
-            write_to_block(fd, buff, new_block);
-            uint8_t clear[BLOCK_SIZE] = {0};
-            write_to_block(fd, clear, old_block);
+    write_superblock_to_disk(*to.disk_name, to.super_block);
+}
 
-            free_block_in_free_list(old_block, super_block);
-            allocate_block_in_free_list(new_block, super_block);
-        }
+/**
+ * @brief Checks that a copy operand has the form [mount:]path (see is_valid_path())
+ *
+ * @param operand - The operand to check
+ * @return True if the operand is well formed. False otherwise.
+ */
+bool is_valid_copy_operand(const char * operand) {
+    const char * separator = strchr(operand, ':');
+    return separator != operand && is_valid_path(separator == NULL ? operand : separator + 1);
+}
 
-        inode->start_block = new_start_block;
+/**
+ * @brief Collect the disks in the mount table, each once, for reporting their fragmentation
+ *
+ * @param disks - Where to collect the disks. Allocated from the command arena.
+ */
+void mounted_metrics_disks(std::vector<Metrics_disk, Arena_allocator<Metrics_disk>> & disks) {
+    for (auto & mount: mount_table) {
+        bool seen = false;
+        for (auto & disk: disks) {
+            seen = seen || disk.super_block == mount.super_block;
+        }
+        if (!seen) {
+            disks.push_back({mount.disk_name.c_str(), mount.super_block});
+        }
     }
+}
 
-    if (!sortedInodes.empty()) {
-        close(fd);
-        write_superblock_to_disk(disk_name, super_block);
-    }
+/**
+ * @brief Prints every metric collected so far as JSON: per command counts and latency histograms,
+ * I/O and allocation counters, and the fragmentation of every mounted disk
+ */
+void fs_stats() {
+    std::vector<Metrics_disk, Arena_allocator<Metrics_disk>> disks;
+    mounted_metrics_disks(disks);
+    metrics_write_json(std::cout, disks.data(), disks.size());
 }
 
 /**
- * @brief Changes the current working directory to a directory with the specified name in the
- * current working directory.
- * 
- * @param name - The name of the directory to move into
+ * @brief Write every metric collected during the run as JSON to a file, before the disks are unmounted
+ *
+ * @param stats_path - The file to write. Nothing is written if NULL.
  */
-void fs_cd(char name[5]) {
-    if (strncmp(name, ".", 5) == 0) {
-        // Stay at the current directory
-        return;
-    } else if (strncmp(name, "..", 5) == 0) {
-        if (current_directory != ROOT) {
-            current_directory = get_parent_dir(super_block->inode[current_directory]);
-        }
+void write_stats_file(const char * stats_path) {
+    if (stats_path == NULL) {
         return;
     }
-
-    bool directory_found = false;
-    int inodeIndex;
-    for (inodeIndex = 0; inodeIndex < 126; inodeIndex++) {
-        Inode inode = super_block->inode[inodeIndex];
-        if (is_inode_used(inode) &&
-                    is_inode_dir(inode) &&
-                    get_parent_dir(inode) == current_directory &&
-                    strncmp(name, inode.name, 5) == 0) {
-            directory_found = true;
-            break;
-        }
+    std::vector<Metrics_disk, Arena_allocator<Metrics_disk>> disks;
+    mounted_metrics_disks(disks);
+    std::ofstream stats_file(stats_path);
+    metrics_write_json(stats_file, disks.data(), disks.size());
+    if (!stats_file) {
+        std::cerr << "Error: Cannot write stats to " << stats_path << std::endl;
     }
+}
 
-    if (directory_found) {
-        current_directory = inodeIndex;
-    } else {
-        std::cerr << "Error: Directory " << name << " does not exist\n";
+/**
+ * @brief Reports that the command cannot run because disks are mounted read-only
+ *
+ * @param target_disk_name - The disk the command changes - default is the current disk
+ * @return True if the command changes disks and must not run
+ */
+bool refuse_read_only(const char * target_disk_name = NULL) {
+    if (read_only_mounts) {
+        std::cerr << "Error: " << (target_disk_name != NULL ? target_disk_name : disk_name.c_str()) << " is mounted read-only\n";
     }
+    return read_only_mounts;
 }
 
 /**
@@ -563,75 +1566,171 @@ void fs_cd(char name[5]) {
  * @param arguments - The command to run, tokenized already by spaces
  * @return True if the command is valid and will run, false otherwise.
  */
-bool runCommand(std::vector<std::string> arguments) {
+bool runCommand(Command_arguments & arguments) {
     // Separate out the command and the arguments
-    std::string command = arguments[0];
+    Arena_string command = arguments[0];
     arguments.erase(arguments.begin());
     bool isValid = true;
     bool isMounted = super_block != NULL;
 
     if (command.compare("M") == 0) {
+        if (arguments.size() != 1 && arguments.size() != 2) {
+            isValid = false;
+        } else {
+            char * cstr = &(arguments[0][0]);
+            char * mount_name = arguments.size() == 2 ? &(arguments[1][0]) : NULL;
+            fs_mount(cstr, mount_name);
+        }
+    } else if (command.compare("U") == 0) {
         if (arguments.size() != 1) {
             isValid = false;
         } else {
             char * cstr = &(arguments[0][0]);
-            fs_mount(cstr);
+            fs_use(cstr);
+        }
+    } else if (command.compare("P") == 0) {
+        if (arguments.size() != 2) {
+            isValid = false;
+        } else if (!is_valid_copy_operand(arguments[0].c_str()) || !is_valid_copy_operand(arguments[1].c_str())) {
+            isValid = false;
+        } else if (isMounted && refuse_read_only()) {
+        } else {
+            char * source = &(arguments[0][0]);
+            char * destination = &(arguments[1][0]);
+            fs_copy(source, destination);
         }
     } else if (command.compare("C") == 0) {
         if (arguments.size() != 2) {
             isValid = false;
-        } else if (arguments[0].size() > 5) {
+        } else if (!is_valid_path(arguments[0].c_str())) {
             isValid = false;
-        } else if (safe_stoi(arguments[1]) < 0 || safe_stoi(arguments[1]) > 127) {
+        } else if (safe_stoi(arguments[1].c_str()) < 0 || safe_stoi(arguments[1].c_str()) > Disk_geometry::block_count - 1) {
             isValid = false;
         } else if (!isMounted) {
             std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
         } else {
-            char * cstr = &(arguments[0][0]);
-            fs_create(cstr, stoi(arguments[1]));
+            Path_operand path;
+            if (resolve_path(super_block, current_directory, arguments[0].c_str(), &path)) {
+                Directory_scope scope(path.directory);
+                fs_create(path.name, safe_stoi(arguments[1].c_str()));
+            }
+        }
+    } else if (command.compare("K") == 0) {
+        if (arguments.size() != 2) {
+            isValid = false;
+        } else if (!is_valid_path(arguments[0].c_str()) || !is_valid_path(arguments[1].c_str())) {
+            isValid = false;
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
+        } else {
+            Path_operand source;
+            Path_operand clone;
+            if (resolve_path(super_block, current_directory, arguments[0].c_str(), &source) &&
+                resolve_path(super_block, current_directory, arguments[1].c_str(), &clone)) {
+                Directory_scope scope(clone.directory);
+                fs_clone(source.directory, source.name, clone.name);
+            }
         }
     } else if (command.compare("D") == 0) {
         if (arguments.size() != 1) {
             isValid = false;
-        } else if (arguments[0].size() > 5) {
+        } else if (!is_valid_path(arguments[0].c_str())) {
             isValid = false;
         } else if (!isMounted) {
             std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
         } else {
-            char * cstr = &(arguments[0][0]);
-            fs_delete(cstr);
+            Path_operand path;
+            if (resolve_path(super_block, current_directory, arguments[0].c_str(), &path)) {
+                Directory_scope scope(path.directory);
+                fs_delete(path.name);
+            }
+        }
+    } else if (command.compare("G") == 0) {
+        for (size_t i = 0; i < arguments.size() && isValid; i += 2) {
+            isValid = i + 1 < arguments.size() && is_valid_path(arguments[i].c_str()) &&
+                      safe_stoi(arguments[i + 1].c_str()) >= 0 && safe_stoi(arguments[i + 1].c_str()) <= Disk_geometry::block_count - 1;
+        }
+        if (arguments.empty()) {
+            isValid = false;
+        } else if (!isValid) {
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
+        } else {
+            int count = arguments.size() / 2;
+            std::vector<Path_operand, Arena_allocator<Path_operand>> paths(count);
+            std::vector<int, Arena_allocator<int>> sizes(count);
+            bool resolved = true;
+            for (int i = 0; i < count && resolved; i++) {
+                resolved = resolve_path(super_block, current_directory, arguments[2 * i].c_str(), &paths[i]);
+                sizes[i] = safe_stoi(arguments[2 * i + 1].c_str());
+            }
+            if (resolved) {
+                fs_create_batch(paths.data(), sizes.data(), count);
+            }
+        }
+    } else if (command.compare("H") == 0) {
+        for (size_t i = 0; i < arguments.size() && isValid; i++) {
+            isValid = is_valid_path(arguments[i].c_str());
+        }
+        if (arguments.empty()) {
+            isValid = false;
+        } else if (!isValid) {
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
+        } else {
+            int count = arguments.size();
+            std::vector<Path_operand, Arena_allocator<Path_operand>> paths(count);
+            bool resolved = true;
+            for (int i = 0; i < count && resolved; i++) {
+                resolved = resolve_path(super_block, current_directory, arguments[i].c_str(), &paths[i]);
+            }
+            if (resolved) {
+                fs_delete_batch(paths.data(), count);
+            }
         }
     } else if (command.compare("R") == 0) {
         if (arguments.size() != 2) {
             isValid = false;
-        } else if (arguments[0].size() > 5) {
+        } else if (!is_valid_path(arguments[0].c_str())) {
             isValid = false;
-        } else if (safe_stoi(arguments[1]) < 0 || safe_stoi(arguments[1]) > 126) {
+        } else if (safe_stoi(arguments[1].c_str()) < 0 || safe_stoi(arguments[1].c_str()) > Disk_geometry::block_count - 2) {
             isValid = false;
         } else if (!isMounted) {
             std::cerr << "Error: No file system is mounted\n";
         } else {
-            char * cstr = &(arguments[0][0]);
-            fs_read(cstr, stoi(arguments[1]));
+            Path_operand path;
+            if (resolve_path(super_block, current_directory, arguments[0].c_str(), &path)) {
+                Directory_scope scope(path.directory);
+                fs_read(path.name, safe_stoi(arguments[1].c_str()));
+            }
         }
     } else if (command.compare("W") == 0) {
         if (arguments.size() != 2) {
             isValid = false;
-        } else if (arguments[0].size() > 5) {
+        } else if (!is_valid_path(arguments[0].c_str())) {
             isValid = false;
-        } else if (safe_stoi(arguments[1]) < 0 || safe_stoi(arguments[1]) > 126) {
+        } else if (safe_stoi(arguments[1].c_str()) < 0 || safe_stoi(arguments[1].c_str()) > Disk_geometry::block_count - 2) {
             isValid = false;
         } else if (!isMounted) {
             std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
         } else {
-            char * cstr = &(arguments[0][0]);
-            fs_write(cstr, stoi(arguments[1]));
+            Path_operand path;
+            if (resolve_path(super_block, current_directory, arguments[0].c_str(), &path)) {
+                Directory_scope scope(path.directory);
+                fs_write(path.name, safe_stoi(arguments[1].c_str()));
+            }
         }
     } else if (command.compare("B") == 0) {
         if (arguments.size() < 1) {
             isValid = false;
         } else {
-            std::string message = arguments[0];
+            Arena_string message = arguments[0];
             message.erase(0, message.find_first_not_of(" "));
 
             if (message.size() > BLOCK_SIZE || message.size() < 1) {
@@ -654,28 +1753,99 @@ bool runCommand(std::vector<std::string> arguments) {
     } else if (command.compare("E") == 0) {
         if (arguments.size() != 2) {
             isValid = false;
-        } else if (arguments[0].size() > 5) {
+        } else if (!is_valid_path(arguments[0].c_str())) {
             isValid = false;
-        } else if (safe_stoi(arguments[1]) < 1 || safe_stoi(arguments[1]) > 127) {
+        } else if (safe_stoi(arguments[1].c_str()) < 1 || safe_stoi(arguments[1].c_str()) > Disk_geometry::block_count - 1) {
             isValid = false;
         } else if (!isMounted) {
             std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
         } else {
-            char * cstr = &(arguments[0][0]);
-            fs_resize(cstr, stoi(arguments[1]));
+            Path_operand path;
+            if (resolve_path(super_block, current_directory, arguments[0].c_str(), &path)) {
+                Directory_scope scope(path.directory);
+                fs_resize(path.name, safe_stoi(arguments[1].c_str()));
+            }
         }
     } else if (command.compare("O") == 0) {
         if (arguments.size() != 0) {
             isValid = false;
         } else if (!isMounted) {
             std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
         } else {
             fs_defrag();
         }
+    } else if (command.compare("F") == 0) {
+        if (arguments.size() != 0) {
+            isValid = false;
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else {
+            fs_statfs();
+        }
+    } else if (command.compare("J") == 0) {
+        if (arguments.size() != 0) {
+            isValid = false;
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
+        } else {
+            dedup_disk(disk_name, super_block);
+        }
+    } else if (command.compare("Z") == 0) {
+        if (arguments.size() != 2) {
+            isValid = false;
+        } else if (!is_valid_path(arguments[0].c_str())) {
+            isValid = false;
+        } else if (arguments[1].compare("0") != 0 && arguments[1].compare("1") != 0) {
+            isValid = false;
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
+        } else {
+            Path_operand path;
+            if (resolve_path(super_block, current_directory, arguments[0].c_str(), &path)) {
+                Directory_scope scope(path.directory);
+                fs_compress(path.name, arguments[1].compare("1") == 0);
+            }
+        }
+    } else if (command.compare("X") == 0) {
+        if (arguments.size() != 1) {
+            isValid = false;
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else if (refuse_read_only()) {
+        } else {
+            export_delta(disk_name, arguments[0].c_str());
+        }
+    } else if (command.compare("A") == 0) {
+        if (arguments.size() != 2) {
+            isValid = false;
+        } else if (refuse_read_only(arguments[1].c_str())) {
+        } else {
+            char * delta_path = &(arguments[0][0]);
+            char * target = &(arguments[1][0]);
+            fs_apply(delta_path, target);
+        }
+    } else if (command.compare("V") == 0) {
+        if (arguments.size() != 0) {
+            isValid = false;
+        } else if (!isMounted) {
+            std::cerr << "Error: No file system is mounted\n";
+        } else if (scrub_and_report(disk_name) < 0) {
+            std::cerr << "Error: " << disk_name << " has no checksums\n";
+        }
+    } else if (command.compare("S") == 0) {
+        if (arguments.size() != 0) {
+            isValid = false;
+        } else {
+            fs_stats();
+        }
     } else if (command.compare("Y") == 0) {
         if (arguments.size() != 1) {
             isValid = false;
-        } else if (arguments[0].size() > 5) {
+        } else if (!is_valid_path(arguments[0].c_str())) {
             isValid = false;
         } else if (!isMounted) {
             std::cerr << "Error: No file system is mounted\n";
@@ -690,16 +1860,184 @@ bool runCommand(std::vector<std::string> arguments) {
     return isValid;
 }
 
+/**
+ * @brief Parse one line of a command file and run it. If the command is invalid, a command error
+ * naming the source of the command and its line number is printed. With --output json, everything
+ * the command prints goes in a single JSON record instead (see Output.cc).
+ *
+ * @param command - The line to run
+ * @param source_name - Where the line came from (eg. the command file name)
+ * @param line_number - The line number of the command within its source
+ */
+void run_command_line(std::string & command, const std::string & source_name, int line_number) {
+    // Everything the previous command allocated from the arena is dead by now
+    arena_reset();
+    Command_arguments arguments;
+    output_begin_command();
+
+    if (command.empty()) {
+        std::cerr << "Command Error: " << source_name << ", " << line_number << std::endl;
+        output_end_command(source_name, line_number, "", false);
+        return;
+    }
+
+    // Named by the whole line, taken before the line is split up
+    Trace_span span(command.c_str(), source_name, line_number);
+
+    // We have to parse the "B" command different, since the buffer message can have spaces
+    if (command.at(0) == 'B') {
+        char * command_cstr = const_cast<char*> (command.c_str());
+        char * command_first_arg = strsep(&command_cstr, " ");
+        arguments.push_back(Arena_string(command_first_arg));
+        if (command_cstr != NULL) {
+            arguments.push_back(Arena_string(command_cstr));
+        }
+    } else {
+        tokenize(command, " ", arguments);
+    }
+
+    // runCommand takes the command off the front of the arguments
+    Arena_string command_name = arguments.empty() ? Arena_string() : arguments[0];
+    uint64_t allocations = metrics_allocations();
+    uint64_t started = metrics_now();
+    bool isValid = !arguments.empty() && runCommand(arguments);
+    metrics_record_command(command_name.c_str(), metrics_now() - started, metrics_allocations() - allocations, isValid);
+
+    if (!isValid) {
+        std::cerr << "Command Error: " << source_name << ", " << line_number << std::endl;
+    }
+    output_end_command(source_name, line_number, command_name.c_str(), isValid);
+}
+
+/**
+ * @brief Save the state of the current session (mounted disk, working directory and buffer)
+ *
+ * @param session - Where to save the state
+ */
+void save_session(Session * session) {
+    session->super_block = super_block;
+    session->geometry = geometry;
+    session->disk_name = disk_name;
+    session->current_directory = current_directory;
+    session->buffer = buffer;
+}
+
+/**
+ * @brief Make the given session the current one, so that commands run against its mounted disk,
+ * working directory and buffer.
+ *
+ * @param session - The session to switch to
+ */
+void restore_session(const Session * session) {
+    super_block = session->super_block;
+    geometry = session->geometry;
+    if (disk_name != session->disk_name) {
+        disk_name = session->disk_name;
+    }
+    current_directory = session->current_directory;
+    buffer = session->buffer;
+}
+
+/**
+ * @brief Forget every mounted disk and free its superblock
+ */
+void unmount_all() {
+    for (auto & mounted: mounted_disks) {
+        free_super_block(mounted.super_block);
+    }
+    mounted_disks.clear();
+    mount_table.clear();
+    super_block = NULL;
+    geometry = NULL;
+    disk_name = "";
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
+    // Options come before the command file
+    int arg = 1;
+    const char * socket_path = NULL;
+    const char * stats_path = NULL;
+    bool count_allocations = false;
+    const char * trace_path = NULL;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--direct") == 0) {
+            set_direct_io(true);
+        } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+            socket_path = argv[++arg];
+            serving_sessions = true;
+        } else if (strcmp(argv[arg], "--stats") == 0 && arg + 1 < argc) {
+            stats_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc) {
+            trace_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--count-allocations") == 0) {
+            if (!metrics_counts_allocations()) {
+                std::cerr << "Error: --count-allocations needs the fs_alloc build (make fs_alloc)\n";
+                return 0;
+            }
+            count_allocations = true;
+        } else if (strcmp(argv[arg], "--output") == 0 && arg + 1 < argc) {
+            if (!set_output_format(argv[++arg])) {
+                std::cerr << "Error: Unknown output format " << argv[arg] << std::endl;
+                return 0;
+            }
+        } else if (strcmp(argv[arg], "--read-only") == 0) {
+            read_only_mounts = true;
+        } else if (strcmp(argv[arg], "--checksums") == 0) {
+            set_checksums(true);
+        } else if (strcmp(argv[arg], "--compact-on-failure") == 0) {
+            compact_on_failure = true;
+        } else if (strcmp(argv[arg], "--dedup") == 0) {
+            set_dedup(true);
+        } else if (strcmp(argv[arg], "--grow-headroom") == 0 && arg + 1 < argc) {
+            int percent = safe_stoi(argv[++arg]);
+            if (percent < 0) {
+                std::cerr << "Error: Invalid headroom percentage " << argv[arg] << std::endl;
+                return 0;
+            }
+            set_growth_headroom(percent);
+        } else if (strcmp(argv[arg], "--make-volume") == 0 && arg + 4 < argc) {
+            // --make-volume <descriptor> <stripe unit> <image> <member>...
+            return make_volume(argv[arg + 1], atoi(argv[arg + 2]), argv[arg + 3], &argv[arg + 4], argc - arg - 4);
+        } else if (strcmp(argv[arg], "--build-image") == 0 && arg + 2 < argc) {
+            // --build-image <image> <host directory>
+            return build_image(argv[arg + 1], argv[arg + 2]);
+        } else {
+            std::cerr << "Unknown option " << argv[arg] << ".\n";
+            return 0;
+        }
+        arg++;
+    }
+
+    if (trace_path != NULL) {
+        trace_start(trace_path);
+    }
+
+    if (socket_path != NULL) {
+        if (arg != argc) {
+            std::cerr << "A command file cannot be given with --serve.\n";
+            return 0;
+        }
+        int status = run_server(socket_path);
+        readahead_shutdown();
+        transfer_shutdown();
+        write_stats_file(stats_path);
+        if (count_allocations) {
+            metrics_write_allocations(std::cerr);
+        }
+        trace_finish();
+        unmount_all();
+        return status;
+    }
+
+    if (argc - arg < 1) {
         std::cerr << "Please provide a command file.\n";
         return 0;
-    } else if (argc > 2) {
+    } else if (argc - arg > 1) {
         std::cerr << "Too many arguments. Please provide one command file.\n";
         return 0;
     }
 
-    std::string command_file_name = argv[1];
+    std::string command_file_name = argv[arg];
     std::ifstream command_file (command_file_name);
 
     if (!command_file.is_open()){
@@ -709,30 +2047,21 @@ int main(int argc, char **argv) {
 
     std::string command;
     int line_number = 0;
+    output_start();
     while (getline(command_file, command)) {
         line_number++;
-        std::vector<std::string> arguments;
-
-        // We have to parse the "B" command different, since the buffer message can have spaces
-        if (command.at(0) == 'B') {
-            char * command_cstr = const_cast<char*> (command.c_str());
-            char * command_first_arg = strsep(&command_cstr, " ");
-            arguments.push_back(std::string(command_first_arg));
-            if (command_cstr != NULL) {
-                arguments.push_back(std::string(command_cstr));
-            }
-        } else {
-            arguments = tokenize(command, " ");
-        }
-
-        if (runCommand(arguments) == false) {
-            std::cerr << "Command Error: " << command_file_name << ", " << line_number << std::endl;
-        }
+        run_command_line(command, command_file_name, line_number);
     }
 
-    if (super_block != NULL) {
-        delete super_block;
+    readahead_shutdown();
+    transfer_shutdown();
+    write_stats_file(stats_path);
+    if (count_allocations) {
+        metrics_write_allocations(std::cerr);
     }
+    trace_finish();
+    unmount_all();
+    output_finish();
 
     command_file.close();
 
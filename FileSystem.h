@@ -2,10 +2,13 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string>
+
+#include "Geometry.h"
 
 // Constants
 #define ROOT 127
-#define BLOCK_SIZE 1024
+#define BLOCK_SIZE Standard_geometry::block_size
 
 typedef struct {
 	char name[5];        // Name of the file or directory
@@ -14,12 +17,27 @@ typedef struct {
 	uint8_t dir_parent;  // Inode mode and the index of the parent inode
 } Inode;
 
+template <typename G>
+struct Basic_super_block {
+	char free_block_list[G::block_count / 8];
+	Inode inode[G::inode_count];
+};
+
+// Storage for a superblock. Disks of every supported geometry are loaded into this.
+typedef Basic_super_block<Standard_geometry> Super_block;
+
+struct Geometry_engine;
+
+// Per-client state when commands from several clients share one process
 typedef struct {
-	char free_block_list[16];
-	Inode inode[126];
-} Super_block;
+    Super_block * super_block; // The mounted disk's superblock, NULL if nothing is mounted
+    const Geometry_engine * geometry; // The engine for the mounted disk's geometry
+    std::string disk_name;
+    uint8_t current_directory;
+    uint8_t * buffer;
+} Session;
 
-void fs_mount(char *new_disk_name);
+void fs_mount(char *new_disk_name, char *mount_name);
 void fs_create(char name[5], int size);
 void fs_delete(char name[5]);
 void fs_read(char name[5], int block_num);
@@ -28,4 +46,10 @@ void fs_buff(uint8_t buff[1024], int size);
 void fs_ls();
 void fs_resize(char name[5], int new_size);
 void fs_defrag();
-void fs_cd(char name[5]);
\ No newline at end of file
+void fs_cd(char * path);
+void fs_use(char *mount_name);
+void fs_copy(char *source, char *destination);
+
+void run_command_line(std::string & command, const std::string & source_name, int line_number);
+void save_session(Session * session);
+void restore_session(const Session * session);
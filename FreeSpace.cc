@@ -0,0 +1,136 @@
+#include <string.h>
+
+#include "FreeSpace.h"
+#include "IO.h"
+
+/**
+ * @brief Count the free blocks right before a block, back to the first data block
+ */
+static int free_run_before(Super_block * super_block, int block_number) {
+    int length = 0;
+    while (block_number - length - 1 >= 1 && is_block_free(block_number - length - 1, super_block)) {
+        length++;
+    }
+    return length;
+}
+
+/**
+ * @brief Count the free blocks right after a block, up to the last block of the disk
+ */
+static int free_run_after(Super_block * super_block, int block_number) {
+    int length = 0;
+    while (block_number + length + 1 < Disk_geometry::block_count && is_block_free(block_number + length + 1, super_block)) {
+        length++;
+    }
+    return length;
+}
+
+/**
+ * @brief Count the free space of a superblock from scratch, after it is read from the disk
+ *
+ * @param super_block - The superblock, allocated with allocate_super_block()
+ */
+void free_space_rebuild(Super_block * super_block) {
+    Free_space_index * index = free_space_index(super_block);
+    memset(index, 0, sizeof(Free_space_index));
+    int block_number = 1;
+    while (block_number < Disk_geometry::block_count) {
+        if (!is_block_free(block_number, super_block)) {
+            block_number++;
+            continue;
+        }
+        int length = 1 + free_run_after(super_block, block_number);
+        index->extents_of_length[length]++;
+        index->summary.free_extents++;
+        index->summary.free_blocks += length;
+        if (length > index->summary.largest_extent) {
+            index->summary.largest_extent = length;
+        }
+        block_number += length;
+    }
+}
+
+/**
+ * @brief Account for a free block that was just allocated: the extent it was in is split in two
+ * around it. Only the blocks next to it are looked at, so this costs as much as the extent is long.
+ *
+ * @param super_block - The superblock, with the block's bit already set
+ * @param block_number - The block that was allocated
+ */
+void note_block_allocated(Super_block * super_block, int block_number) {
+    if (block_number < 1 || block_number >= Disk_geometry::block_count) {
+        return;
+    }
+    Free_space_index * index = free_space_index(super_block);
+    int before = free_run_before(super_block, block_number);
+    int after = free_run_after(super_block, block_number);
+
+    index->extents_of_length[before + 1 + after]--;
+    index->summary.free_extents--;
+    if (before > 0) {
+        index->extents_of_length[before]++;
+        index->summary.free_extents++;
+    }
+    if (after > 0) {
+        index->extents_of_length[after]++;
+        index->summary.free_extents++;
+    }
+    index->summary.free_blocks--;
+
+    // The largest extent only shrinks when the last extent of its length was split
+    while (index->summary.largest_extent > 0 && index->extents_of_length[index->summary.largest_extent] == 0) {
+        index->summary.largest_extent--;
+    }
+}
+
+/**
+ * @brief Account for a block in use that was just freed: it joins the extents on either side of it
+ *
+ * @param super_block - The superblock, with the block's bit already cleared
+ * @param block_number - The block that was freed
+ */
+void note_block_freed(Super_block * super_block, int block_number) {
+    if (block_number < 1 || block_number >= Disk_geometry::block_count) {
+        return;
+    }
+    Free_space_index * index = free_space_index(super_block);
+    int before = free_run_before(super_block, block_number);
+    int after = free_run_after(super_block, block_number);
+
+    if (before > 0) {
+        index->extents_of_length[before]--;
+        index->summary.free_extents--;
+    }
+    if (after > 0) {
+        index->extents_of_length[after]--;
+        index->summary.free_extents--;
+    }
+    int merged = before + 1 + after;
+    index->extents_of_length[merged]++;
+    index->summary.free_extents++;
+    index->summary.free_blocks++;
+    if (merged > index->summary.largest_extent) {
+        index->summary.largest_extent = merged;
+    }
+}
+
+/**
+ * @brief Get the free space of a loaded disk, without scanning its free block list
+ *
+ * @param super_block - The disk's superblock, allocated with allocate_super_block()
+ * @return The free space of the disk
+ */
+Free_space free_space_summary(const Super_block * super_block) {
+    return free_space_index(const_cast<Super_block *>(super_block))->summary;
+}
+
+/**
+ * @brief How scattered the free space of a disk is: 0 when it is all one extent, approaching 1 as
+ * it is split into more and smaller extents
+ *
+ * @param space - The free space of the disk
+ * @return The fragmentation index
+ */
+double fragmentation_index(const Free_space & space) {
+    return space.free_blocks > 0 ? 1.0 - (double) space.largest_extent / space.free_blocks : 0.0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+// The free space of a disk, outside the superblock
+typedef struct {
+    int free_blocks;
+    int free_extents;   // Runs of free blocks
+    int largest_extent; // Blocks in the longest run of free blocks
+} Free_space;
+
+// The free space of a loaded disk, kept up to date as blocks are allocated and freed so that it can
+// be reported without scanning the free block list
+typedef struct {
+    Free_space summary;
+    uint8_t extents_of_length[Standard_geometry::block_count + 1]; // Free extents of each length
+} Free_space_index;
+
+Free_space_index * free_space_index(Super_block * super_block);
+void free_space_rebuild(Super_block * super_block);
+void note_block_allocated(Super_block * super_block, int block_number);
+void note_block_freed(Super_block * super_block, int block_number);
+Free_space free_space_summary(const Super_block * super_block);
+double fragmentation_index(const Free_space & space);
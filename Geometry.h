@@ -0,0 +1,33 @@
+#pragma once
+
+/**
+ * @brief Describes the shape of a disk: the size of a block, the number of blocks (including the
+ * superblock) and the number of inodes. Everything is a compile-time constant, so code templated
+ * on a geometry gets constant loop bounds and fixed-size arrays.
+ */
+template <int Block_size, int Block_count, int Inode_count>
+struct Geometry {
+    static constexpr int block_size = Block_size;
+    static constexpr int block_count = Block_count;
+    static constexpr int inode_count = Inode_count;
+};
+
+// The geometry of the disks this simulator has always used: 128 blocks of 1 KB and 126 inodes
+typedef Geometry<1024, 128, 126> Standard_geometry;
+
+/**
+ * @brief The same fields as a Geometry, but set at run time from the disk being mounted. Only used
+ * by the generic build (make fs_generic), to measure what the specialized engines save.
+ */
+struct Runtime_geometry {
+    static int block_size;
+    static int block_count;
+    static int inode_count;
+};
+
+// The geometry the command code is compiled against
+#ifdef GENERIC_GEOMETRY
+typedef Runtime_geometry Disk_geometry;
+#else
+typedef Standard_geometry Disk_geometry;
+#endif
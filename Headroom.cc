@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <string.h>
+
+#include "Engine.h"
+#include "Headroom.h"
+#include "InodeMirror.h"
+#include "IO.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+// Headroom reserved after a file that grows, as a percentage of its new size. 0 turns it off.
+static int headroom_percent = 0;
+
+/**
+ * @brief Set the growth headroom policy for the rest of the run
+ *
+ * @param percent - Blocks to reserve after a file that grows, as a percentage of its new size
+ */
+void set_growth_headroom(int percent) {
+    headroom_percent = percent;
+}
+
+/**
+ * @brief Blocks of headroom a file of the given size should get
+ */
+static int headroom_for(int size) {
+    return (size * headroom_percent + 99) / 100;
+}
+
+/**
+ * @brief Copy the free block list of a superblock with every reserved block marked as used. The
+ * reservations only live in the inode mirror, so on the disk these blocks stay free.
+ *
+ * @param super_block - The superblock
+ * @param masked - Set to the copy. Only its free block list is filled in.
+ */
+void mask_reserved_blocks(Super_block * super_block, Super_block * masked) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    memcpy(masked->free_block_list, super_block->free_block_list, sizeof(masked->free_block_list));
+    for (int i = next_inode(mirror->used, 0); i >= 0; i = next_inode(mirror->used, i + 1)) {
+        int first_reserved = mirror->start[i] + mirror->size[i];
+        for (int block = first_reserved; block < first_reserved + mirror->headroom[i]; block++) {
+            masked->free_block_list[block / 8] |= 1 << (7 - block % 8);
+        }
+    }
+}
+
+/**
+ * @brief Give up the part of every reservation that overlaps a run of blocks about to be allocated
+ *
+ * @param super_block - The superblock
+ * @param first_block - The first block of the run
+ * @param size - The length of the run
+ */
+void reclaim_headroom(Super_block * super_block, int first_block, int size) {
+    Inode_mirror * mirror = inode_mirror(super_block);
+    for (int i = next_inode(mirror->used, 0); i >= 0; i = next_inode(mirror->used, i + 1)) {
+        int first_reserved = mirror->start[i] + mirror->size[i];
+        if (mirror->headroom[i] == 0 || first_reserved >= first_block + size || first_block >= first_reserved + mirror->headroom[i]) {
+            continue;
+        }
+        int kept = std::max(0, first_block - first_reserved);
+        metrics_add(COUNTER_HEADROOM_RECLAIMED, mirror->headroom[i] - kept);
+        mirror->headroom[i] = kept;
+    }
+}
+
+/**
+ * @brief Find the first run of free blocks of the given length that no file has reserved. When
+ * there is none, reserved blocks are used after all and the reservations they belonged to shrink.
+ *
+ * @param super_block - The superblock to search
+ * @param disk_geometry - The engine for the disk
+ * @param size - The number of contiguous blocks needed
+ * @param start_block - Block to start the search at
+ * @param end_block - Block to end the search at
+ * @return The first block of the run, or -1 if there is no such run.
+ */
+int find_unreserved_run(Super_block * super_block, const Geometry_engine * disk_geometry, int size, int start_block, int end_block) {
+    if (headroom_percent == 0) {
+        return disk_geometry->find_free_run(super_block, size, start_block, end_block);
+    }
+
+    Super_block masked;
+    mask_reserved_blocks(super_block, &masked);
+    int first_block = disk_geometry->find_free_run(&masked, size, start_block, end_block);
+    if (first_block < 0) {
+        first_block = disk_geometry->find_free_run(super_block, size, start_block, end_block);
+        if (first_block >= 0) {
+            reclaim_headroom(super_block, first_block, size);
+        }
+    }
+    return first_block;
+}
+
+/**
+ * @brief Find where to move a file that has to grow out of place. A run with room for the file's
+ * headroom after it is preferred, so that its next grows can stay in place.
+ *
+ * @param super_block - The superblock to search
+ * @param disk_geometry - The engine for the disk
+ * @param size - The new size of the file
+ * @return The first block of the run, or -1 if there is no run of the file's size.
+ */
+int find_growing_run(Super_block * super_block, const Geometry_engine * disk_geometry, int size) {
+    Trace_span span("find_growing_run", 1, size);
+    int headroom = headroom_for(size);
+    if (headroom > 0) {
+        Super_block masked;
+        mask_reserved_blocks(super_block, &masked);
+        int first_block = disk_geometry->find_free_run(&masked, size + headroom, 1, disk_geometry->block_count);
+        if (first_block >= 0) {
+            return first_block;
+        }
+    }
+    return find_unreserved_run(super_block, disk_geometry, size, 1, disk_geometry->block_count);
+}
+
+/**
+ * @brief Reserve headroom after a file that just grew: as many of the free blocks right after it
+ * as the policy gives its size. No other file's reservation can start in those blocks, since it
+ * would have to follow a file in between.
+ *
+ * @param super_block - The superblock holding the file
+ * @param disk_geometry - The engine for the disk
+ * @param inode_index - The file's inode
+ */
+void reserve_headroom(Super_block * super_block, const Geometry_engine * disk_geometry, int inode_index) {
+    Inode_mirror * mirror = inode_mirror(super_block);
+    int first_reserved = mirror->start[inode_index] + mirror->size[inode_index];
+    int wanted = headroom_for(mirror->size[inode_index]);
+    int reserved = 0;
+    while (reserved < wanted && first_reserved + reserved < disk_geometry->block_count &&
+           is_block_free(first_reserved + reserved, super_block)) {
+        reserved++;
+    }
+    mirror->headroom[inode_index] = reserved;
+}
+
+/**
+ * @brief Release the headroom of a file, when it shrinks or is about to move
+ *
+ * @param super_block - The superblock holding the file
+ * @param inode_index - The file's inode
+ */
+void drop_headroom(Super_block * super_block, int inode_index) {
+    inode_mirror(super_block)->headroom[inode_index] = 0;
+}
+
+/**
+ * @brief Release the headroom of every file on a disk, when its files are packed together
+ *
+ * @param super_block - The superblock
+ */
+void drop_all_headroom(Super_block * super_block) {
+    Inode_mirror * mirror = inode_mirror(super_block);
+    memset(mirror->headroom, 0, sizeof(mirror->headroom));
+}
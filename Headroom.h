@@ -0,0 +1,12 @@
+#pragma once
+
+#include "FileSystem.h"
+
+void set_growth_headroom(int percent);
+void mask_reserved_blocks(Super_block * super_block, Super_block * masked);
+int find_unreserved_run(Super_block * super_block, const Geometry_engine * disk_geometry, int size, int start_block, int end_block);
+void reclaim_headroom(Super_block * super_block, int first_block, int size);
+int find_growing_run(Super_block * super_block, const Geometry_engine * disk_geometry, int size);
+void reserve_headroom(Super_block * super_block, const Geometry_engine * disk_geometry, int inode_index);
+void drop_headroom(Super_block * super_block, int inode_index);
+void drop_all_headroom(Super_block * super_block);
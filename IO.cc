@@ -1,37 +1,641 @@
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
+#include "BlockMap.h"
+#include "BlockPool.h"
+#include "FreeSpace.h"
 #include "InodeHelper.h"
+#include "InodeMirror.h"
 #include "IO.h"
+#include "Metrics.h"
+#include "ReadAhead.h"
+#include "Trace.h"
+
+// Whether disks should be opened with O_DIRECT. Cleared by the transfer workers too, when a disk
+// refuses a direct transfer.
+static std::atomic<bool> direct_io(false);
+
+// Disks opened so far and, for striped volumes, their layout. Descriptors, checksum regions and
+// changed blocks are read only once. A disk is known by the device and inode of its file, so that
+// every name it is given (eg. "disk" and "./disk") finds the same lock and the same sidecars.
+typedef struct {
+    std::string disk_name;      // The name the disk was first seen under
+    bool identified;            // The disk's file existed when it was first seen
+    dev_t device;
+    ino_t inode;
+    bool is_volume;
+    Volume_layout layout;
+    Block_checksums * checksums;
+    Changed_blocks * changes;
+    int lock_fd;                // Holds the disk's lock while it is mounted, -1 if it is not locked
+    const uint8_t * mapping;    // The disk mapped read-only, for read-only mounts of image files
+    size_t mapping_size;
+} Known_disk;
+static std::vector<Known_disk> known_disks;
+
+// The part of a multi-block transfer that falls on one member of a striped volume. The member's
+// share is always a contiguous range of the member file, but is scattered over the buffer.
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t size;
+    bool write;
+    bool done_ok;
+    int piece_count;
+    struct iovec pieces[MAX_TRANSFER_PIECES];
+} Member_transfer;
+
+// Workers that run member transfers in parallel with the calling thread
+static std::mutex transfer_mutex;
+static std::condition_variable transfer_queued;
+static std::condition_variable transfer_finished;
+static Member_transfer * transfer_queue[MAX_VOLUME_MEMBERS];
+static std::vector<std::thread> transfer_workers;
+static int queued_transfers = 0;
+static int unfinished_transfers = 0;
+static bool stop_transfer_workers = false;
+
+/**
+ * @brief Turn direct I/O on or off for disks opened from now on. With direct I/O, the disk is
+ * opened with O_DIRECT so the host page cache is bypassed.
+ *
+ * @param enabled - True to open disks with O_DIRECT
+ */
+void set_direct_io(bool enabled) {
+    direct_io = enabled;
+}
+
+/**
+ * @brief Give up on direct I/O for the rest of the run because the host file system does not
+ * support it. Warns once.
+ */
+static void fall_back_to_buffered_io() {
+    if (direct_io.exchange(false)) {
+        std::cerr << "Warning: Direct I/O is not supported for this disk, falling back to buffered I/O\n";
+    }
+}
+
+/**
+ * @brief Open an image file with the given flags, adding O_DIRECT when direct I/O is on. If the host
+ * file system rejects O_DIRECT, the file is opened normally instead.
+ *
+ * @param file_name - The image file to open
+ * @param flags - The open flags, eg. O_RDWR
+ * @return The file descriptor, or -1 on failure
+ */
+static int open_image_file(const std::string & file_name, int flags) {
+    if (direct_io) {
+        int fd = open(file_name.c_str(), flags | O_DIRECT);
+        if (fd >= 0 || errno != EINVAL) {
+            return fd;
+        }
+        fall_back_to_buffered_io();
+    }
+    return open(file_name.c_str(), flags);
+}
+
+/**
+ * @brief Look up a disk, reading its volume descriptor, its checksum region and its changed blocks
+ * the first time the disk is seen. A disk is looked up by the name it was first seen under, and
+ * otherwise by the device and inode of its file.
+ *
+ * @param disk_name - The disk to look up
+ * @return What is known about the disk. Only valid until the next disk is seen.
+ */
+static Known_disk * find_known_disk(const std::string & disk_name) {
+    for (auto & known: known_disks) {
+        if (known.disk_name == disk_name) {
+            return &known;
+        }
+    }
+
+    struct stat disk_stat;
+    bool identified = stat(disk_name.c_str(), &disk_stat) == 0;
+    if (identified) {
+        for (auto & known: known_disks) {
+            if (known.identified && known.device == disk_stat.st_dev && known.inode == disk_stat.st_ino) {
+                return &known;
+            }
+        }
+    }
+
+    Known_disk known;
+    known.disk_name = disk_name;
+    known.identified = identified;
+    known.device = identified ? disk_stat.st_dev : 0;
+    known.inode = identified ? disk_stat.st_ino : 0;
+    known.is_volume = read_volume_layout(disk_name, &known.layout);
+    known.checksums = load_block_checksums(disk_name);
+    known.changes = load_changed_blocks(disk_name);
+    known.lock_fd = -1;
+    known.mapping = NULL;
+    known.mapping_size = 0;
+    known_disks.push_back(known);
+    return &known_disks.back();
+}
+
+/**
+ * @brief Look up the layout of a disk, reading its volume descriptor the first time the disk is seen
+ *
+ * @param disk_name - The disk to look up
+ * @return The layout if the disk is a striped volume, or NULL if it is a plain image file
+ */
+static const Volume_layout * find_volume_layout(const std::string & disk_name) {
+    Known_disk * known = find_known_disk(disk_name);
+    return known->is_volume ? &known->layout : NULL;
+}
+
+/**
+ * @brief Check that the disk is usable before it is mounted. For a striped volume, every member must
+ * belong to the volume; plain image files always pass.
+ *
+ * @param disk_name - The disk to check
+ * @return True if the disk can be mounted. False otherwise.
+ */
+bool check_disk_members(const std::string & disk_name) {
+    const Volume_layout * layout = find_volume_layout(disk_name);
+    return layout == NULL || check_volume_members(disk_name, layout);
+}
+
+/**
+ * @brief Open the disk with the given flags. The disk is either a plain image file or the descriptor
+ * of a striped volume, in which case every member image file is opened.
+ *
+ * @param disk_name - The disk to open
+ * @param flags - The open flags, eg. O_RDWR
+ * @param disk - The handle to open. Must be closed with close_disk(), even if opening failed.
+ * @return True if the disk was opened. False otherwise, and transfers on the handle will fail.
+ */
+bool open_disk(const std::string & disk_name, int flags, Disk * disk) {
+    const Volume_layout * layout = find_volume_layout(disk_name);
+    Known_disk * known = find_known_disk(disk_name);
+    disk->checksums = known->checksums;
+    disk->changes = known->changes;
+    disk->mapping = NULL;
+    disk->mapping_size = 0;
+    if (known->mapping != NULL && (flags & O_ACCMODE) == O_RDONLY) {
+        // Reads of a disk mounted read-only come from its mapping, without opening anything
+        disk->mapping = known->mapping;
+        disk->mapping_size = known->mapping_size;
+        disk->member_count = 0;
+        return true;
+    } else if (layout == NULL) {
+        disk->member_count = 1;
+        disk->stripe_unit = 1;
+        disk->data_offset = 0;
+        disk->fds[0] = open_image_file(disk_name, flags);
+    } else {
+        disk->member_count = layout->member_count;
+        disk->stripe_unit = layout->stripe_unit;
+        disk->data_offset = BLOCK_SIZE;
+        for (int i = 0; i < layout->member_count; i++) {
+            disk->fds[i] = open_image_file(layout->members[i], flags);
+        }
+    }
+
+    for (int i = 0; i < disk->member_count; i++) {
+        if (disk->fds[i] < 0) {
+            disk->member_count = i;
+            close_disk(disk);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Lock a disk being mounted, for the rest of the run, so that other processes cannot change
+ * it under this one. A read-only mount takes a shared lock, which any number of read-only mounts in
+ * other processes can hold at once, and maps the disk read-only so that all of them share its pages
+ * in the page cache; a read-write mount takes an exclusive lock. Striped volumes lock their
+ * descriptor and are not mapped.
+ *
+ * @param disk_name - The disk
+ * @param read_only - True for a read-only mount
+ * @return False if another process holds a lock that conflicts with this one
+ */
+bool lock_disk(const std::string & disk_name, bool read_only) {
+    Known_disk * known = find_known_disk(disk_name);
+    if (known->lock_fd >= 0) {
+        return true;
+    }
+    int fd = open(disk_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (flock(fd, (read_only ? LOCK_SH : LOCK_EX) | LOCK_NB) != 0) {
+        std::cerr << "Error: Disk " << disk_name << " is in use by another process\n";
+        close(fd);
+        return false;
+    }
+
+    struct stat disk_stat;
+    if (read_only && !known->is_volume && fstat(fd, &disk_stat) == 0 && disk_stat.st_size > 0) {
+        void * mapping = mmap(NULL, disk_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            known->mapping = (const uint8_t *) mapping;
+            known->mapping_size = disk_stat.st_size;
+        }
+    }
+    known->lock_fd = fd;
+    return true;
+}
+
+/**
+ * @brief Give up the lock and the mapping of a disk, when mounting it failed
+ *
+ * @param disk_name - The disk
+ */
+void unlock_disk(const std::string & disk_name) {
+    Known_disk * known = find_known_disk(disk_name);
+    if (known->mapping != NULL) {
+        munmap(const_cast<uint8_t *>(known->mapping), known->mapping_size);
+        known->mapping = NULL;
+        known->mapping_size = 0;
+    }
+    if (known->lock_fd >= 0) {
+        close(known->lock_fd);
+        known->lock_fd = -1;
+    }
+}
+
+/**
+ * @brief Close a disk opened with open_disk()
+ *
+ * @param disk - The disk to close
+ */
+void close_disk(Disk * disk) {
+    for (int i = 0; i < disk->member_count; i++) {
+        close(disk->fds[i]);
+    }
+    disk->member_count = 0;
+}
+
+/**
+ * @brief Count the blocks an opened disk holds, over all of its members
+ *
+ * @param disk - The disk
+ * @return The number of blocks, including the superblock
+ */
+int count_disk_blocks(Disk * disk) {
+    if (disk->mapping != NULL) {
+        return disk->mapping_size / BLOCK_SIZE;
+    }
+    int blocks = 0;
+    for (int i = 0; i < disk->member_count; i++) {
+        struct stat member_stat;
+        if (fstat(disk->fds[i], &member_stat) == 0 && member_stat.st_size > disk->data_offset) {
+            blocks += (member_stat.st_size - disk->data_offset) / BLOCK_SIZE;
+        }
+    }
+    return blocks;
+}
+
+/**
+ * @brief If the file descriptor was opened with O_DIRECT, clear the flag so a failed transfer
+ * can be retried through the page cache.
+ *
+ * @param fd - The file descriptor of the disk
+ * @return True if O_DIRECT was cleared and the transfer should be retried
+ */
+static bool clear_direct_flag(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || !(flags & O_DIRECT)) {
+        return false;
+    }
+    fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    fall_back_to_buffered_io();
+    return true;
+}
+
+/**
+ * @brief preadv()/pwritev() that falls back to buffered I/O when the disk refuses a direct transfer
+ * (eg. the block offset is not aligned to the device's sector size).
+ *
+ * @param transfer - The transfer to run
+ * @return True if the whole transfer was done
+ */
+static bool run_member_transfer(Member_transfer * transfer) {
+    Trace_span span(transfer->write ? "disk_write" : "disk_read", (int) (transfer->offset / BLOCK_SIZE), (int) (transfer->size / BLOCK_SIZE));
+    ssize_t size;
+    if (transfer->write) {
+        size = pwritev(transfer->fd, transfer->pieces, transfer->piece_count, transfer->offset);
+        if (size < 0 && errno == EINVAL && clear_direct_flag(transfer->fd)) {
+            size = pwritev(transfer->fd, transfer->pieces, transfer->piece_count, transfer->offset);
+        }
+    } else {
+        size = preadv(transfer->fd, transfer->pieces, transfer->piece_count, transfer->offset);
+        if (size < 0 && errno == EINVAL && clear_direct_flag(transfer->fd)) {
+            size = preadv(transfer->fd, transfer->pieces, transfer->piece_count, transfer->offset);
+        }
+    }
+    transfer->done_ok = size == (ssize_t) transfer->size;
+    return transfer->done_ok;
+}
+
+/**
+ * @brief Worker thread running member transfers queued by run_member_transfers()
+ */
+static void transfer_worker_loop() {
+    std::unique_lock<std::mutex> lock(transfer_mutex);
+    while (true) {
+        while (queued_transfers == 0 && !stop_transfer_workers) {
+            transfer_queued.wait(lock);
+        }
+        if (queued_transfers == 0) {
+            return;
+        }
+        Member_transfer * transfer = transfer_queue[--queued_transfers];
+        lock.unlock();
+        run_member_transfer(transfer);
+        lock.lock();
+        if (--unfinished_transfers == 0) {
+            transfer_finished.notify_all();
+        }
+    }
+}
+
+/**
+ * @brief Run the member transfers of a striped transfer in parallel: the calling thread runs the
+ * first one while worker threads run the others.
+ *
+ * @param transfers - The transfers to run, at most one per member
+ * @param count - The number of transfers
+ * @return True if every transfer was done in full
+ */
+static bool run_member_transfers(Member_transfer * transfers, int count) {
+    if (count > 1) {
+        std::unique_lock<std::mutex> lock(transfer_mutex);
+        while ((int) transfer_workers.size() < count - 1) {
+            transfer_workers.push_back(std::thread(transfer_worker_loop));
+        }
+        for (int i = 1; i < count; i++) {
+            transfer_queue[queued_transfers++] = &transfers[i];
+        }
+        unfinished_transfers += count - 1;
+        transfer_queued.notify_all();
+    }
+
+    run_member_transfer(&transfers[0]);
+
+    if (count > 1) {
+        std::unique_lock<std::mutex> lock(transfer_mutex);
+        while (unfinished_transfers > 0) {
+            transfer_finished.wait(lock);
+        }
+    }
+
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        ok = ok && transfers[i].done_ok;
+    }
+    return ok;
+}
+
+/**
+ * @brief Stop the worker threads used for striped transfers. Must be called before the process exits.
+ */
+void transfer_shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(transfer_mutex);
+        stop_transfer_workers = true;
+    }
+    transfer_queued.notify_all();
+    for (auto & worker: transfer_workers) {
+        worker.join();
+    }
+    transfer_workers.clear();
+}
 
 /**
- * @brief Allocate the block in the superblock's free list by setting its bit to 1
+ * @brief Check blocks just read from a disk against their checksums. Every block that fails is
+ * reported, unless the caller asks to be told which blocks failed instead.
+ *
+ * @param disk - The disk the blocks were read from
+ * @param buff - The blocks read
+ * @param block_number - The first block read
+ * @param count - The number of blocks read
+ * @param failed - Set for every block that fails, indexed by block, with nothing reported. NULL to
+ * report the blocks that fail on stderr.
+ * @return False if a block failed its checksum. True if they all passed or the disk has no checksums.
+ */
+static bool verify_blocks_read(Disk * disk, const uint8_t * buff, int block_number, int count, bool * failed) {
+    if (failed != NULL) {
+        return disk->checksums == NULL || verify_block_checksums(disk->checksums, buff, block_number, count, failed) == 0;
+    }
+    bool reported[Standard_geometry::block_count] = {false};
+    failed = reported;
+    if (disk->checksums == NULL || verify_block_checksums(disk->checksums, buff, block_number, count, failed) == 0) {
+        return true;
+    }
+    for (int block = block_number; block < block_number + count && block < Standard_geometry::block_count; block++) {
+        if (failed[block]) {
+            std::cerr << "Error: Block " << block << " failed its checksum\n";
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Read count consecutive blocks of a disk mounted read-only from its mapping. The mapping
+ * cannot be written.
+ *
+ * @param disk - The disk to read from
+ * @param buff - Where to read the blocks to, count blocks long
+ * @param block_number - The first block to read
+ * @param count - The number of blocks to read
+ * @param write - Must be false
+ * @param failed - See verify_blocks_read()
+ * @return True if every block was read
+ */
+static bool read_mapped_blocks(Disk * disk, uint8_t * buff, int block_number, int count, bool write, bool * failed) {
+    size_t offset = (size_t) BLOCK_SIZE * block_number;
+    size_t size = (size_t) BLOCK_SIZE * count;
+    if (write || offset + size > disk->mapping_size) {
+        return false;
+    }
+    memcpy(buff, disk->mapping + offset, size);
+    metrics_add(COUNTER_BLOCK_READS, count);
+    return verify_blocks_read(disk, buff, block_number, count, failed);
+}
+
+/**
+ * @brief Read or write count consecutive blocks of the disk. On a plain image file this is a single
+ * pread/pwrite. On a striped volume, the blocks are split by member and each member's share is
+ * moved with one preadv/pwritev, all members in parallel. On a disk with checksums, the blocks read
+ * are verified and the checksums of the blocks written are updated.
+ *
+ * @param disk - The disk to transfer to or from
+ * @param buff - The data, count blocks long
+ * @param block_number - The first block of the transfer
+ * @param count - The number of blocks to transfer
+ * @param write - True to write buff to the disk, false to read the disk into buff
+ * @param failed - For reads, see verify_blocks_read() - default is to report failed blocks
+ * @return True if every block was transferred
+ */
+static bool transfer_blocks(Disk * disk, uint8_t * buff, int block_number, int count, bool write, bool * failed = NULL) {
+    if (disk->mapping != NULL) {
+        return read_mapped_blocks(disk, buff, block_number, count, write, failed);
+    }
+    if (disk->member_count == 0) {
+        return false;
+    }
+
+    Member_transfer transfers[MAX_VOLUME_MEMBERS];
+    int transfer_of_member[MAX_VOLUME_MEMBERS];
+    int transfer_count = 0;
+    for (int i = 0; i < disk->member_count; i++) {
+        transfer_of_member[i] = -1;
+    }
+
+    int i = 0;
+    while (i < count) {
+        int block = block_number + i;
+        int member = 0;
+        int member_block = block;
+        int run = count - i;
+        if (disk->member_count > 1) {
+            locate_volume_block(disk->stripe_unit, disk->member_count, block, &member, &member_block);
+            run = std::min(disk->stripe_unit - block % disk->stripe_unit, count - i);
+        }
+
+        if (transfer_of_member[member] < 0) {
+            Member_transfer * transfer = &transfers[transfer_count];
+            transfer->fd = disk->fds[member];
+            transfer->offset = disk->data_offset + (off_t) BLOCK_SIZE * member_block;
+            transfer->size = 0;
+            transfer->write = write;
+            transfer->done_ok = false;
+            transfer->piece_count = 0;
+            transfer_of_member[member] = transfer_count++;
+        }
+
+        Member_transfer * transfer = &transfers[transfer_of_member[member]];
+        transfer->pieces[transfer->piece_count].iov_base = buff + (size_t) BLOCK_SIZE * i;
+        transfer->pieces[transfer->piece_count].iov_len = (size_t) BLOCK_SIZE * run;
+        transfer->piece_count++;
+        transfer->size += (size_t) BLOCK_SIZE * run;
+        i += run;
+    }
+
+    // A write that fails may still have changed some of the blocks
+    if (write && disk->changes != NULL) {
+        mark_changed_blocks(disk->changes, block_number, count);
+    }
+    if (!run_member_transfers(transfers, transfer_count)) {
+        return false;
+    }
+    metrics_add(write ? COUNTER_BLOCK_WRITES : COUNTER_BLOCK_READS, count);
+
+    if (disk->checksums != NULL && write) {
+        update_block_checksums(disk->checksums, buff, block_number, count);
+        return true;
+    }
+    return verify_blocks_read(disk, buff, block_number, count, failed);
+}
+
+/**
+ * @brief Give a disk a checksum region if it has none yet, computed from the blocks on the disk now.
+ * Done when a disk is mounted with --checksums.
+ *
+ * @param disk_name - The disk
+ * @return False if the disk has no checksum region and one could not be made
+ */
+bool add_block_checksums(const std::string & disk_name) {
+    Known_disk * known = find_known_disk(disk_name);
+    if (known->checksums != NULL) {
+        return true;
+    }
+
+    Disk disk;
+    if (!open_disk(disk_name, O_RDONLY, &disk)) {
+        return false;
+    }
+    int count = std::min(count_disk_blocks(&disk), Standard_geometry::block_count);
+    uint8_t * blocks = extent_buffer();
+    bool read = transfer_blocks(&disk, blocks, 0, count, false);
+    close_disk(&disk);
+    if (!read) {
+        std::cerr << "Error: Reading blocks from disk\n";
+        return false;
+    }
+    known->checksums = create_block_checksums(disk_name, blocks, count);
+    return known->checksums != NULL;
+}
+
+/**
+ * @brief Get the blocks written to a disk since its last checkpoint, starting to track them if the
+ * disk was never exported
+ *
+ * @param disk_name - The disk
+ * @return The disk's changed blocks, or NULL if they could not be tracked
+ */
+Changed_blocks * track_changes(const std::string & disk_name) {
+    Known_disk * known = find_known_disk(disk_name);
+    if (known->changes == NULL) {
+        known->changes = create_changed_blocks(disk_name);
+    }
+    return known->changes;
+}
+
+/**
+ * @brief Allocate the block in the superblock's free list by setting its bit to 1. Blocks past the
+ * end of the disk have no bit, and are left alone.
  * 
  * @param block_number - The block index to allocate
  * @param super_block - The super block with the free list to change
  */
 void allocate_block_in_free_list(int block_number, Super_block * super_block) {
+    if (block_number >= Disk_geometry::block_count) {
+        return;
+    }
     int free_block_list_index = block_number/8;
     int bit_number = 7 - (block_number % 8);
 
     char * byte = &(super_block->free_block_list[free_block_list_index]);
+    bool was_free = !((*byte >> bit_number) & 1);
     *byte |= 1UL << bit_number;
+    forget_block_contents(super_block, block_number);
+    if (was_free) {
+        note_block_allocated(super_block, block_number);
+    }
 }
 
 /**
- * @brief Free the block in the superblock's free list by setting its bit to 0
+ * @brief Free the block in the superblock's free list by setting its bit to 0. Blocks past the end
+ * of the disk, which a file written by an older version can run into, have no bit and are left alone.
  * 
  * @param block_number - The block index to free
  * @param super_block - The super block with the free list to change
  */
 void free_block_in_free_list(int block_number, Super_block * super_block) {
+    if (block_number >= Disk_geometry::block_count) {
+        return;
+    }
     int free_block_list_index = block_number/8;
     int bit_number = 7 - (block_number % 8);
 
     char * byte = &(super_block->free_block_list[free_block_list_index]);
+    bool was_used = (*byte >> bit_number) & 1;
     *byte &= ~(1UL << bit_number);
+    forget_block_contents(super_block, block_number);
+    if (was_used) {
+        note_block_freed(super_block, block_number);
+    }
 }
 
 /**
@@ -52,52 +656,197 @@ bool is_block_free(int block_number, Super_block * super_block) {
 
 /**
  * @brief Write the provided superblock to the provided disk. The superblock should be the
- * first block on the disk.
+ * first block on the disk. A block map that changed is saved first (see BlockMap.cc), so the
+ * superblock on the disk never refers to blocks shared in a way its block map does not know of yet.
  * 
  * @param disk_name - The disk to write the superblock to
  * @param super_block - The super block
  */
-void write_superblock_to_disk(std::string disk_name, Super_block * super_block) {
-    int fd = open(disk_name.c_str(), O_RDWR);
-    int sizeWritten = write(fd, super_block, BLOCK_SIZE);
-    if (sizeWritten < BLOCK_SIZE) {
+void write_superblock_to_disk(const std::string & disk_name, Super_block * super_block) {
+    Trace_span span("superblock_flush");
+    if (block_map(super_block)->dirty) {
+        save_block_map(disk_name, super_block);
+    }
+
+    // The superblock is copied into an aligned block so it can be written with direct I/O
+    Pooled_block block;
+    memcpy(block.data, super_block, BLOCK_SIZE);
+
+    Disk disk;
+    open_disk(disk_name, O_RDWR, &disk);
+    if (!transfer_blocks(&disk, block.data, 0, 1, true)) {
         std::cerr << "Error: Writing superblock back to disk\n";
     }
-    close(fd);
+    metrics_add(COUNTER_SUPERBLOCK_FLUSHES, 1);
+    close_disk(&disk);
+}
+
+/**
+ * @brief Read the superblock from the first block of the disk.
+ *
+ * @param disk - The disk to read from
+ * @param super_block - The super block to read into
+ * @return True if a whole block was read. False otherwise.
+ */
+bool read_superblock_from_disk(Disk * disk, Super_block * super_block) {
+    Trace_span span("read_superblock");
+    Pooled_block block;
+    if (!transfer_blocks(disk, block.data, 0, 1, false)) {
+        return false;
+    }
+    memcpy(super_block, block.data, BLOCK_SIZE);
+    return true;
 }
 
 /**
- * @brief Write the buffer array to the block on the disk provided by the file descriptor fd.
+ * @brief Write the buffer array to the block on the disk.
  * The disk needs to be opened before the call of this function.
  * 
- * @param fd - The file descriptor of the disk to write to
+ * @param disk - The disk to write to
  * @param buff - The contents to write to the block
  * @param block_number - The index of the block to write to
  */
-void write_to_block(int fd, uint8_t buff[BLOCK_SIZE], int block_number) {
-    int offset = BLOCK_SIZE*block_number;
-    int sizeWritten = pwrite(fd, buff, BLOCK_SIZE, offset);
-    if (sizeWritten < BLOCK_SIZE) {
+void write_to_block(Disk * disk, const uint8_t buff[BLOCK_SIZE], int block_number) {
+    Trace_span span(buff == zero_block() ? "zero_block" : "write_block", block_number, 1);
+    readahead_invalidate_block(block_number);
+    if (buff == zero_block()) {
+        metrics_add(COUNTER_BYTES_ZEROED, BLOCK_SIZE);
+    }
+    if (!transfer_blocks(disk, const_cast<uint8_t *>(buff), block_number, 1, true)) {
         std::cerr << "Error: Writing to block on disk\n";
     }
 }
 
 /**
- * @brief Read the block on the disk provided by the file descriptor fd into the provided buffer array.
+ * @brief Read the block on the disk into the provided buffer array.
  * The disk needs to be opened before the call of this function.
  * 
- * @param fd - The file descriptor of the disk to read from
+ * @param disk - The disk to read from
  * @param buff - The array to read the block into
  * @param block_number - The index of the block to read from
  */
-void read_from_block(int fd, uint8_t buff[BLOCK_SIZE], int block_number) {
-    int offset = BLOCK_SIZE*block_number;
-    int sizeRead = pread(fd, buff, BLOCK_SIZE, offset);
-    if (sizeRead < BLOCK_SIZE) {
+void read_from_block(Disk * disk, uint8_t buff[BLOCK_SIZE], int block_number) {
+    Trace_span span("read_block", block_number, 1);
+    if (!transfer_blocks(disk, buff, block_number, 1, false)) {
         std::cerr << "Error: Reading block from disk\n";
     }
 }
 
+/**
+ * @brief Write count consecutive blocks, starting at block_number, from the provided buffer array to
+ * the disk in one transfer. The disk needs to be opened before the call of this function.
+ *
+ * @param disk - The disk to write to
+ * @param buff - The contents to write. Must hold count blocks.
+ * @param block_number - The index of the first block to write to
+ * @param count - The number of blocks to write
+ */
+void write_to_blocks(Disk * disk, const uint8_t * buff, int block_number, int count) {
+    Trace_span span(buff == zero_block() ? "zero_blocks" : "write_blocks", block_number, count);
+    for (int i = 0; i < count; i++) {
+        readahead_invalidate_block(block_number + i);
+    }
+    if (buff == zero_block()) {
+        metrics_add(COUNTER_BYTES_ZEROED, (uint64_t) BLOCK_SIZE * count);
+    }
+    if (!transfer_blocks(disk, const_cast<uint8_t *>(buff), block_number, count, true)) {
+        std::cerr << "Error: Writing blocks to disk\n";
+    }
+}
+
+/**
+ * @brief Read count consecutive blocks, starting at block_number, from the disk into the provided
+ * buffer array in one transfer. The disk needs to be opened before the call of this function.
+ *
+ * @param disk - The disk to read from
+ * @param buff - The array to read the blocks into. Must hold count blocks.
+ * @param block_number - The index of the first block to read from
+ * @param count - The number of blocks to read
+ */
+void read_from_blocks(Disk * disk, uint8_t * buff, int block_number, int count) {
+    Trace_span span("read_blocks", block_number, count);
+    if (!transfer_blocks(disk, buff, block_number, count, false)) {
+        std::cerr << "Error: Reading blocks from disk\n";
+    }
+}
+
+/**
+ * @brief Read count consecutive blocks like read_from_blocks(), but without printing anything, for
+ * threads other than the one running commands. What went wrong is left to the command that uses
+ * the blocks to report.
+ *
+ * @param disk - The disk to read from
+ * @param buff - The array to read the blocks into. Must hold count blocks.
+ * @param block_number - The index of the first block to read from
+ * @param count - The number of blocks to read
+ * @param failed - Set for every block that fails its checksum, indexed by block
+ * @return False if the blocks could not be read
+ */
+bool read_blocks_unreported(Disk * disk, uint8_t * buff, int block_number, int count, bool failed[Standard_geometry::block_count]) {
+    Trace_span span("read_blocks", block_number, count);
+    if (transfer_blocks(disk, buff, block_number, count, false, failed)) {
+        return true;
+    }
+    // Blocks are only verified once they were read
+    for (int block = block_number; block < block_number + count && block < Standard_geometry::block_count; block++) {
+        if (failed[block]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Copy count consecutive blocks from one disk to another (or within the same disk). Between
+ * plain image files the data is copied by the kernel with copy_file_range() where possible;
+ * otherwise it is read and written in one transfer each. Both disks need to be opened before the
+ * call of this function.
+ *
+ * @param source - The disk to copy from
+ * @param source_block - The index of the first block to copy
+ * @param destination - The disk to copy to
+ * @param destination_block - The index of the first block to copy to
+ * @param count - The number of blocks to copy
+ */
+void copy_blocks(Disk * source, int source_block, Disk * destination, int destination_block, int count) {
+    Trace_span span("copy_blocks", destination_block, count);
+    if ((source->member_count == 0 && source->mapping == NULL) || destination->member_count == 0) {
+        std::cerr << "Error: Writing blocks to disk\n";
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        readahead_invalidate_block(destination_block + i);
+    }
+
+    // The kernel's copy would neither verify the source nor checksum the destination
+    int copied_blocks = 0;
+    if (source->member_count == 1 && destination->member_count == 1 && source->checksums == NULL && destination->checksums == NULL) {
+        loff_t source_offset = (loff_t) BLOCK_SIZE * source_block;
+        loff_t destination_offset = (loff_t) BLOCK_SIZE * destination_block;
+        size_t remaining = (size_t) BLOCK_SIZE * count;
+        while (remaining > 0) {
+            ssize_t sizeCopied = copy_file_range(source->fds[0], &source_offset, destination->fds[0], &destination_offset, remaining, 0);
+            if (sizeCopied <= 0) {
+                break;
+            }
+            remaining -= sizeCopied;
+        }
+        copied_blocks = count - (remaining + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (destination->changes != NULL) {
+            mark_changed_blocks(destination->changes, destination_block, copied_blocks);
+        }
+        metrics_add(COUNTER_BLOCK_READS, copied_blocks);
+        metrics_add(COUNTER_BLOCK_WRITES, copied_blocks);
+    }
+
+    // Striped, or not supported between these files (eg. different file systems on an old kernel)
+    if (copied_blocks < count) {
+        uint8_t * extent = extent_buffer();
+        read_from_blocks(source, extent, source_block + copied_blocks, count - copied_blocks);
+        write_to_blocks(destination, extent, destination_block + copied_blocks, count - copied_blocks);
+    }
+}
+
 /**
  * @brief Delete the file represented by the inode. Clears the inode bits, frees the block in the
  * free block list, and zeros out the contents on the disk
@@ -106,15 +855,21 @@ void read_from_block(int fd, uint8_t buff[BLOCK_SIZE], int block_number) {
  * @param disk_name - The disk to delete the file from
  * @param super_block - The super block to update
  */
-void delete_file(Inode * inode, std::string disk_name, Super_block * super_block) {
-    uint8_t buff[BLOCK_SIZE] = {0};
-    int size = get_inode_size(*inode);
-    int fd = open(disk_name.c_str(), O_RDWR);
-    for (int i = inode->start_block; i < inode->start_block + size; i++) {
-        write_to_block(fd, buff, i);
-        free_block_in_free_list(i, super_block);
+void delete_file(Inode * inode, const std::string & disk_name, Super_block * super_block) {
+    int inode_index = inode - super_block->inode;
+    if (is_mapped(super_block, inode_index)) {
+        // Only the blocks no other file shares are freed
+        release_mapped_blocks(disk_name, super_block, inode_index, 0);
+    } else {
+        int size = get_inode_size(*inode);
+        Disk disk;
+        open_disk(disk_name, O_RDWR, &disk);
+        write_to_blocks(&disk, zero_block(), inode->start_block, size);
+        for (int i = inode->start_block; i < inode->start_block + size; i++) {
+            free_block_in_free_list(i, super_block);
+        }
+        close_disk(&disk);
     }
-    close(fd);
 
     inode->dir_parent = 0;
     inode->start_block = 0;
@@ -122,6 +877,7 @@ void delete_file(Inode * inode, std::string disk_name, Super_block * super_block
     for (int i = 0; i < 5; i++) {
         inode->name[i] = 0;
     }
+    mirror_update_inode(super_block, inode);
 }
 
 /**
@@ -132,15 +888,18 @@ void delete_file(Inode * inode, std::string disk_name, Super_block * super_block
  * @param disk_name - The disk to delete the directory from
  * @param super_block - The super block to update
  */
-void delete_directory(int directory, std::string disk_name, Super_block * super_block) {
-    for (int i = 0; i < 126; i++) {
+void delete_directory(int directory, const std::string & disk_name, Super_block * super_block) {
+    // Deleting a child only changes the child and its own descendants, so the children can be found up front
+    Inode_set children = mirror_children(inode_mirror(super_block), directory);
+    for (int i = next_inode(children, 0); i >= 0; i = next_inode(children, i + 1)) {
         Inode * inode = &(super_block->inode[i]);
-        if (is_inode_used(*inode) && get_parent_dir(*inode) == directory) {
-            if (is_inode_dir(*inode)) {
-                delete_directory(i, disk_name, super_block);
-            } else {
-                delete_file(inode, disk_name, super_block);
-            }
+        if (!is_inode_used(*inode)) {
+            continue;
+        }
+        if (is_inode_dir(*inode)) {
+            delete_directory(i, disk_name, super_block);
+        } else {
+            delete_file(inode, disk_name, super_block);
         }
     }
 
@@ -150,34 +909,47 @@ void delete_directory(int directory, std::string disk_name, Super_block * super_
     for (int i = 0; i < 5; i++) {
         super_block->inode[directory].name[i] = 0;
     }
+    mirror_update_inode(super_block, &super_block->inode[directory]);
 }
 
 /**
  * @brief Move the file represented by the inode to the provided destination blocks. Updates the superblock's
- * free list, copies the old block on disk to the new one, and zeroes out the old block.
+ * free list, copies the old blocks on disk to the new ones, and zeroes out the old blocks the file no
+ * longer uses. The whole file is moved with one read and one write.
  * 
  * @param inode - The inode representing the file to move
  * @param disk_name - The disk to update
  * @param super_block - The super block to update
- * @param destination_blocks - The blocks to move the file to
+ * @param destination_block - The first of the contiguous blocks to move the file to
+ * @param destination_size - The number of destination blocks, at least the size of the file
  */
-void move_file_to_blocks(Inode * inode, std::string disk_name, Super_block * super_block, std::vector<int> destination_blocks) {
-    for (auto block: destination_blocks) {
-        allocate_block_in_free_list(block, super_block);
+void move_file_to_blocks(Inode * inode, const std::string & disk_name, Super_block * super_block, int destination_block, int destination_size) {
+    for (int i = 0; i < destination_size; i++) {
+        allocate_block_in_free_list(destination_block + i, super_block);
     }
     int currentSize = get_inode_size(*inode);
-    int destinationIndex = 0;
-    int fd = open(disk_name.c_str(), O_RDWR);
-    for (int i = inode->start_block; i < inode->start_block + currentSize; i++) {
-        uint8_t buff[BLOCK_SIZE] = {0};
-        read_from_block(fd, buff, i);
+    int old_start = inode->start_block;
+    int old_end = old_start + currentSize;
+    int new_start = destination_block;
+    int new_end = new_start + currentSize;
 
-        uint8_t clear[BLOCK_SIZE] = {0};
-        write_to_block(fd, clear, i);
+    Disk disk;
+    open_disk(disk_name, O_RDWR, &disk);
+    uint8_t * extent = extent_buffer();
+    read_from_blocks(&disk, extent, old_start, currentSize);
+    write_to_blocks(&disk, extent, new_start, currentSize);
 
-        write_to_block(fd, buff, destination_blocks[destinationIndex]);
-        destinationIndex++;
+    // Clear the old blocks that the destination does not overlap
+    int before_end = std::min(old_end, new_start);
+    if (old_start < before_end) {
+        write_to_blocks(&disk, zero_block(), old_start, before_end - old_start);
     }
-    close(fd);
-    inode->start_block = destination_blocks[0];
-}
\ No newline at end of file
+    int after_start = std::max(old_start, new_end);
+    if (after_start < old_end) {
+        write_to_blocks(&disk, zero_block(), after_start, old_end - after_start);
+    }
+    close_disk(&disk);
+
+    inode->start_block = new_start;
+    mirror_update_inode(super_block, inode);
+}
@@ -3,14 +3,48 @@
 #include <string>
 #include <vector>
 
+#include "Backup.h"
+#include "Checksum.h"
 #include "FileSystem.h"
+#include "Volume.h"
 
+// Splitting a transfer over a striped volume never needs more pieces than there are blocks
+#define MAX_TRANSFER_PIECES 128
+
+// An opened disk: a plain image file, or every member image file of a striped volume. A disk mounted
+// read-only is read from its mapping instead, and has no member files open.
+typedef struct {
+    const uint8_t * mapping;     // The whole disk mapped read-only, NULL if it is not mapped
+    size_t mapping_size;
+    int member_count;
+    int stripe_unit;
+    off_t data_offset; // Where block data starts in each member; volume members start with a label
+    int fds[MAX_VOLUME_MEMBERS];
+    Block_checksums * checksums; // Verified on every read and updated on every write, NULL if the disk has none
+    Changed_blocks * changes;    // Marked on every write, NULL if the disk was never exported
+} Disk;
+
+void set_direct_io(bool enabled);
+void transfer_shutdown();
+bool check_disk_members(const std::string & disk_name);
+bool lock_disk(const std::string & disk_name, bool read_only);
+void unlock_disk(const std::string & disk_name);
+bool add_block_checksums(const std::string & disk_name);
+Changed_blocks * track_changes(const std::string & disk_name);
+bool open_disk(const std::string & disk_name, int flags, Disk * disk);
+void close_disk(Disk * disk);
+int count_disk_blocks(Disk * disk);
 void allocate_block_in_free_list(int block_number, Super_block * super_block);
 void free_block_in_free_list(int block_number, Super_block * super_block);
 bool is_block_free(int block_number, Super_block * super_block);
-void write_superblock_to_disk(std::string disk_name, Super_block * super_block);
-void write_to_block(int fd, uint8_t buff[BLOCK_SIZE], int block_number);
-void read_from_block(int fd, uint8_t buff[BLOCK_SIZE], int block_number);
-void delete_file(Inode * inode, std::string disk_name, Super_block * super_block);
-void delete_directory(int directory, std::string disk_name, Super_block * super_block);
-void move_file_to_blocks(Inode * inode, std::string disk_name, Super_block * super_block, std::vector<int> destination_blocks);
\ No newline at end of file
+void write_superblock_to_disk(const std::string & disk_name, Super_block * super_block);
+bool read_superblock_from_disk(Disk * disk, Super_block * super_block);
+void write_to_block(Disk * disk, const uint8_t buff[BLOCK_SIZE], int block_number);
+void read_from_block(Disk * disk, uint8_t buff[BLOCK_SIZE], int block_number);
+void write_to_blocks(Disk * disk, const uint8_t * buff, int block_number, int count);
+void read_from_blocks(Disk * disk, uint8_t * buff, int block_number, int count);
+bool read_blocks_unreported(Disk * disk, uint8_t * buff, int block_number, int count, bool failed[Standard_geometry::block_count]);
+void copy_blocks(Disk * source, int source_block, Disk * destination, int destination_block, int count);
+void delete_file(Inode * inode, const std::string & disk_name, Super_block * super_block);
+void delete_directory(int directory, const std::string & disk_name, Super_block * super_block);
+void move_file_to_blocks(Inode * inode, const std::string & disk_name, Super_block * super_block, int destination_block, int destination_size);
\ No newline at end of file
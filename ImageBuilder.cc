@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "ImageBuilder.h"
+#include "ConsistencyCheck.h"
+#include "FileSystem.h"
+#include "FreeSpace.h"
+#include "InodeHelper.h"
+#include "InodeMirror.h"
+#include "IO.h"
+
+// Files kept next to a disk by other modules, which describe the disk an image replaces
+static const char * const sidecar_suffixes[] = {".blockmap", ".checksums", ".changes", ".clean"};
+
+// A file or directory of the host tree, and where it goes in the image
+typedef struct {
+    std::string host_path;
+    int inode;
+    int start_block;  // 0 for a directory
+    int size;         // In blocks, 0 for a directory
+} Planned_entry;
+
+// The layout of the image, decided in a single walk of the host tree
+typedef struct {
+    Super_block * super_block;
+    std::vector<Planned_entry> entries;
+    int next_block;  // The first block no file has been given yet
+} Image_plan;
+
+/**
+ * @brief Checks that a host file name can be used as a name on the disk: 1 to 5 characters, none of
+ * them a space, which a command could not name
+ */
+static bool is_valid_image_name(const char * name) {
+    size_t length = strlen(name);
+    if (length < 1 || length > 5) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (isspace((unsigned char) name[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Gives an entry of the host tree an inode and, for a file, its blocks, as fs_create()
+ * would: the first free inode, and the first run of free blocks long enough. Nothing is ever freed
+ * while an image is planned, so the first free run always starts where the last file ended.
+ *
+ * @param plan - The plan so far
+ * @param entry - The entry, with its host path and size filled in
+ * @param name - The entry's name on the disk
+ * @param parent - The directory it goes in, as the index of its inode or ROOT
+ * @return True if the entry got an inode and its blocks. False otherwise, with an error printed.
+ */
+static bool plan_entry(Image_plan * plan, Planned_entry * entry, const char * name, uint8_t parent) {
+    Super_block * super_block = plan->super_block;
+    int inode_index = mirror_find_free_inode(super_block);
+    if (inode_index < 0) {
+        std::cerr << "Error: Superblock is full, cannot create " << entry->host_path << std::endl;
+        return false;
+    }
+    if (entry->size > Disk_geometry::block_count - plan->next_block) {
+        std::cerr << "Error: Cannot allocate " << entry->size << " for " << entry->host_path << std::endl;
+        return false;
+    }
+
+    Inode * inode = &super_block->inode[inode_index];
+    inode->dir_parent = parent;
+    if (entry->size == 0) {
+        inode->dir_parent |= 1UL << 7;
+        inode->start_block = 0;
+        entry->start_block = 0;
+    } else {
+        inode->dir_parent &= ~(1UL << 7);
+        inode->start_block = plan->next_block;
+        entry->start_block = plan->next_block;
+        for (int block = plan->next_block; block < plan->next_block + entry->size; block++) {
+            allocate_block_in_free_list(block, super_block);
+        }
+        plan->next_block += entry->size;
+    }
+    set_inode_size(inode, entry->size);
+    strncpy(inode->name, name, 5);
+    mirror_update_inode(super_block, inode);
+
+    entry->inode = inode_index;
+    plan->entries.push_back(*entry);
+    return true;
+}
+
+/**
+ * @brief Plans the contents of a host directory, and then of each directory in it, in the order a
+ * depth first walk creates them. Entries of a directory are taken in byte order of their names, so
+ * the same tree always gives the same image. Entries that cannot be put on the disk are reported
+ * and left out, along with everything under them.
+ *
+ * @param plan - The plan so far
+ * @param host_directory - The path of the host directory
+ * @param parent - The directory its contents go in, as the index of its inode or ROOT
+ */
+static void plan_directory(Image_plan * plan, const std::string & host_directory, uint8_t parent) {
+    DIR * directory = opendir(host_directory.c_str());
+    if (directory == NULL) {
+        std::cerr << "Error: Cannot read directory " << host_directory << std::endl;
+        return;
+    }
+    std::vector<std::string> names;
+    for (struct dirent * dirent = readdir(directory); dirent != NULL; dirent = readdir(directory)) {
+        if (strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0) {
+            names.push_back(dirent->d_name);
+        }
+    }
+    closedir(directory);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string & name : names) {
+        Planned_entry entry;
+        entry.host_path = host_directory + "/" + name;
+        struct stat host_stat;
+        if (!is_valid_image_name(name.c_str())) {
+            std::cerr << "Error: Cannot add " << entry.host_path << ", names are 1 to 5 characters without spaces\n";
+            continue;
+        }
+        if (lstat(entry.host_path.c_str(), &host_stat) != 0 || (!S_ISDIR(host_stat.st_mode) && !S_ISREG(host_stat.st_mode))) {
+            std::cerr << "Error: Cannot add " << entry.host_path << ", it is not a file or directory\n";
+            continue;
+        }
+
+        if (S_ISDIR(host_stat.st_mode)) {
+            entry.size = 0;
+            if (plan_entry(plan, &entry, name.c_str(), parent)) {
+                plan_directory(plan, entry.host_path, entry.inode);
+            }
+            continue;
+        }
+
+        // A file always has a block, since a size of 0 makes a directory
+        entry.size = std::max<off_t>(1, (host_stat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        if (entry.size > Disk_geometry::block_count - 1) {
+            std::cerr << "Error: Cannot add " << entry.host_path << ", files are at most ";
+            std::cerr << Disk_geometry::block_count - 1 << " KB\n";
+            continue;
+        }
+        plan_entry(plan, &entry, name.c_str(), parent);
+    }
+}
+
+/**
+ * @brief Reads a planned file into its blocks of the image. Whatever the file holds past the size
+ * it was planned with is left out; blocks it no longer fills stay zero.
+ */
+static bool read_host_file(const Planned_entry & entry, uint8_t * image) {
+    int fd = open(entry.host_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    uint8_t * data = image + (size_t) BLOCK_SIZE * entry.start_block;
+    size_t wanted = (size_t) BLOCK_SIZE * entry.size;
+    size_t done = 0;
+    while (done < wanted) {
+        ssize_t count = read(fd, data + done, wanted - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            break;
+        }
+        done += count;
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * @brief Builds a disk image holding the files and directories of a host directory tree, without
+ * going through commands. The whole tree is planned in a single walk: every entry gets its inode
+ * and its blocks in the order that creating them one by one with C, depth first, would give them,
+ * so the image is the one those commands and writes of the files' contents would leave. The image
+ * is then assembled in memory, checked like a mounted disk, and written with a single large write.
+ *
+ * @param image_name - The image file to create. Any image already there is replaced.
+ * @param host_directory - The host directory whose contents go in the root directory of the image
+ * @return The exit status of the process
+ */
+int build_image(const char * image_name, const char * host_directory) {
+    Image_plan plan;
+    plan.super_block = allocate_super_block();
+    plan.next_block = 1;
+    allocate_block_in_free_list(0, plan.super_block);
+    mirror_rebuild(plan.super_block);
+    free_space_rebuild(plan.super_block);
+    plan_directory(&plan, host_directory, ROOT);
+
+    std::vector<uint8_t> image((size_t) BLOCK_SIZE * Standard_geometry::block_count, 0);
+    for (const Planned_entry & entry : plan.entries) {
+        if (entry.size > 0 && !read_host_file(entry, image.data())) {
+            std::cerr << "Error: Cannot read " << entry.host_path << ", its blocks are left zero\n";
+        }
+    }
+    memcpy(image.data(), plan.super_block, sizeof(Super_block));
+
+    int errorCode = check_consistency<Standard_geometry>(plan.super_block);
+    free_super_block(plan.super_block);
+    if (errorCode != 0) {
+        std::cerr << "Error: Built file system is inconsistent (error code: " << errorCode << ")\n";
+        return 1;
+    }
+
+    // An image that is mounted elsewhere is not replaced under the process using it
+    int fd = open(image_name, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, 0) != 0 ||
+        write(fd, image.data(), image.size()) != (ssize_t) image.size()) {
+        std::cerr << "Error: Cannot write disk " << image_name << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    close(fd);
+
+    for (const char * suffix : sidecar_suffixes) {
+        unlink((std::string(image_name) + suffix).c_str());
+    }
+    return 0;
+}
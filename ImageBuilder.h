@@ -0,0 +1,3 @@
+#pragma once
+
+int build_image(const char * image_name, const char * host_directory);
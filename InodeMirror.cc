@@ -0,0 +1,287 @@
+#include <string.h>
+
+#include "BlockMap.h"
+#include "FreeSpace.h"
+#include "InodeHelper.h"
+#include "InodeMirror.h"
+
+// A loaded superblock with its mirror, block map and free space, allocated together so they can be
+// found from the Super_block * that the rest of the code passes around
+typedef struct {
+    Super_block super_block; // Must come first
+    Inode_mirror mirror;
+    Block_map block_map;
+    Free_space_index free_space;
+} Mirrored_super_block;
+
+/**
+ * @brief Allocate a superblock along with its inode mirror, block map and free space. Every
+ * superblock of a loaded disk is allocated this way.
+ *
+ * @return The superblock. Free it with free_super_block().
+ */
+Super_block * allocate_super_block() {
+    Mirrored_super_block * mirrored = new Mirrored_super_block;
+    memset(mirrored, 0, sizeof(Mirrored_super_block));
+    return &mirrored->super_block;
+}
+
+/**
+ * @brief Free a superblock allocated with allocate_super_block()
+ *
+ * @param super_block - The superblock to free
+ */
+void free_super_block(Super_block * super_block) {
+    delete (Mirrored_super_block *) super_block;
+}
+
+/**
+ * @brief Replace a superblock, along with its mirror, block map and free space, with another one.
+ * Everything that holds the destination sees the source's contents from then on.
+ *
+ * @param destination - The superblock to replace, allocated with allocate_super_block()
+ * @param source - The superblock to copy, allocated with allocate_super_block()
+ */
+void copy_super_block(Super_block * destination, const Super_block * source) {
+    memcpy((Mirrored_super_block *) destination, (const Mirrored_super_block *) source, sizeof(Mirrored_super_block));
+}
+
+/**
+ * @brief Get the inode mirror of a superblock allocated with allocate_super_block()
+ *
+ * @param super_block - The superblock
+ * @return The superblock's mirror
+ */
+Inode_mirror * inode_mirror(Super_block * super_block) {
+    return &((Mirrored_super_block *) super_block)->mirror;
+}
+
+/**
+ * @brief Get the block map of a superblock allocated with allocate_super_block()
+ *
+ * @param super_block - The superblock
+ * @return The superblock's block map
+ */
+Block_map * block_map(Super_block * super_block) {
+    return &((Mirrored_super_block *) super_block)->block_map;
+}
+
+/**
+ * @brief Get the free space of a superblock allocated with allocate_super_block()
+ *
+ * @param super_block - The superblock
+ * @return The superblock's free space
+ */
+Free_space_index * free_space_index(Super_block * super_block) {
+    return &((Mirrored_super_block *) super_block)->free_space;
+}
+
+/**
+ * @brief Pack a name of up to 5 characters into an integer, zero filled after the end of the name.
+ * Two names compare equal with strncmp(a, b, 5) exactly when their keys are equal.
+ *
+ * @param name - The name
+ * @return The name's key
+ */
+uint64_t name_key(const char * name) {
+    char packed[8] = {0};
+    for (int i = 0; i < 5 && name[i] != 0; i++) {
+        packed[i] = name[i];
+    }
+    uint64_t key;
+    memcpy(&key, packed, sizeof(key));
+    return key;
+}
+
+/**
+ * @brief The bucket of the directory index holding the inodes with a name in a directory
+ */
+static int name_bucket(uint8_t parent, uint64_t key) {
+    uint64_t hash = (key ^ ((uint64_t) parent << 56)) * 0x9E3779B97F4A7C15ULL;
+    return hash >> 58 & (NAME_BUCKETS - 1);
+}
+
+/**
+ * @brief Copy one inode of the superblock into its mirror, and move it in the directory index if
+ * its parent, its name or whether it is used changed. Must be called after every change to an inode
+ * of a loaded superblock.
+ *
+ * @param super_block - The superblock holding the inode
+ * @param inode - The inode that changed
+ */
+void mirror_update_inode(Super_block * super_block, const Inode * inode) {
+    Inode_mirror * mirror = inode_mirror(super_block);
+    int index = inode - super_block->inode;
+    uint64_t bit = 1ULL << (index % 64);
+
+    // Out of the directory it was in, under the name it had
+    if (mirror->used.bits[index / 64] & bit) {
+        mirror->children[mirror->parent[index]].bits[index / 64] &= ~bit;
+        mirror->name_buckets[name_bucket(mirror->parent[index], mirror->name_key[index])].bits[index / 64] &= ~bit;
+    }
+
+    mirror->used.bits[index / 64] &= ~bit;
+    mirror->directories.bits[index / 64] &= ~bit;
+    if (is_inode_used(*inode)) {
+        mirror->used.bits[index / 64] |= bit;
+        if (is_inode_dir(*inode)) {
+            mirror->directories.bits[index / 64] |= bit;
+        }
+    } else {
+        mirror->headroom[index] = 0;
+    }
+    mirror->parent[index] = get_parent_dir(*inode);
+    mirror->start[index] = inode->start_block;
+    mirror->size[index] = get_inode_size(*inode);
+    mirror->name_key[index] = name_key(inode->name);
+
+    if (mirror->used.bits[index / 64] & bit) {
+        mirror->children[mirror->parent[index]].bits[index / 64] |= bit;
+        mirror->name_buckets[name_bucket(mirror->parent[index], mirror->name_key[index])].bits[index / 64] |= bit;
+    }
+}
+
+/**
+ * @brief Check the directory index of a superblock against the parents and names of its inodes,
+ * which are what the index is kept from
+ *
+ * @param super_block - The superblock, allocated with allocate_super_block()
+ * @return True if every inode in use is in its directory and name bucket, and nothing else is
+ */
+bool mirror_check_directories(Super_block * super_block) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    Inode_mirror expected;
+    memset(expected.children, 0, sizeof(expected.children));
+    memset(expected.name_buckets, 0, sizeof(expected.name_buckets));
+    for (int i = 0; i < Standard_geometry::inode_count; i++) {
+        const Inode & inode = super_block->inode[i];
+        if (!is_inode_used(inode)) {
+            continue;
+        }
+        uint8_t parent = get_parent_dir(inode);
+        uint64_t bit = 1ULL << (i % 64);
+        expected.children[parent].bits[i / 64] |= bit;
+        expected.name_buckets[name_bucket(parent, name_key(inode.name))].bits[i / 64] |= bit;
+    }
+    return memcmp(expected.children, mirror->children, sizeof(expected.children)) == 0 &&
+           memcmp(expected.name_buckets, mirror->name_buckets, sizeof(expected.name_buckets)) == 0;
+}
+
+/**
+ * @brief Build the mirror of a superblock from scratch, after it is read from the disk
+ *
+ * @param super_block - The superblock
+ */
+void mirror_rebuild(Super_block * super_block) {
+    Inode_mirror * mirror = inode_mirror(super_block);
+    memset(mirror, 0, sizeof(Inode_mirror));
+    for (int i = 0; i < Standard_geometry::inode_count; i++) {
+        mirror_update_inode(super_block, &super_block->inode[i]);
+    }
+}
+
+/**
+ * @brief Find the inodes in use whose parent is the given directory, from the directory index
+ *
+ * @param mirror - The mirror to search
+ * @param parent - The directory, as the index of its inode or ROOT
+ * @return The children of the directory
+ */
+Inode_set mirror_children(const Inode_mirror * mirror, uint8_t parent) {
+    return mirror->children[parent];
+}
+
+/**
+ * @brief Check whether an inode is in a set
+ *
+ * @param set - The set
+ * @param index - The inode
+ * @return True if the inode is in the set
+ */
+bool is_in_set(const Inode_set & set, int index) {
+    return (set.bits[index / 64] >> (index % 64)) & 1;
+}
+
+/**
+ * @brief Find the next inode of a set, in inode order
+ *
+ * @param set - The set
+ * @param index - The inode to start looking from
+ * @return The first inode of the set at or after index, or -1 if there is none
+ */
+int next_inode(const Inode_set & set, int index) {
+    while (index < MIRROR_SLOTS) {
+        uint64_t bits = set.bits[index / 64] >> (index % 64);
+        if (bits != 0) {
+            return index + __builtin_ctzll(bits);
+        }
+        index = (index / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+/**
+ * @brief Count the inodes of a set
+ *
+ * @param set - The set
+ * @return The number of inodes in the set
+ */
+int count_inodes(const Inode_set & set) {
+    int count = 0;
+    for (int word = 0; word < MIRROR_WORDS; word++) {
+        count += __builtin_popcountll(set.bits[word]);
+    }
+    return count;
+}
+
+/**
+ * @brief Look up a file or directory by name in a directory. If several inodes match, the one with
+ * the lowest index is returned, as a scan of the inode table would.
+ *
+ * @param super_block - The superblock to search
+ * @param parent - The directory to search, as the index of its inode or ROOT
+ * @param name - The name to look up
+ * @param kind - Whether to only match files or only directories
+ * @return The index of the matching inode, or -1 if there is none
+ */
+int mirror_find_child(Super_block * super_block, uint8_t parent, const char * name, Inode_kind kind) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    uint64_t key = name_key(name);
+    const Inode_set & children = mirror->children[parent];
+    const Inode_set & bucket = mirror->name_buckets[name_bucket(parent, key)];
+    for (int word = 0; word < MIRROR_WORDS; word++) {
+        uint64_t bits = children.bits[word] & bucket.bits[word];
+        if (kind == FILE_INODE) {
+            bits &= ~mirror->directories.bits[word];
+        } else if (kind == DIRECTORY_INODE) {
+            bits &= mirror->directories.bits[word];
+        }
+        // Other names of the directory can share the bucket
+        while (bits != 0) {
+            int index = word * 64 + __builtin_ctzll(bits);
+            if (mirror->name_key[index] == key) {
+                return index;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Find the first inode that is not in use
+ *
+ * @param super_block - The superblock to search
+ * @return The index of the inode, or -1 if every inode is in use
+ */
+int mirror_find_free_inode(Super_block * super_block) {
+    const Inode_mirror * mirror = inode_mirror(super_block);
+    for (int word = 0; word < MIRROR_WORDS; word++) {
+        uint64_t free_bits = ~mirror->used.bits[word];
+        if (free_bits != 0) {
+            int index = word * 64 + __builtin_ctzll(free_bits);
+            return index < Disk_geometry::inode_count ? index : -1;
+        }
+    }
+    return -1;
+}
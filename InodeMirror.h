@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+// Inode slots in the mirror: the inode count rounded up to whole 64 bit words. The slots past the
+// last inode are never in use.
+#define MIRROR_SLOTS (((Standard_geometry::inode_count + 63) / 64) * 64)
+#define MIRROR_WORDS (MIRROR_SLOTS / 64)
+#define NAME_BUCKETS 64  // Buckets of the directory index's name hash; must be a power of two
+
+// A set of inodes, as a bitmap indexed by inode
+typedef struct {
+    uint64_t bits[MIRROR_WORDS];
+} Inode_set;
+
+// The inode table of a superblock decoded into one array per field, so that a pass over the whole
+// table compares whole vectors of inodes at a time instead of decoding bit fields one inode at a time.
+// Along with it is an index of every directory, kept up to date with the parents of the inodes, so
+// that listing a directory or looking up a name in it does not scan the table at all.
+typedef struct {
+    Inode_set used;
+    Inode_set directories;           // Inodes in use that are directories
+    uint8_t parent[MIRROR_SLOTS];    // Parent directory of every inode, used or not
+    uint8_t start[MIRROR_SLOTS];
+    uint8_t size[MIRROR_SLOTS];
+    uint64_t name_key[MIRROR_SLOTS]; // See name_key()
+    uint8_t headroom[MIRROR_SLOTS];  // Free blocks after each file held back for it to grow into
+    Inode_set children[MIRROR_SLOTS];       // Inodes in use in each directory, indexed by the directory's inode or ROOT
+    Inode_set name_buckets[NAME_BUCKETS];   // Inodes in use by the hash of their parent and name
+} Inode_mirror;
+
+enum Inode_kind {
+    ANY_INODE,
+    FILE_INODE,
+    DIRECTORY_INODE
+};
+
+Super_block * allocate_super_block();
+void free_super_block(Super_block * super_block);
+void copy_super_block(Super_block * destination, const Super_block * source);
+Inode_mirror * inode_mirror(Super_block * super_block);
+void mirror_rebuild(Super_block * super_block);
+void mirror_update_inode(Super_block * super_block, const Inode * inode);
+bool mirror_check_directories(Super_block * super_block);
+
+uint64_t name_key(const char * name);
+Inode_set mirror_children(const Inode_mirror * mirror, uint8_t parent);
+bool is_in_set(const Inode_set & set, int index);
+int next_inode(const Inode_set & set, int index);
+int count_inodes(const Inode_set & set);
+int mirror_find_child(Super_block * super_block, uint8_t parent, const char * name, Inode_kind kind);
+int mirror_find_free_inode(Super_block * super_block);
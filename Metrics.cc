@@ -0,0 +1,274 @@
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeSpace.h"
+#include "Metrics.h"
+#include "ReadAhead.h"
+
+// Constants
+// Bucket i of a latency histogram counts commands that took less than 2^i microseconds (and at
+// least 2^(i-1)); the last bucket also takes anything slower
+#define LATENCY_BUCKETS 32
+
+typedef struct {
+    uint64_t count;
+    uint64_t invalid;   // Commands rejected with a command error
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t allocations;           // Heap allocations made while running the commands
+    uint64_t warm_up_allocations;   // Heap allocations made by the first run, which fills caches and pools
+} Command_metrics;
+
+// I/O counters are bumped by the read-ahead and transfer worker threads too
+static std::atomic<uint64_t> counters[COUNTER_COUNT];
+static const char * counter_names[COUNTER_COUNT] = {
+    "block_reads", "block_writes", "bytes_zeroed", "superblock_flushes",
+    "block_allocation_failures", "inode_allocation_failures", "relocations",
+    "neighbor_relocations", "relocations_avoided", "headroom_reclaimed",
+    "clones", "copy_on_write_blocks", "dedup_writes", "dedup_cpu_ns", "dedup_blocks_saved",
+    "zero_writes_skipped", "checksum_bytes", "checksum_ns", "checksum_errors",
+    "delta_blocks_exported", "delta_blocks_applied", "compactions", "compaction_blocks_moved",
+    "dentry_hits", "dentry_misses", "compression_ns", "compression_blocks_saved", "compressed_reads",
+    "decompression_ns", "compressed_writes", "batch_entries"
+};
+
+// Commands are only run by one thread. Indexed by command letter; anything that is not a single
+// character is counted under '?'.
+static Command_metrics commands[256];
+
+// Every heap allocation counted so far, by any thread
+static std::atomic<uint64_t> allocation_count;
+
+#ifdef COUNT_ALLOCATIONS
+/**
+ * @brief Replacement for the global operator new that counts every heap allocation, so that
+ * commands can be checked for allocating in steady state. Only built into fs_alloc.
+ */
+void * operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    void * memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void * operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void * memory) noexcept {
+    free(memory);
+}
+
+void operator delete[](void * memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void * memory, size_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void * memory, size_t) noexcept {
+    free(memory);
+}
+#endif
+
+/**
+ * @brief Count a heap allocation made without operator new, eg. with malloc()
+ */
+void metrics_count_allocation() {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Whether every heap allocation is counted, which takes a build with COUNT_ALLOCATIONS
+ */
+bool metrics_counts_allocations() {
+#ifdef COUNT_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief The number of heap allocations counted so far
+ *
+ * @return The allocation count
+ */
+uint64_t metrics_allocations() {
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief The current time, for measuring how long something takes
+ *
+ * @return A monotonic time in nanoseconds
+ */
+uint64_t metrics_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Add to one of the counters
+ *
+ * @param counter - The counter
+ * @param amount - The amount to add
+ */
+void metrics_add(Metrics_counter counter, uint64_t amount) {
+    counters[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Record that a command ran
+ *
+ * @param command - The command, eg. "C"
+ * @param elapsed_ns - How long the command took, in nanoseconds
+ * @param allocations - How many heap allocations the command made
+ * @param valid - False if the command was rejected with a command error
+ */
+void metrics_record_command(const char * command, uint64_t elapsed_ns, uint64_t allocations, bool valid) {
+    Command_metrics * metrics = &commands[command[0] != 0 && command[1] == 0 ? (uint8_t) command[0] : '?'];
+    if (metrics->count == 0) {
+        metrics->warm_up_allocations = allocations;
+    }
+    metrics->allocations += allocations;
+    metrics->count++;
+    if (!valid) {
+        metrics->invalid++;
+    }
+    metrics->total_ns += elapsed_ns;
+    if (elapsed_ns > metrics->max_ns) {
+        metrics->max_ns = elapsed_ns;
+    }
+
+    int bucket = 0;
+    uint64_t elapsed_us = elapsed_ns / 1000;
+    while (elapsed_us > 0 && bucket < LATENCY_BUCKETS - 1) {
+        elapsed_us >>= 1;
+        bucket++;
+    }
+    metrics->buckets[bucket]++;
+}
+
+/**
+ * @brief Write a string as a JSON string literal
+ */
+static void write_json_string(std::ostream & out, const char * text) {
+    out << '"';
+    for (const char * p = text; *p != 0; p++) {
+        char c = *p;
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if ((unsigned char) c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+/**
+ * @brief Write the free space layout of a disk: free blocks, free extents, the largest free extent,
+ * and a fragmentation index (0 when all free space is one extent, approaching 1 as it is scattered)
+ */
+static void write_fragmentation(std::ostream & out, const Metrics_disk & disk) {
+    Free_space space = free_space_summary(disk.super_block);
+    char index[32];
+    snprintf(index, sizeof(index), "%.3f", fragmentation_index(space));
+
+    out << "{\"disk\": ";
+    write_json_string(out, disk.disk_name);
+    out << ", \"free_blocks\": " << space.free_blocks << ", \"free_extents\": " << space.free_extents;
+    out << ", \"largest_free_extent\": " << space.largest_extent << ", \"fragmentation\": " << index << "}";
+}
+
+/**
+ * @brief Write every metric as a JSON object: per command counts and latency histograms, the I/O
+ * and allocation counters, read-ahead statistics, and the fragmentation of the given disks
+ *
+ * @param out - Where to write the JSON
+ * @param disks - The disks to report the fragmentation of
+ * @param disk_count - The number of disks
+ */
+void metrics_write_json(std::ostream & out, const Metrics_disk * disks, size_t disk_count) {
+    out << "{\n  \"commands\": {";
+    bool first = true;
+    for (int c = 0; c < 256; c++) {
+        const Command_metrics & metrics = commands[c];
+        if (metrics.count == 0) {
+            continue;
+        }
+        out << (first ? "\n" : ",\n") << "    ";
+        char name[2] = {(char) c, 0};
+        write_json_string(out, name);
+        out << ": {\"count\": " << metrics.count << ", \"invalid\": " << metrics.invalid;
+        out << ", \"allocations\": " << metrics.allocations;
+        out << ", \"total_us\": " << metrics.total_ns / 1000 << ", \"max_us\": " << metrics.max_ns / 1000;
+        out << ", \"latency_us\": [";
+        bool first_bucket = true;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (metrics.buckets[i] == 0) {
+                continue;
+            }
+            out << (first_bucket ? "" : ", ") << "{\"under\": ";
+            if (i < LATENCY_BUCKETS - 1) {
+                out << (1ULL << i);
+            } else {
+                out << "null";
+            }
+            out << ", \"count\": " << metrics.buckets[i] << "}";
+            first_bucket = false;
+        }
+        out << "]}";
+        first = false;
+    }
+    out << (first ? "},\n" : "\n  },\n");
+
+    out << "  \"counters\": {";
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        out << (i == 0 ? "" : ", ") << "\"" << counter_names[i] << "\": " << counters[i].load(std::memory_order_relaxed);
+    }
+    out << "},\n";
+
+    Read_ahead_stats read_ahead = readahead_stats();
+    out << "  \"read_ahead\": {\"hits\": " << read_ahead.hits << ", \"misses\": " << read_ahead.misses;
+    out << ", \"prefetched\": " << read_ahead.prefetched << ", \"wasted\": " << read_ahead.wasted << "},\n";
+
+    out << "  \"disks\": [";
+    for (size_t i = 0; i < disk_count; i++) {
+        out << (i == 0 ? "\n    " : ",\n    ");
+        write_fragmentation(out, disks[i]);
+    }
+    out << (disk_count == 0 ? "]\n" : "\n  ]\n") << "}\n";
+}
+
+/**
+ * @brief Write how many heap allocations each command made, leaving out the first run of each
+ * command, which warms up caches and pools. Anything left is an allocation in steady state.
+ *
+ * @param out - Where to write the report
+ */
+void metrics_write_allocations(std::ostream & out) {
+    uint64_t steady_state = 0;
+    out << "Command allocations (first run of each command excluded):\n";
+    for (int c = 0; c < 256; c++) {
+        const Command_metrics & metrics = commands[c];
+        if (metrics.count == 0) {
+            continue;
+        }
+        uint64_t allocations = metrics.allocations - metrics.warm_up_allocations;
+        out << "  " << (char) c << ": " << metrics.count - 1 << " commands, " << allocations << " allocations\n";
+        steady_state += allocations;
+    }
+    out << "Steady state: " << steady_state << " allocations\n";
+}
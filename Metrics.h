@@ -0,0 +1,57 @@
+#pragma once
+
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+enum Metrics_counter {
+    COUNTER_BLOCK_READS,                // Blocks read from disks
+    COUNTER_BLOCK_WRITES,               // Blocks written to disks
+    COUNTER_BYTES_ZEROED,               // Bytes of disk cleared with zeros
+    COUNTER_SUPERBLOCK_FLUSHES,         // Superblocks written back to disks
+    COUNTER_BLOCK_ALLOCATION_FAILURES,  // Creates, resizes and copies that found no room on the disk
+    COUNTER_INODE_ALLOCATION_FAILURES,  // Creates and copies that found no free inode
+    COUNTER_RELOCATIONS,                // Files moved elsewhere on the disk to grow
+    COUNTER_NEIGHBOR_RELOCATIONS,       // Files moved out of the way of a file growing in place
+    COUNTER_RELOCATIONS_AVOIDED,        // Grows that stayed in place by using their file's headroom
+    COUNTER_HEADROOM_RECLAIMED,         // Reserved headroom blocks taken back under space pressure
+    COUNTER_CLONES,                     // Files cloned
+    COUNTER_COPY_ON_WRITE_BLOCKS,       // Shared blocks given a copy of their own when written
+    COUNTER_DEDUP_WRITES,               // Writes fingerprinted for deduplication
+    COUNTER_DEDUP_CPU_NS,               // Time spent fingerprinting and looking up blocks
+    COUNTER_DEDUP_BLOCKS_SAVED,         // Blocks not stored twice thanks to deduplication
+    COUNTER_ZERO_WRITES_SKIPPED,        // Writes of zeros to blocks known to hold zeros
+    COUNTER_CHECKSUM_BYTES,             // Bytes checksummed on their way to or from disks with checksums
+    COUNTER_CHECKSUM_NS,                // Time spent computing those checksums
+    COUNTER_CHECKSUM_ERRORS,            // Blocks read that did not match their checksums
+    COUNTER_DELTA_BLOCKS_EXPORTED,      // Blocks written to deltas by X
+    COUNTER_DELTA_BLOCKS_APPLIED,       // Blocks written to disks from deltas by A
+    COUNTER_COMPACTIONS,                // Compactions run to make room for an allocation that had none
+    COUNTER_COMPACTION_BLOCKS_MOVED,    // Blocks those compactions moved
+    COUNTER_DENTRY_HITS,                // Directories in paths found in the dentry cache
+    COUNTER_DENTRY_MISSES,              // Directories in paths looked up in the inode mirror
+    COUNTER_COMPRESSION_NS,             // Time spent compressing the blocks of files for Z
+    COUNTER_COMPRESSION_BLOCKS_SAVED,   // Blocks freed by compressing files
+    COUNTER_COMPRESSED_READS,           // Packed blocks of compressed files read and decompressed
+    COUNTER_DECOMPRESSION_NS,           // Time spent decompressing them
+    COUNTER_COMPRESSED_WRITES,          // Packed blocks stored whole again because they were written
+    COUNTER_BATCH_ENTRIES,              // Files and directories created or deleted by G and H
+    COUNTER_COUNT
+};
+
+// A mounted disk to report the fragmentation of
+typedef struct {
+    const char * disk_name;
+    const Super_block * super_block;
+} Metrics_disk;
+
+uint64_t metrics_now();
+void metrics_add(Metrics_counter counter, uint64_t amount);
+void metrics_count_allocation();
+bool metrics_counts_allocations();
+uint64_t metrics_allocations();
+void metrics_record_command(const char * command, uint64_t elapsed_ns, uint64_t allocations, bool valid);
+void metrics_write_json(std::ostream & out, const Metrics_disk * disks, size_t disk_count);
+void metrics_write_allocations(std::ostream & out);
@@ -0,0 +1,311 @@
+#include <iostream>
+#include <streambuf>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Output.h"
+
+// Constants
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define OUTPUT_RESERVED_SIZE 4096  // What a command's record is expected to fit in, per part
+#define STATUS_OK 0        // The command ran and printed no error
+#define STATUS_FAILED 1    // The command ran and printed an error
+#define STATUS_INVALID 2   // The command was rejected before it ran
+
+/**
+ * @brief A stream buffer that collects what is printed and writes it to a file descriptor in large
+ * writes. The flushes asked for by std::endl, and by std::cerr after every write, are ignored:
+ * what was printed is written out when the buffer is full and after every command (see
+ * output_end_command()), so that a line costs no write of its own.
+ */
+class Output_buffer : public std::streambuf {
+public:
+    explicit Output_buffer(int fd) : fd(fd) {
+        setp(data, data + OUTPUT_BUFFER_SIZE);
+    }
+
+    /**
+     * @brief Write out everything collected so far
+     */
+    void drain() {
+        const char * next = pbase();
+        while (next < pptr()) {
+            ssize_t written = write(fd, next, pptr() - next);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            } else if (written <= 0) {
+                break;
+            }
+            next += written;
+        }
+        setp(data, data + OUTPUT_BUFFER_SIZE);
+    }
+
+protected:
+    int_type overflow(int_type c) {
+        drain();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // Written out after the command instead, by output_end_command()
+    int sync() {
+        return 0;
+    }
+
+private:
+    int fd;
+    char data[OUTPUT_BUFFER_SIZE];
+};
+
+/**
+ * @brief A stream buffer that collects what one command prints into a string, which keeps its
+ * capacity from one command to the next
+ */
+class Capture_buffer : public std::streambuf {
+public:
+    std::string text;
+
+protected:
+    int_type overflow(int_type c) {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            text += traits_type::to_char_type(c);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char * s, std::streamsize count) {
+        text.append(s, count);
+        return count;
+    }
+};
+
+static Output_format output_format = OUTPUT_TEXT;
+
+// Set by output_start() until output_finish(): the buffers standing in for stdout and stderr
+static Output_buffer * stdout_buffer = NULL;
+static Output_buffer * stderr_buffer = NULL;
+static std::streambuf * original_out = NULL;
+static std::streambuf * original_err = NULL;
+
+// JSON lines: what the command being run has printed so far, and where its record goes
+static Capture_buffer command_output;
+static Capture_buffer command_errors;
+static std::string command_entries;  // The entries listed by L, as JSON objects
+static std::string command_data;     // The block read by R, in base64
+static std::string record;
+static std::streambuf * record_out = NULL;
+static std::streambuf * record_err = NULL;
+
+/**
+ * @brief Choose how the results of commands are printed, for the rest of the run
+ *
+ * @param name - "text" or "json"
+ * @return False if there is no such format
+ */
+bool set_output_format(const char * name) {
+    if (strcmp(name, "text") == 0) {
+        output_format = OUTPUT_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        output_format = OUTPUT_JSON_LINES;
+        // Room for the largest listing and block up front, so that commands do not allocate
+        command_output.text.reserve(OUTPUT_RESERVED_SIZE);
+        command_errors.text.reserve(OUTPUT_RESERVED_SIZE);
+        command_entries.reserve(2 * OUTPUT_RESERVED_SIZE);
+        command_data.reserve(OUTPUT_RESERVED_SIZE);
+        record.reserve(4 * OUTPUT_RESERVED_SIZE);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Send everything printed to stdout and stderr through large buffers from now on, until
+ * output_finish(). Only for runs of a command file: the server sends what commands print to its
+ * clients instead.
+ */
+void output_start() {
+    stdout_buffer = new Output_buffer(STDOUT_FILENO);
+    stderr_buffer = new Output_buffer(STDERR_FILENO);
+    original_out = std::cout.rdbuf(stdout_buffer);
+    original_err = std::cerr.rdbuf(stderr_buffer);
+}
+
+/**
+ * @brief Write out everything still buffered and print to stdout and stderr directly again
+ */
+void output_finish() {
+    if (stdout_buffer == NULL) {
+        return;
+    }
+    std::cout.rdbuf(original_out);
+    std::cerr.rdbuf(original_err);
+    stdout_buffer->drain();
+    stderr_buffer->drain();
+    delete stdout_buffer;
+    delete stderr_buffer;
+    stdout_buffer = NULL;
+    stderr_buffer = NULL;
+}
+
+/**
+ * @brief Get ready to run a command. With JSON lines, everything the command prints is collected
+ * until output_end_command() so that it can go in the command's record.
+ */
+void output_begin_command() {
+    if (output_format != OUTPUT_JSON_LINES) {
+        return;
+    }
+    command_output.text.clear();
+    command_errors.text.clear();
+    command_entries.clear();
+    command_data.clear();
+    record_out = std::cout.rdbuf(&command_output);
+    record_err = std::cerr.rdbuf(&command_errors);
+}
+
+/**
+ * @brief Add text to a record as a JSON string literal. Bytes outside of ASCII are escaped one by
+ * one, so that names with stray bytes in them still make valid JSON.
+ */
+static void append_json_string(std::string & out, const char * text, size_t length) {
+    out += '"';
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c < 0x20 || c >= 0x7F) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+/**
+ * @brief Write out what the commands run so far printed, stdout first. What a command prints is
+ * then on the terminal before the next command runs, in step with the command it came from, and
+ * is not lost if the run crashes.
+ */
+static void drain_buffers() {
+    if (stdout_buffer == NULL) {
+        return;
+    }
+    stdout_buffer->drain();
+    stderr_buffer->drain();
+}
+
+/**
+ * @brief Finish running a command. With JSON lines, its record is printed: where the command came
+ * from, its status (0 if it ran without errors, 1 if it printed an error, 2 if it was invalid),
+ * what it printed to stdout and to stderr, and the entries it listed or the block it read. Either
+ * way, what the command printed is then written out.
+ *
+ * @param source_name - Where the command came from (eg. the command file name)
+ * @param line_number - The line number of the command within its source
+ * @param command - The command's name, its first word
+ * @param valid - False if the command was rejected
+ */
+void output_end_command(const std::string & source_name, int line_number, const char * command, bool valid) {
+    if (output_format != OUTPUT_JSON_LINES) {
+        drain_buffers();
+        return;
+    }
+    std::cout.rdbuf(record_out);
+    std::cerr.rdbuf(record_err);
+
+    int status = !valid ? STATUS_INVALID : command_errors.text.empty() ? STATUS_OK : STATUS_FAILED;
+    char number[16];
+    record.clear();
+    record += "{\"source\": ";
+    append_json_string(record, source_name.data(), source_name.size());
+    snprintf(number, sizeof(number), "%d", line_number);
+    record += ", \"line\": ";
+    record += number;
+    record += ", \"command\": ";
+    append_json_string(record, command, strlen(command));
+    snprintf(number, sizeof(number), "%d", status);
+    record += ", \"status\": ";
+    record += number;
+    record += ", \"output\": ";
+    append_json_string(record, command_output.text.data(), command_output.text.size());
+    record += ", \"errors\": ";
+    append_json_string(record, command_errors.text.data(), command_errors.text.size());
+    if (!command_entries.empty()) {
+        record += ", \"entries\": [";
+        record += command_entries;
+        record += "]";
+    }
+    if (!command_data.empty()) {
+        record += ", \"data\": \"";
+        record += command_data;
+        record += "\"";
+    }
+    record += "}\n";
+    std::cout.write(record.data(), record.size());
+    drain_buffers();
+}
+
+/**
+ * @brief Record an entry listed by L, for the command's JSON record. Does nothing in text mode.
+ *
+ * @param name - The name of the entry, up to 5 characters and not necessarily terminated
+ * @param size - The size of a file in KB, or the number of entries of a directory
+ * @param directory - True if the entry is a directory
+ */
+void output_entry(const char * name, int size, bool directory) {
+    if (output_format != OUTPUT_JSON_LINES) {
+        return;
+    }
+    if (!command_entries.empty()) {
+        command_entries += ", ";
+    }
+    char number[16];
+    snprintf(number, sizeof(number), "%d", size);
+    command_entries += "{\"name\": ";
+    append_json_string(command_entries, name, strnlen(name, 5));
+    command_entries += directory ? ", \"directory\": true" : ", \"directory\": false";
+    command_entries += ", \"size\": ";
+    command_entries += number;
+    command_entries += "}";
+}
+
+/**
+ * @brief Record a block read by R, in base64, for the command's JSON record. Does nothing in text
+ * mode.
+ *
+ * @param data - The block
+ * @param size - The size of the block
+ */
+void output_block(const uint8_t * data, size_t size) {
+    if (output_format != OUTPUT_JSON_LINES) {
+        return;
+    }
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    command_data.clear();
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t group = (uint32_t) data[i] << 16;
+        if (i + 1 < size) {
+            group |= (uint32_t) data[i + 1] << 8;
+        }
+        if (i + 2 < size) {
+            group |= data[i + 2];
+        }
+        command_data += digits[(group >> 18) & 0x3F];
+        command_data += digits[(group >> 12) & 0x3F];
+        command_data += i + 1 < size ? digits[(group >> 6) & 0x3F] : '=';
+        command_data += i + 2 < size ? digits[group & 0x3F] : '=';
+    }
+}
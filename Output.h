@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// How the results of commands are printed
+enum Output_format {
+    OUTPUT_TEXT,       // As the commands print them, errors on stderr
+    OUTPUT_JSON_LINES  // One JSON object per command on stdout, with what it printed in it
+};
+
+bool set_output_format(const char * name);
+void output_start();
+void output_finish();
+void output_begin_command();
+void output_end_command(const std::string & source_name, int line_number, const char * command, bool valid);
+void output_entry(const char * name, int size, bool directory);
+void output_block(const uint8_t * data, size_t size);
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "BlockPool.h"
+#include "InodeHelper.h"
+#include "IO.h"
+#include "ReadAhead.h"
+
+// Constants
+#define READ_AHEAD_SLOTS 8
+#define READ_AHEAD_INITIAL_WINDOW 4
+#define READ_AHEAD_MAX_WINDOW 32
+
+enum Slot_state { SLOT_EMPTY, SLOT_QUEUED, SLOT_LOADING, SLOT_READY };
+
+typedef struct {
+    int window;     // Blocks to read ahead next time, 0 while the stream looks random
+    int next_block; // The file block a sequential reader would ask for next
+} Stream;
+
+typedef struct {
+    alignas(BLOCK_ALIGNMENT) uint8_t data[READ_AHEAD_MAX_WINDOW * BLOCK_SIZE];
+    Slot_state state;
+    int first_block; // First physical block held by the slot
+    int count;       // Number of blocks held by the slot
+    uint64_t queued_at;
+    uint64_t last_used;
+    bool consumed[READ_AHEAD_MAX_WINDOW];
+    bool failed[READ_AHEAD_MAX_WINDOW]; // Could not be read or failed its checksum, so is read again when asked for
+} Slot;
+
+static Slot slots[READ_AHEAD_SLOTS];
+static Stream streams[Standard_geometry::inode_count];
+static Read_ahead_stats stats = {0, 0, 0, 0};
+static uint64_t clock_tick = 0;
+
+static std::mutex ra_mutex;
+static std::condition_variable work_ready;
+static std::condition_variable slot_ready;
+static std::thread * worker = NULL;
+static bool stopping = false;
+static std::string worker_disk_name = ""; // The disk the slots and streams belong to
+
+/**
+ * @brief Background thread that fills queued slots, oldest first. Each slot is filled with a
+ * single pread of the whole window. Nothing is printed here, since the command thread may be
+ * redirecting std::cerr meanwhile: blocks that could not be read or failed their checksums are
+ * marked in the slot, and read again by the command that asks for them, which reports them.
+ */
+static void worker_loop() {
+    // The command thread can move the read-ahead to another disk at any time, so the name is copied
+    // with the slot. The copy keeps its capacity, so it only allocates for a longer name.
+    std::string disk_name;
+    std::unique_lock<std::mutex> lock(ra_mutex);
+    while (true) {
+        Slot * next = NULL;
+        for (int i = 0; i < READ_AHEAD_SLOTS; i++) {
+            if (slots[i].state == SLOT_QUEUED && (next == NULL || slots[i].queued_at < next->queued_at)) {
+                next = &slots[i];
+            }
+        }
+
+        if (next == NULL) {
+            if (stopping) {
+                return;
+            }
+            work_ready.wait(lock);
+            continue;
+        }
+
+        next->state = SLOT_LOADING;
+        disk_name = worker_disk_name;
+        lock.unlock();
+
+        Disk disk;
+        bool failed[Standard_geometry::block_count] = {false};
+        bool read = open_disk(disk_name, O_RDONLY, &disk) && read_blocks_unreported(&disk, next->data, next->first_block, next->count, failed);
+        close_disk(&disk);
+
+        lock.lock();
+        for (int i = 0; i < next->count; i++) {
+            next->failed[i] = !read || failed[next->first_block + i];
+        }
+        next->state = SLOT_READY;
+        stats.prefetched += next->count;
+        slot_ready.notify_all();
+    }
+}
+
+/**
+ * @brief Drop the contents of a slot, waiting for an in-flight read to land first. Blocks that
+ * were read ahead but never handed out are counted as wasted. The lock must be held.
+ *
+ * @param slot - The slot to drop
+ * @param lock - The held read-ahead lock
+ */
+static void drop_slot(Slot * slot, std::unique_lock<std::mutex> & lock) {
+    while (slot->state == SLOT_LOADING) {
+        slot_ready.wait(lock);
+    }
+    if (slot->state == SLOT_READY) {
+        for (int i = 0; i < slot->count; i++) {
+            if (!slot->consumed[i]) {
+                stats.wasted++;
+            }
+        }
+    }
+    slot->state = SLOT_EMPTY;
+}
+
+/**
+ * @brief Drop every slot and forget every access pattern. The lock must be held.
+ *
+ * @param lock - The held read-ahead lock
+ */
+static void forget_all(std::unique_lock<std::mutex> & lock) {
+    for (int i = 0; i < READ_AHEAD_SLOTS; i++) {
+        drop_slot(&slots[i], lock);
+    }
+    for (int i = 0; i < Standard_geometry::inode_count; i++) {
+        streams[i].window = 0;
+        streams[i].next_block = 0;
+    }
+}
+
+/**
+ * @brief Find the slot holding (or about to hold) the given physical block. The lock must be held.
+ *
+ * @param block_number - The physical block to look for
+ * @return The slot, or NULL if no slot covers the block
+ */
+static Slot * find_slot(int block_number) {
+    for (int i = 0; i < READ_AHEAD_SLOTS; i++) {
+        Slot * slot = &slots[i];
+        if (slot->state != SLOT_EMPTY && block_number >= slot->first_block && block_number < slot->first_block + slot->count) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Queue an asynchronous read of the given physical blocks. Reuses an empty slot, or
+ * the least recently used filled one. Does nothing if every slot is still in flight.
+ * The lock must be held.
+ *
+ * @param first_block - The first physical block to read
+ * @param count - The number of blocks to read
+ * @param lock - The held read-ahead lock
+ */
+static void schedule(int first_block, int count, std::unique_lock<std::mutex> & lock) {
+    Slot * victim = NULL;
+    for (int i = 0; i < READ_AHEAD_SLOTS; i++) {
+        Slot * slot = &slots[i];
+        if (slot->state == SLOT_EMPTY) {
+            victim = slot;
+            break;
+        }
+        if (slot->state == SLOT_READY && (victim == NULL || slot->last_used < victim->last_used)) {
+            victim = slot;
+        }
+    }
+    if (victim == NULL) {
+        return;
+    }
+    drop_slot(victim, lock);
+
+    victim->first_block = first_block;
+    victim->count = count;
+    victim->queued_at = ++clock_tick;
+    victim->last_used = clock_tick;
+    for (int i = 0; i < count; i++) {
+        victim->consumed[i] = false;
+    }
+    victim->state = SLOT_QUEUED;
+    work_ready.notify_one();
+}
+
+/**
+ * @brief Read the block_num-th block of the file represented by the inode into buff. Sequential
+ * readers of a file are detected per inode: while reads keep arriving in order, the next window
+ * of the file is read in the background and the window doubles each time (up to 32 blocks). An
+ * out of order read collapses the window back to nothing.
+ *
+ * @param disk_name - The disk the file lives on
+ * @param inode_index - The index of the file's inode, used to track the access pattern
+ * @param inode - The inode representing the file to read
+ * @param block_num - The block of the file to read
+ * @param buff - The array to read the block into
+ */
+void readahead_read(const std::string & disk_name, int inode_index, Inode * inode, int block_num, uint8_t buff[BLOCK_SIZE]) {
+    int block = inode->start_block + block_num;
+    int end_block = inode->start_block + get_inode_size(*inode);
+
+    std::unique_lock<std::mutex> lock(ra_mutex);
+    if (worker_disk_name != disk_name) {
+        // Reads have moved to another disk, eg. another client of the server
+        forget_all(lock);
+        worker_disk_name = disk_name;
+    }
+
+    Stream * stream = &streams[inode_index];
+    if (block_num != stream->next_block) {
+        stream->window = 0;
+    } else if (stream->window == 0) {
+        stream->window = READ_AHEAD_INITIAL_WINDOW;
+    }
+    stream->next_block = block_num + 1;
+
+    // Where the next window should start if the reader keeps going
+    int ahead = block + 1;
+
+    Slot * slot = find_slot(block);
+    while (slot != NULL && slot->state != SLOT_READY) {
+        slot_ready.wait(lock);
+    }
+    if (slot != NULL && slot->failed[block - slot->first_block]) {
+        // Read again below, so that this command reports what is wrong with the block
+        slot->consumed[block - slot->first_block] = true;
+        ahead = slot->first_block + slot->count;
+        slot = NULL;
+    }
+    if (slot != NULL) {
+        int index = block - slot->first_block;
+        memcpy(buff, slot->data + index * BLOCK_SIZE, BLOCK_SIZE);
+        slot->consumed[index] = true;
+        slot->last_used = ++clock_tick;
+        stats.hits++;
+        ahead = slot->first_block + slot->count;
+    } else {
+        lock.unlock();
+        Disk disk;
+        open_disk(disk_name, O_RDONLY, &disk);
+        read_from_block(&disk, buff, block);
+        close_disk(&disk);
+        lock.lock();
+        stats.misses++;
+    }
+
+    if (stream->window > 0 && ahead < end_block && find_slot(ahead) == NULL) {
+        int count = std::min(stream->window, end_block - ahead);
+        schedule(ahead, count, lock);
+        stream->window = std::min(stream->window * 2, READ_AHEAD_MAX_WINDOW);
+    }
+}
+
+/**
+ * @brief Drop any read-ahead data for the given physical block. Must be called whenever the
+ * block is written so a later read does not see stale data.
+ *
+ * @param block_number - The physical block that is being written
+ */
+void readahead_invalidate_block(int block_number) {
+    std::unique_lock<std::mutex> lock(ra_mutex);
+    Slot * slot = find_slot(block_number);
+    if (slot != NULL) {
+        drop_slot(slot, lock);
+    }
+}
+
+/**
+ * @brief Forget all read-ahead data and access patterns. Called when a new disk is mounted.
+ */
+void readahead_reset() {
+    std::unique_lock<std::mutex> lock(ra_mutex);
+    forget_all(lock);
+}
+
+/**
+ * @brief Start the background read-ahead thread, if it is not running yet. Done when a disk is
+ * mounted rather than on the first prefetch, so that reads never allocate.
+ */
+void readahead_start() {
+    std::unique_lock<std::mutex> lock(ra_mutex);
+    if (worker == NULL) {
+        stopping = false;
+        worker = new std::thread(worker_loop);
+    }
+}
+
+/**
+ * @brief Stop the background read-ahead thread. Outstanding reads are finished first.
+ */
+void readahead_shutdown() {
+    readahead_reset();
+    {
+        std::unique_lock<std::mutex> lock(ra_mutex);
+        stopping = true;
+        work_ready.notify_one();
+    }
+    if (worker != NULL) {
+        worker->join();
+        delete worker;
+        worker = NULL;
+    }
+}
+
+/**
+ * @brief Get a snapshot of the read-ahead counters
+ *
+ * @return The counters
+ */
+Read_ahead_stats readahead_stats() {
+    std::unique_lock<std::mutex> lock(ra_mutex);
+    return stats;
+}
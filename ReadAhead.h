@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+typedef struct {
+    uint64_t hits;       // Reads served from a read-ahead buffer
+    uint64_t misses;     // Reads that had to go to the disk
+    uint64_t prefetched; // Blocks read ahead of time
+    uint64_t wasted;     // Prefetched blocks dropped before they were read
+} Read_ahead_stats;
+
+void readahead_read(const std::string & disk_name, int inode_index, Inode * inode, int block_num, uint8_t buff[BLOCK_SIZE]);
+void readahead_invalidate_block(int block_number);
+void readahead_reset();
+void readahead_start();
+void readahead_shutdown();
+Read_ahead_stats readahead_stats();
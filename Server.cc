@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "BlockPool.h"
+#include "FileSystem.h"
+#include "Server.h"
+
+// Constants
+#define SERVER_BACKLOG 128
+#define READ_CHUNK_SIZE 65536
+// A client that does not read its responses stops having its commands run past this much output
+#define MAX_PENDING_OUTPUT (1 << 20)
+
+typedef struct {
+    int fd;
+    int id;
+    std::string input;   // Bytes received but not yet run, may end with a partial line
+    std::string output;  // Responses not yet sent
+    size_t output_sent;  // How much of output has been sent
+    int line_number;
+    bool input_closed;   // The client will not send any more commands
+    Session session;
+} Client;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int) {
+    stop_requested = 1;
+}
+
+/**
+ * @brief Run one command for a client in the client's session. Everything the command prints,
+ * on stdout or stderr, becomes the response. A response is a header line with the command's
+ * line number and the length of the output, followed by the output itself.
+ *
+ * @param client - The client that sent the command
+ * @param command - The command to run
+ */
+static void run_client_command(Client * client, std::string & command) {
+    client->line_number++;
+    if (!command.empty() && command[command.size() - 1] == '\r') {
+        command.erase(command.size() - 1);
+    }
+
+    std::ostringstream captured;
+    std::streambuf * old_out = std::cout.rdbuf(captured.rdbuf());
+    std::streambuf * old_err = std::cerr.rdbuf(captured.rdbuf());
+
+    restore_session(&client->session);
+    run_command_line(command, "client " + std::to_string(client->id), client->line_number);
+    save_session(&client->session);
+
+    std::cout.rdbuf(old_out);
+    std::cerr.rdbuf(old_err);
+
+    std::string payload = captured.str();
+    client->output += std::to_string(client->line_number) + " " + std::to_string(payload.size()) + "\n";
+    client->output += payload;
+}
+
+/**
+ * @brief Run every complete command line the client has sent so far, in order. Once the client
+ * has stopped sending, a last line without a newline is run too. Stops early if the client has
+ * too many unsent responses.
+ *
+ * @param client - The client whose commands to run
+ */
+static void run_client_commands(Client * client) {
+    size_t start = 0;
+    while (client->output.size() - client->output_sent < MAX_PENDING_OUTPUT) {
+        size_t end = client->input.find('\n', start);
+        if (end == std::string::npos) {
+            if (client->input_closed && start < client->input.size()) {
+                end = client->input.size();
+            } else {
+                break;
+            }
+        }
+        std::string command = client->input.substr(start, end - start);
+        start = std::min(end + 1, client->input.size());
+        run_client_command(client, command);
+    }
+    client->input.erase(0, start);
+}
+
+/**
+ * @brief Read whatever the client has sent. Marks the client's input as closed at end of file.
+ *
+ * @param client - The client to read from
+ * @return False if the connection failed
+ */
+static bool receive_from_client(Client * client) {
+    char chunk[READ_CHUNK_SIZE];
+    while (true) {
+        ssize_t sizeRead = read(client->fd, chunk, sizeof(chunk));
+        if (sizeRead > 0) {
+            client->input.append(chunk, sizeRead);
+        } else if (sizeRead == 0) {
+            client->input_closed = true;
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+}
+
+/**
+ * @brief Send as much of the client's pending output as the socket will take
+ *
+ * @param client - The client to send to
+ * @return False if the connection failed
+ */
+static bool send_to_client(Client * client) {
+    while (client->output_sent < client->output.size()) {
+        ssize_t sizeWritten = write(client->fd, client->output.data() + client->output_sent, client->output.size() - client->output_sent);
+        if (sizeWritten > 0) {
+            client->output_sent += sizeWritten;
+        } else if (sizeWritten < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return sizeWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+    client->output.clear();
+    client->output_sent = 0;
+    return true;
+}
+
+/**
+ * @brief Close the client's connection and free its session
+ *
+ * @param client - The client to disconnect
+ */
+static void disconnect_client(Client * client) {
+    close(client->fd);
+    release_block(client->session.buffer);
+    delete client;
+}
+
+/**
+ * @brief Serve commands to local clients over a Unix domain socket until interrupted by SIGINT or
+ * SIGTERM. Each connection gets its own session (mounted disk, working directory and buffer).
+ * Clients may send many commands without waiting for their responses; responses are always sent
+ * back in the order the commands were received. Disks stay mounted for the life of the server.
+ *
+ * @param socket_path - The path of the socket to listen on
+ * @return The exit status of the process
+ */
+int run_server(const char * socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        std::cerr << "Error: Socket path " << socket_path << " is too long\n";
+        return 1;
+    }
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        std::cerr << "Error: Cannot create socket\n";
+        return 1;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listen_fd, SERVER_BACKLOG) != 0) {
+        std::cerr << "Error: Cannot listen on " << socket_path << std::endl;
+        close(listen_fd);
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Restored when the server stops, so no client's session is left current
+    Session server_session;
+    save_session(&server_session);
+
+    std::vector<Client *> clients;
+    std::vector<struct pollfd> poll_fds;
+    int next_client_id = 1;
+
+    while (!stop_requested) {
+        poll_fds.clear();
+        poll_fds.push_back({listen_fd, POLLIN, 0});
+        for (auto client: clients) {
+            short events = 0;
+            if (!client->input_closed && client->output.size() - client->output_sent < MAX_PENDING_OUTPUT) {
+                events |= POLLIN;
+            }
+            if (client->output_sent < client->output.size()) {
+                events |= POLLOUT;
+            }
+            poll_fds.push_back({client->fd, events, 0});
+        }
+
+        if (poll(poll_fds.data(), poll_fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error: Waiting for clients failed\n";
+            break;
+        }
+
+        std::vector<Client *> remaining;
+        for (size_t i = 0; i < clients.size(); i++) {
+            Client * client = clients[i];
+            short revents = poll_fds[i + 1].revents;
+
+            bool healthy = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                healthy = receive_from_client(client);
+            }
+            if (healthy) {
+                run_client_commands(client);
+                healthy = send_to_client(client);
+            }
+            // Commands held back while the client was not reading can run now
+            if (healthy && client->output.empty() && !client->input.empty()) {
+                run_client_commands(client);
+                healthy = send_to_client(client);
+            }
+
+            bool finished = client->input_closed && client->output.empty() && client->input.empty();
+            if (!healthy || finished) {
+                disconnect_client(client);
+            } else {
+                remaining.push_back(client);
+            }
+        }
+        clients.swap(remaining);
+
+        if (poll_fds[0].revents & POLLIN) {
+            while (true) {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    break;
+                }
+                Client * client = new Client;
+                client->fd = fd;
+                client->id = next_client_id++;
+                client->output_sent = 0;
+                client->line_number = 0;
+                client->input_closed = false;
+                client->session.super_block = NULL;
+                client->session.geometry = NULL;
+                client->session.disk_name = "";
+                client->session.current_directory = ROOT;
+                client->session.buffer = acquire_block();
+                clients.push_back(client);
+            }
+        }
+    }
+
+    for (auto client: clients) {
+        send_to_client(client);
+        disconnect_client(client);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    restore_session(&server_session);
+
+    return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+/**
+ * @brief Serve commands to local clients over a Unix domain socket until interrupted.
+ *
+ * @param socket_path - The path of the socket to listen on
+ * @return The exit status of the process
+ */
+int run_server(const char * socket_path);
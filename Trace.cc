@@ -0,0 +1,157 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+
+#include "Trace.h"
+
+// Trace events in the Chrome trace event format: a "B" event opens a span on a thread and the next
+// "E" event on the same thread closes it, so spans nest like the calls they cover
+typedef struct {
+    std::string name;
+    char phase;
+    int thread;
+    uint64_t time_ns;   // Since tracing started
+    std::string args;   // A JSON object, or empty
+} Trace_event;
+
+static bool tracing = false;
+static std::string output_path;
+static std::chrono::steady_clock::time_point started_at;
+static std::mutex trace_mutex;
+static std::vector<Trace_event> events;
+static std::atomic<int> next_thread(1);
+
+/**
+ * @brief A small number identifying the calling thread in the trace; the first thread to record an
+ * event is 1
+ */
+static int trace_thread() {
+    static thread_local int thread = 0;
+    if (thread == 0) {
+        thread = next_thread++;
+    }
+    return thread;
+}
+
+/**
+ * @brief Record an event on the calling thread
+ */
+static void record(const char * name, char phase, const std::string & args) {
+    uint64_t time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started_at).count();
+    int thread = trace_thread();
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    events.push_back({name, phase, thread, time_ns, args});
+}
+
+/**
+ * @brief Write a string as a JSON string literal
+ */
+static std::string json_string(const std::string & text) {
+    std::string quoted = "\"";
+    for (auto c: text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char) c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/**
+ * @brief Start recording a timeline of the run, to be written to the given file by trace_finish()
+ *
+ * @param trace_path - The file to write the trace to
+ */
+void trace_start(const char * trace_path) {
+    output_path = trace_path;
+    started_at = std::chrono::steady_clock::now();
+    tracing = true;
+}
+
+/**
+ * @brief Stop tracing and write the recorded events as Chrome trace event JSON, which can be opened
+ * in chrome://tracing or Perfetto. Spans still open (eg. on a thread that was never stopped) are
+ * left open. Must be called after all threads that may record events have stopped.
+ */
+void trace_finish() {
+    if (!tracing) {
+        return;
+    }
+    tracing = false;
+
+    std::ofstream trace_file(output_path);
+    trace_file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < events.size(); i++) {
+        const Trace_event & event = events[i];
+        char time_us[32];
+        snprintf(time_us, sizeof(time_us), "%.3f", event.time_ns / 1000.0);
+        trace_file << "{\"name\": " << json_string(event.name) << ", \"ph\": \"" << event.phase << "\", \"pid\": 1";
+        trace_file << ", \"tid\": " << event.thread << ", \"ts\": " << time_us;
+        if (!event.args.empty()) {
+            trace_file << ", \"args\": " << event.args;
+        }
+        trace_file << (i + 1 < events.size() ? "},\n" : "}\n");
+    }
+    trace_file << "]}\n";
+    trace_file.close();
+    if (!trace_file) {
+        std::cerr << "Error: Cannot write trace to " << output_path << std::endl;
+    }
+    events.clear();
+}
+
+/**
+ * @brief Open a span on the calling thread
+ *
+ * @param name - The name of the span
+ */
+void trace_begin(const char * name) {
+    if (tracing) {
+        record(name, 'B', "");
+    }
+}
+
+/**
+ * @brief Open a span on the calling thread for work on a range of blocks
+ *
+ * @param name - The name of the span
+ * @param block_number - The first block
+ * @param count - The number of blocks
+ */
+void trace_begin(const char * name, int block_number, int count) {
+    if (tracing) {
+        record(name, 'B', "{\"block\": " + std::to_string(block_number) + ", \"count\": " + std::to_string(count) + "}");
+    }
+}
+
+/**
+ * @brief Open a span on the calling thread for a command, noting where the command came from
+ *
+ * @param name - The name of the span, eg. the command line
+ * @param source_name - Where the command came from (eg. the command file name)
+ * @param line_number - The line number of the command within its source
+ */
+void trace_begin(const char * name, const std::string & source_name, int line_number) {
+    if (tracing) {
+        record(name, 'B', "{\"source\": " + json_string(source_name) + ", \"line\": " + std::to_string(line_number) + "}");
+    }
+}
+
+/**
+ * @brief Close the innermost open span on the calling thread
+ */
+void trace_end() {
+    if (tracing) {
+        record("", 'E', "");
+    }
+}
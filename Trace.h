@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+void trace_start(const char * trace_path);
+void trace_finish();
+void trace_begin(const char * name);
+void trace_begin(const char * name, int block_number, int count);
+void trace_begin(const char * name, const std::string & source_name, int line_number);
+void trace_end();
+
+/**
+ * @brief A span on the trace timeline covering the lifetime of the object. Does nothing unless
+ * tracing was started with trace_start().
+ */
+class Trace_span {
+public:
+    explicit Trace_span(const char * name) { trace_begin(name); }
+    Trace_span(const char * name, int block_number, int count) { trace_begin(name, block_number, count); }
+    Trace_span(const char * name, const std::string & source_name, int line_number) { trace_begin(name, source_name, line_number); }
+    ~Trace_span() { trace_end(); }
+
+private:
+    Trace_span(const Trace_span &);
+    Trace_span & operator=(const Trace_span &);
+};
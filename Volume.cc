@@ -0,0 +1,233 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <vector>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Volume.h"
+
+// Every member starts with a label block naming the volume it belongs to; its data blocks follow
+#define MEMBER_MAGIC "FSVMEMBR"
+
+typedef struct {
+    char magic[8];
+    uint8_t uuid[16];
+    uint32_t member_index;
+    uint32_t member_count;
+    uint32_t stripe_unit;
+} Volume_label;
+
+/**
+ * @brief Find where a logical block of a striped volume lives
+ *
+ * @param stripe_unit - The number of blocks in a stripe unit
+ * @param member_count - The number of members in the volume
+ * @param block_number - The logical block
+ * @param member - Set to the index of the member holding the block
+ * @param member_block - Set to the index of the block within the member's data blocks
+ */
+void locate_volume_block(int stripe_unit, int member_count, int block_number, int * member, int * member_block) {
+    int unit = block_number / stripe_unit;
+    *member = unit % member_count;
+    *member_block = (unit / member_count) * stripe_unit + block_number % stripe_unit;
+}
+
+/**
+ * @brief Resolve a member path from a volume descriptor. Relative paths are relative to the
+ * directory holding the descriptor.
+ *
+ * @param descriptor_name - The path of the volume descriptor
+ * @param member_name - The member path as written in the descriptor
+ * @return The path of the member
+ */
+static std::string resolve_member_path(const std::string & descriptor_name, const std::string & member_name) {
+    size_t slash = descriptor_name.rfind('/');
+    if (member_name.empty() || member_name[0] == '/' || slash == std::string::npos) {
+        return member_name;
+    }
+    return descriptor_name.substr(0, slash + 1) + member_name;
+}
+
+/**
+ * @brief Read the layout of a striped volume from its descriptor. A descriptor is a text file:
+ * a line "FSVOLUME <uuid> <stripe unit> <member count>" followed by one line per member image file.
+ *
+ * @param disk_name - The disk to read. May be a plain image file.
+ * @param layout - Where to store the layout
+ * @return True if the disk is a volume descriptor. False if it is a plain image file.
+ */
+bool read_volume_layout(const std::string & disk_name, Volume_layout * layout) {
+    char head[4096];
+    int fd = open(disk_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t sizeRead = pread(fd, head, sizeof(head) - 1, 0);
+    close(fd);
+    if (sizeRead < (ssize_t) strlen(VOLUME_MAGIC) || strncmp(head, VOLUME_MAGIC, strlen(VOLUME_MAGIC)) != 0) {
+        return false;
+    }
+    head[sizeRead] = 0;
+
+    std::istringstream descriptor(head);
+    std::string magic;
+    std::string uuid;
+    descriptor >> magic >> uuid >> layout->stripe_unit >> layout->member_count;
+    if (!descriptor || uuid.size() != 32 || layout->member_count < 1 || layout->member_count > MAX_VOLUME_MEMBERS || layout->stripe_unit < 1) {
+        return false;
+    }
+    for (int i = 0; i < 16; i++) {
+        layout->uuid[i] = (uint8_t) strtoul(uuid.substr(i * 2, 2).c_str(), NULL, 16);
+    }
+    for (int i = 0; i < layout->member_count; i++) {
+        std::string member;
+        descriptor >> member;
+        if (!descriptor) {
+            return false;
+        }
+        layout->members[i] = resolve_member_path(disk_name, member);
+    }
+    return true;
+}
+
+/**
+ * @brief Check that every member image file of a volume carries the volume's label, in the right
+ * position, and holds all of the blocks the layout puts on it.
+ *
+ * @param disk_name - The volume descriptor
+ * @param layout - The layout read from the descriptor
+ * @return True if all members belong to the volume. False otherwise.
+ */
+bool check_volume_members(const std::string & disk_name, const Volume_layout * layout) {
+    for (int i = 0; i < layout->member_count; i++) {
+        const std::string & member_name = layout->members[i];
+        Volume_label label;
+        memset(&label, 0, sizeof(label));
+
+        int fd = open(member_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error: Cannot find disk " << member_name << " of volume " << disk_name << std::endl;
+            return false;
+        }
+        ssize_t sizeRead = pread(fd, &label, sizeof(label), 0);
+        off_t member_size = lseek(fd, 0, SEEK_END);
+        close(fd);
+
+        // The member must hold every block the layout places on it
+        int needed_blocks = 0;
+        for (int block = 0; block < Standard_geometry::block_count; block++) {
+            int member;
+            int member_block;
+            locate_volume_block(layout->stripe_unit, layout->member_count, block, &member, &member_block);
+            if (member == i) {
+                needed_blocks = member_block + 1;
+            }
+        }
+
+        if (sizeRead != (ssize_t) sizeof(label) ||
+                    memcmp(label.magic, MEMBER_MAGIC, 8) != 0 ||
+                    memcmp(label.uuid, layout->uuid, 16) != 0 ||
+                    label.member_index != (uint32_t) i ||
+                    label.member_count != (uint32_t) layout->member_count ||
+                    label.stripe_unit != (uint32_t) layout->stripe_unit ||
+                    member_size < (off_t) BLOCK_SIZE * (needed_blocks + 1)) {
+            std::cerr << "Error: Disk " << member_name << " is not member " << i << " of volume " << disk_name << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Create a striped volume from an existing image file. The image's blocks are spread over
+ * the new member image files and a descriptor naming them is written; the descriptor can then be
+ * mounted like an image file.
+ *
+ * @param descriptor_name - The path of the descriptor to create
+ * @param stripe_unit - The number of blocks in a stripe unit
+ * @param image_name - The image file holding the file system to stripe
+ * @param member_names - The paths of the member image files to create, relative to the descriptor
+ * @param member_count - The number of members
+ * @return The exit status of the process
+ */
+int make_volume(const char * descriptor_name, int stripe_unit, const char * image_name, char ** member_names, int member_count) {
+    if (member_count < 1 || member_count > MAX_VOLUME_MEMBERS || stripe_unit < 1 || stripe_unit > 127) {
+        std::cerr << "Error: A volume needs 1 to " << MAX_VOLUME_MEMBERS << " members and a stripe unit of 1 to 127 blocks\n";
+        return 1;
+    }
+
+    std::vector<uint8_t> image((size_t) BLOCK_SIZE * Standard_geometry::block_count, 0);
+    int image_fd = open(image_name, O_RDONLY);
+    if (image_fd < 0 || pread(image_fd, image.data(), image.size(), 0) != (ssize_t) image.size()) {
+        std::cerr << "Error: Cannot read disk " << image_name << std::endl;
+        if (image_fd >= 0) {
+            close(image_fd);
+        }
+        return 1;
+    }
+    close(image_fd);
+
+    Volume_label label;
+    memset(&label, 0, sizeof(label));
+    memcpy(label.magic, MEMBER_MAGIC, 8);
+    std::random_device random;
+    for (int i = 0; i < 16; i++) {
+        label.uuid[i] = (uint8_t) random();
+    }
+    label.member_count = member_count;
+    label.stripe_unit = stripe_unit;
+
+    for (int i = 0; i < member_count; i++) {
+        std::vector<uint8_t> member(BLOCK_SIZE, 0);
+        label.member_index = i;
+        memcpy(member.data(), &label, sizeof(label));
+
+        for (int block = 0; block < Standard_geometry::block_count; block++) {
+            int block_member;
+            int member_block;
+            locate_volume_block(stripe_unit, member_count, block, &block_member, &member_block);
+            if (block_member != i) {
+                continue;
+            }
+            size_t offset = (size_t) BLOCK_SIZE * (member_block + 1);
+            if (member.size() < offset + BLOCK_SIZE) {
+                member.resize(offset + BLOCK_SIZE, 0);
+            }
+            memcpy(member.data() + offset, image.data() + (size_t) BLOCK_SIZE * block, BLOCK_SIZE);
+        }
+
+        std::string member_path = resolve_member_path(descriptor_name, member_names[i]);
+        int fd = open(member_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, member.data(), member.size()) != (ssize_t) member.size()) {
+            std::cerr << "Error: Cannot write disk " << member_path << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return 1;
+        }
+        close(fd);
+    }
+
+    std::ofstream descriptor(descriptor_name);
+    descriptor << VOLUME_MAGIC << " ";
+    for (int i = 0; i < 16; i++) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", label.uuid[i]);
+        descriptor << hex;
+    }
+    descriptor << " " << stripe_unit << " " << member_count << "\n";
+    for (int i = 0; i < member_count; i++) {
+        descriptor << member_names[i] << "\n";
+    }
+    descriptor.close();
+    if (!descriptor) {
+        std::cerr << "Error: Cannot write volume descriptor " << descriptor_name << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
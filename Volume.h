@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#include "FileSystem.h"
+
+// Constants
+#define MAX_VOLUME_MEMBERS 16
+#define VOLUME_MAGIC "FSVOLUME"
+
+// How the blocks of a striped volume are spread over its member image files. Logical blocks are
+// grouped into stripe units of stripe_unit blocks, and the stripe units are dealt out to the
+// members in turn. Member 0 holds block 0, and so the superblock and free block list.
+typedef struct {
+    int member_count;
+    int stripe_unit;
+    uint8_t uuid[16];
+    std::string members[MAX_VOLUME_MEMBERS]; // Paths of the member image files
+} Volume_layout;
+
+void locate_volume_block(int stripe_unit, int member_count, int block_number, int * member, int * member_block);
+bool read_volume_layout(const std::string & disk_name, Volume_layout * layout);
+bool check_volume_members(const std::string & disk_name, const Volume_layout * layout);
+int make_volume(const char * descriptor_name, int stripe_unit, const char * image_name, char ** member_names, int member_count);
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Clones a file, writes a block through the clone and deletes the original, then mounts the disk
+# again in a new run, which has only the disk and its block map file to go on. The clone must pass
+# the consistency checks and still read the shared block and its own copy of the written one.
+#
+# Usage: tests/clone_remount.sh [<fs binary>]
+
+FS=$(cd "$(dirname "${1:-./fs}")" && pwd)/$(basename "${1:-./fs}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+# A fresh disk: only the superblock's own block is in use
+{ printf '\200'; head -c 131071 /dev/zero; } > disk
+
+cat > first <<'COMMANDS'
+M disk
+C a 3
+B shared
+W a 0
+W a 1
+K a b
+B own
+W b 1
+D a
+COMMANDS
+
+cat > second <<'COMMANDS'
+M disk
+L
+R b 0
+R b 1
+F
+COMMANDS
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+"$FS" first > first.out 2> first.err || fail "first run exited with $?"
+[ -s first.err ] && fail "first run printed errors: $(cat first.err)"
+[ -f disk.blockmap ] || fail "no block map was saved for the clone"
+
+"$FS" --output json second > second.out 2> second.err || fail "second run exited with $?"
+[ -s second.err ] && fail "second run printed errors: $(cat second.err)"
+grep -q '"command": "M", "status": 0' second.out || fail "the disk did not mount again"
+grep -q '"output": ".       3\\n..      3\\nb       3 KB\\n"' second.out || fail "the clone is not listed as it was left"
+# "shared" and "own" in base64
+grep '"line": 3,' second.out | grep -q '"data": "c2hhcmVk' || fail "block 0 of the clone is not the shared block"
+grep '"line": 4,' second.out | grep -q '"data": "b3du' || fail "block 1 of the clone is not its own copy"
+grep -q '"output": "124 free blocks' second.out || fail "the blocks only the original used were not freed"
+
+echo "PASS: clone, write, delete and remount"
@@ -0,0 +1,660 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Benchmark suite for the file system. Synthetic workloads are generated as command files, and
+// each one is run against a fresh disk image by a dedicated `fs --serve` process. Commands are
+// sent one at a time so the latency of every command can be measured, and the server's I/O
+// counters are read from /proc before and after the workload.
+
+typedef std::chrono::steady_clock Clock;
+
+// Constants
+#define DISK_BLOCKS 128
+#define BLOCK_SIZE 1024
+// Commands run before each workload to measure the socket traffic of a command that does no disk I/O
+#define CALIBRATION_COMMANDS 64
+#define SERVER_START_TIMEOUT_MS 5000
+
+typedef std::vector<std::string> Workload;
+
+typedef struct {
+    const char * name;
+    const char * description;
+    Workload (*generate)(int scale, std::mt19937 & random);
+} Scenario;
+
+// The server's I/O counters from /proc/<pid>/io. Socket traffic is counted too.
+typedef struct {
+    long long read_bytes;
+    long long written_bytes;
+    long long read_syscalls;
+    long long write_syscalls;
+} Io_counters;
+
+typedef struct {
+    std::string scenario;
+    long commands;
+    long error_responses;
+    double seconds;
+    long long read_bytes;
+    long long written_bytes;
+    long long read_syscalls;
+    long long write_syscalls;
+    std::map<std::string, std::vector<double>> latencies_us; // By command letter
+} Scenario_result;
+
+/**
+ * @brief Pick a number between low and high, inclusive
+ */
+static int pick(std::mt19937 & random, int low, int high) {
+    return std::uniform_int_distribution<int>(low, high)(random);
+}
+
+/**
+ * @brief Create and delete batches of small files of random sizes
+ */
+static Workload generate_churn(int scale, std::mt19937 & random) {
+    Workload workload;
+    for (int round = 0; round < scale; round++) {
+        std::vector<int> files;
+        for (int i = 0; i < 20; i++) {
+            workload.push_back("C c" + std::to_string(i) + " " + std::to_string(pick(random, 1, 4)));
+            files.push_back(i);
+        }
+        std::shuffle(files.begin(), files.end(), random);
+        for (auto file: files) {
+            workload.push_back("D c" + std::to_string(file));
+        }
+    }
+    return workload;
+}
+
+/**
+ * @brief Write every block of a few large files in order, then read them back in order
+ */
+static Workload generate_sequential(int scale, std::mt19937 &) {
+    Workload workload;
+    for (int file = 0; file < 3; file++) {
+        workload.push_back("C s" + std::to_string(file) + " 40");
+    }
+    workload.push_back("B sequential block contents");
+    for (int round = 0; round < scale; round++) {
+        for (int file = 0; file < 3; file++) {
+            for (int block = 0; block < 40; block++) {
+                workload.push_back("W s" + std::to_string(file) + " " + std::to_string(block));
+            }
+        }
+        for (int file = 0; file < 3; file++) {
+            for (int block = 0; block < 40; block++) {
+                workload.push_back("R s" + std::to_string(file) + " " + std::to_string(block));
+            }
+        }
+    }
+    return workload;
+}
+
+/**
+ * @brief Read and write random blocks of a few large files
+ */
+static Workload generate_random(int scale, std::mt19937 & random) {
+    Workload workload;
+    for (int file = 0; file < 3; file++) {
+        workload.push_back("C r" + std::to_string(file) + " 40");
+    }
+    workload.push_back("B random block contents");
+    for (int i = 0; i < scale * 240; i++) {
+        std::string target = "r" + std::to_string(pick(random, 0, 2)) + " " + std::to_string(pick(random, 0, 39));
+        workload.push_back((pick(random, 0, 1) == 0 ? "R " : "W ") + target);
+    }
+    return workload;
+}
+
+/**
+ * @brief Build a deep chain of directories with a file at every level, list each level, then
+ * delete the whole tree
+ */
+static Workload generate_deep_tree(int scale, std::mt19937 &) {
+    const int depth = 60;
+    Workload workload;
+    for (int round = 0; round < scale; round++) {
+        for (int level = 0; level < depth; level++) {
+            workload.push_back("C d 0");
+            workload.push_back("C f 1");
+            workload.push_back("Y d");
+            workload.push_back("L");
+        }
+        for (int level = 0; level < depth; level++) {
+            workload.push_back("Y ..");
+        }
+        workload.push_back("D d");
+        workload.push_back("D f");
+    }
+    return workload;
+}
+
+/**
+ * @brief Fill the disk with small files, punch holes in it, then grow the remaining files so that
+ * some grow in place and others have to be moved
+ */
+static Workload generate_fragmented_resize(int scale, std::mt19937 & random) {
+    Workload workload;
+    for (int round = 0; round < scale; round++) {
+        for (int i = 0; i < 30; i++) {
+            workload.push_back("C e" + std::to_string(i) + " 2");
+        }
+        for (int i = 1; i < 30; i += 2) {
+            workload.push_back("D e" + std::to_string(i));
+        }
+        for (int i = 0; i < 30; i += 2) {
+            workload.push_back("E e" + std::to_string(i) + " " + std::to_string(pick(random, 3, 6)));
+        }
+        for (int i = 0; i < 30; i += 2) {
+            workload.push_back("E e" + std::to_string(i) + " 1");
+        }
+        for (int i = 0; i < 30; i += 2) {
+            workload.push_back("D e" + std::to_string(i));
+        }
+    }
+    return workload;
+}
+
+/**
+ * @brief Churn files until the disk is full of holes, then defragment it
+ */
+static Workload generate_defrag(int scale, std::mt19937 & random) {
+    Workload workload;
+    for (int round = 0; round < scale; round++) {
+        std::vector<int> files;
+        for (int i = 0; i < 40; i++) {
+            workload.push_back("C g" + std::to_string(i) + " " + std::to_string(pick(random, 1, 3)));
+            files.push_back(i);
+        }
+        std::shuffle(files.begin(), files.end(), random);
+        for (int i = 0; i < 20; i++) {
+            workload.push_back("D g" + std::to_string(files[i]));
+        }
+        workload.push_back("O");
+        workload.push_back("L");
+        for (int i = 20; i < 40; i++) {
+            workload.push_back("D g" + std::to_string(files[i]));
+        }
+    }
+    return workload;
+}
+
+static const Scenario scenarios[] = {
+    {"churn", "create/delete churn of small files", generate_churn},
+    {"seq_rw", "sequential block writes then reads", generate_sequential},
+    {"rand_rw", "random block reads and writes", generate_random},
+    {"deep_tree", "deep directory trees", generate_deep_tree},
+    {"frag_resize", "resizes on a fragmented disk", generate_fragmented_resize},
+    {"defrag", "defragmentation after churn", generate_defrag},
+};
+
+/**
+ * @brief Write a fresh disk image: an empty superblock with only block 0 in use, and zeroed blocks
+ *
+ * @param image_name - The image file to create
+ * @return True on success
+ */
+static bool write_fresh_image(const std::string & image_name) {
+    std::vector<char> image((size_t) DISK_BLOCKS * BLOCK_SIZE, 0);
+    image[0] = (char) 0x80;
+    std::ofstream image_file(image_name, std::ios::binary);
+    image_file.write(image.data(), image.size());
+    return (bool) image_file;
+}
+
+/**
+ * @brief Write a workload as a command file that mounts "disk" and runs the workload, so it can
+ * also be run directly with ./fs
+ *
+ * @param file_name - The command file to create
+ * @param workload - The commands
+ * @return True on success
+ */
+static bool write_command_file(const std::string & file_name, const Workload & workload) {
+    std::ofstream command_file(file_name);
+    command_file << "M disk\n";
+    for (auto & command: workload) {
+        command_file << command << "\n";
+    }
+    return (bool) command_file;
+}
+
+/**
+ * @brief Read the I/O counters of a process
+ *
+ * @param pid - The process
+ * @param counters - Where to store the counters
+ * @return True if the counters were read
+ */
+static bool read_io_counters(pid_t pid, Io_counters * counters) {
+    std::ifstream io_file("/proc/" + std::to_string(pid) + "/io");
+    if (!io_file.is_open()) {
+        return false;
+    }
+    memset(counters, 0, sizeof(*counters));
+    std::string key;
+    long long value;
+    while (io_file >> key >> value) {
+        if (key == "rchar:") {
+            counters->read_bytes = value;
+        } else if (key == "wchar:") {
+            counters->written_bytes = value;
+        } else if (key == "syscr:") {
+            counters->read_syscalls = value;
+        } else if (key == "syscw:") {
+            counters->write_syscalls = value;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief A connection to a benchmarked server, which runs one command at a time
+ */
+class Server_connection {
+public:
+    Server_connection() : fd(-1), sent_bytes(0), received_bytes(0) {}
+    ~Server_connection() { if (fd >= 0) close(fd); }
+
+    /**
+     * @brief Connect to the server's socket, retrying while the server starts up
+     */
+    bool connect_to(const std::string & socket_path) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        for (int waited = 0; waited < SERVER_START_TIMEOUT_MS; waited += 10) {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+                return true;
+            }
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            usleep(10000);
+        }
+        return false;
+    }
+
+    /**
+     * @brief Send a command and wait for its whole response
+     *
+     * @param command - The command line, without a newline
+     * @param response - Set to the command's output
+     * @return False if the connection failed
+     */
+    bool run(const std::string & command, std::string & response) {
+        std::string line = command + "\n";
+        size_t sent = 0;
+        while (sent < line.size()) {
+            ssize_t sizeWritten = send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+            if (sizeWritten < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sizeWritten <= 0) {
+                return false;
+            }
+            sent += sizeWritten;
+        }
+        sent_bytes += line.size();
+
+        while (true) {
+            size_t header_end = received.find('\n');
+            long line_number = 0;
+            long length = 0;
+            if (header_end != std::string::npos && sscanf(received.c_str(), "%ld %ld", &line_number, &length) == 2 &&
+                        received.size() - (header_end + 1) >= (size_t) length) {
+                response = received.substr(header_end + 1, length);
+                received_bytes += header_end + 1 + length;
+                received.erase(0, header_end + 1 + length);
+                return true;
+            }
+            char chunk[65536];
+            ssize_t sizeRead = recv(fd, chunk, sizeof(chunk), 0);
+            if (sizeRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sizeRead <= 0) {
+                return false;
+            }
+            received.append(chunk, sizeRead);
+        }
+    }
+
+    int fd;
+    long long sent_bytes;     // Bytes of commands sent
+    long long received_bytes; // Bytes of responses received
+    std::string received;
+};
+
+/**
+ * @brief Start `fs --serve` in the given directory
+ *
+ * @param fs_path - The absolute path of the fs binary
+ * @param directory - The directory to run the server in, holding the disk image
+ * @return The server's process id, or -1 on failure
+ */
+static pid_t start_server(const std::string & fs_path, const std::string & directory) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(directory.c_str()) != 0) {
+            _exit(127);
+        }
+        execl(fs_path.c_str(), "fs", "--serve", "fs.sock", (char *) NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * @brief Stop a server started with start_server()
+ */
+static void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/**
+ * @brief Run one workload against a fresh disk image in a new server
+ *
+ * @param fs_path - The absolute path of the fs binary
+ * @param work_directory - A directory for the image, the command file and the socket
+ * @param scenario - The scenario being run
+ * @param workload - The commands to run
+ * @param result - Where to store the measurements
+ * @return True if the whole workload was run
+ */
+static bool run_scenario(const std::string & fs_path, const std::string & work_directory, const Scenario & scenario, const Workload & workload, Scenario_result * result) {
+    std::string directory = work_directory + "/" + scenario.name;
+    mkdir(directory.c_str(), 0755);
+    if (!write_fresh_image(directory + "/disk") || !write_command_file(directory + "/commands.txt", workload)) {
+        std::cerr << "Error: Cannot write the workload for " << scenario.name << std::endl;
+        return false;
+    }
+
+    pid_t pid = start_server(fs_path, directory);
+    Server_connection server;
+    if (pid < 0 || !server.connect_to(directory + "/fs.sock")) {
+        std::cerr << "Error: Cannot start " << fs_path << " --serve for " << scenario.name << std::endl;
+        if (pid > 0) {
+            stop_server(pid);
+        }
+        return false;
+    }
+
+    std::string response;
+    bool ok = server.run("M disk", response);
+
+    // Measure the socket syscalls of a command that does not touch the disk
+    Io_counters before;
+    Io_counters after;
+    ok = ok && read_io_counters(pid, &before);
+    for (int i = 0; ok && i < CALIBRATION_COMMANDS; i++) {
+        ok = server.run("B calibration", response);
+    }
+    ok = ok && read_io_counters(pid, &after);
+    double socket_reads_per_command = (double) (after.read_syscalls - before.read_syscalls) / CALIBRATION_COMMANDS;
+    double socket_writes_per_command = (double) (after.write_syscalls - before.write_syscalls) / CALIBRATION_COMMANDS;
+
+    result->scenario = scenario.name;
+    result->commands = 0;
+    result->error_responses = 0;
+    long long sent_before = server.sent_bytes;
+    long long received_before = server.received_bytes;
+
+    ok = ok && read_io_counters(pid, &before);
+    Clock::time_point start = Clock::now();
+    for (auto & command: workload) {
+        Clock::time_point sent_at = Clock::now();
+        if (!server.run(command, response)) {
+            ok = false;
+            break;
+        }
+        std::chrono::duration<double, std::micro> latency = Clock::now() - sent_at;
+        result->latencies_us[command.substr(0, 1)].push_back(latency.count());
+        result->commands++;
+        if (response.find("Error") != std::string::npos) {
+            result->error_responses++;
+        }
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    ok = ok && read_io_counters(pid, &after);
+    stop_server(pid);
+
+    // Take the socket traffic out of the server's counters, leaving the disk I/O
+    result->seconds = elapsed.count();
+    result->read_bytes = after.read_bytes - before.read_bytes - (server.sent_bytes - sent_before);
+    result->written_bytes = after.written_bytes - before.written_bytes - (server.received_bytes - received_before);
+    result->read_syscalls = std::max(0LL, after.read_syscalls - before.read_syscalls - (long long) (socket_reads_per_command * result->commands + 0.5));
+    result->write_syscalls = std::max(0LL, after.write_syscalls - before.write_syscalls - (long long) (socket_writes_per_command * result->commands + 0.5));
+
+    if (!ok) {
+        std::cerr << "Error: The server stopped responding during " << scenario.name << std::endl;
+    }
+    return ok;
+}
+
+/**
+ * @brief Get a percentile from sorted values
+ *
+ * @param sorted - The values, sorted in increasing order. Must not be empty.
+ * @param percentile - The percentile to get, between 0 and 100
+ * @return The value at the percentile
+ */
+static double percentile_of(const std::vector<double> & sorted, double percentile) {
+    size_t index = (size_t) (percentile / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+/**
+ * @brief Format the results of a scenario as result file lines: a "scenario" line with the totals
+ * and a "command" line per command letter with its latency percentiles
+ */
+static std::string format_result(Scenario_result & result) {
+    std::ostringstream lines;
+    char line[512];
+    snprintf(line, sizeof(line), "scenario %s commands %ld errors %ld seconds %.6f ops_per_sec %.1f read_bytes %lld written_bytes %lld read_syscalls %lld write_syscalls %lld\n",
+                result.scenario.c_str(), result.commands, result.error_responses, result.seconds,
+                result.seconds > 0 ? result.commands / result.seconds : 0.0,
+                result.read_bytes, result.written_bytes, result.read_syscalls, result.write_syscalls);
+    lines << line;
+    for (auto & command: result.latencies_us) {
+        std::vector<double> & latencies = command.second;
+        std::sort(latencies.begin(), latencies.end());
+        snprintf(line, sizeof(line), "command %s %s count %zu p50_us %.1f p90_us %.1f p99_us %.1f max_us %.1f\n",
+                    result.scenario.c_str(), command.first.c_str(), latencies.size(),
+                    percentile_of(latencies, 50), percentile_of(latencies, 90), percentile_of(latencies, 99), latencies.back());
+        lines << line;
+    }
+    return lines.str();
+}
+
+/**
+ * @brief Read the ops/sec of every scenario from an earlier results file
+ *
+ * @param file_name - The results file
+ * @param ops_per_sec - Filled with the ops/sec by scenario name
+ * @return True if the file was read
+ */
+static bool read_baseline(const std::string & file_name, std::map<std::string, double> & ops_per_sec) {
+    std::ifstream results_file(file_name);
+    if (!results_file.is_open()) {
+        return false;
+    }
+    std::string line;
+    while (getline(results_file, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        std::string scenario;
+        fields >> kind >> scenario;
+        if (kind != "scenario") {
+            continue;
+        }
+        std::string key;
+        std::string value;
+        while (fields >> key >> value) {
+            if (key == "ops_per_sec") {
+                ops_per_sec[scenario] = atof(value.c_str());
+            }
+        }
+    }
+    return true;
+}
+
+static void print_usage() {
+    std::cerr << "Usage: fs_bench [--fs <fs binary>] [--scale N] [--seed N] [--output <results file>]\n"
+                 "                [--compare <results file>] [--generate <directory>] [scenario...]\n"
+                 "Scenarios:\n";
+    for (auto & scenario: scenarios) {
+        std::cerr << "  " << scenario.name << " - " << scenario.description << "\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string fs_path = "./fs";
+    std::string output_name = "bench-results.txt";
+    std::string baseline_name;
+    std::string generate_directory;
+    int scale = 10;
+    unsigned seed = 1;
+    std::vector<const Scenario *> selected;
+
+    for (int arg = 1; arg < argc; arg++) {
+        std::string option = argv[arg];
+        if (option == "--fs" && arg + 1 < argc) {
+            fs_path = argv[++arg];
+        } else if (option == "--scale" && arg + 1 < argc) {
+            scale = atoi(argv[++arg]);
+        } else if (option == "--seed" && arg + 1 < argc) {
+            seed = (unsigned) strtoul(argv[++arg], NULL, 10);
+        } else if (option == "--output" && arg + 1 < argc) {
+            output_name = argv[++arg];
+        } else if (option == "--compare" && arg + 1 < argc) {
+            baseline_name = argv[++arg];
+        } else if (option == "--generate" && arg + 1 < argc) {
+            generate_directory = argv[++arg];
+        } else {
+            const Scenario * found = NULL;
+            for (auto & scenario: scenarios) {
+                if (option == scenario.name) {
+                    found = &scenario;
+                }
+            }
+            if (found == NULL) {
+                print_usage();
+                return 1;
+            }
+            selected.push_back(found);
+        }
+    }
+    if (scale < 1) {
+        print_usage();
+        return 1;
+    }
+    if (selected.empty()) {
+        for (auto & scenario: scenarios) {
+            selected.push_back(&scenario);
+        }
+    }
+
+    // Every scenario gets the same seed, so a workload does not depend on which others are run
+    std::vector<Workload> workloads;
+    for (auto scenario: selected) {
+        std::mt19937 random(seed);
+        workloads.push_back(scenario->generate(scale, random));
+    }
+
+    if (!generate_directory.empty()) {
+        mkdir(generate_directory.c_str(), 0755);
+        for (size_t i = 0; i < selected.size(); i++) {
+            std::string file_name = generate_directory + "/" + selected[i]->name + ".txt";
+            if (!write_command_file(file_name, workloads[i])) {
+                std::cerr << "Error: Cannot write " << file_name << std::endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    char resolved[PATH_MAX];
+    if (realpath(fs_path.c_str(), resolved) == NULL) {
+        std::cerr << "Error: Cannot find " << fs_path << std::endl;
+        return 1;
+    }
+    fs_path = resolved;
+
+    char work_template[] = "/tmp/fs_bench.XXXXXX";
+    if (mkdtemp(work_template) == NULL) {
+        std::cerr << "Error: Cannot create a work directory\n";
+        return 1;
+    }
+    std::string work_directory = work_template;
+
+    std::map<std::string, double> baseline;
+    if (!baseline_name.empty() && !read_baseline(baseline_name, baseline)) {
+        std::cerr << "Error: Cannot read " << baseline_name << std::endl;
+        return 1;
+    }
+
+    std::ostringstream results;
+    results << "# fs_bench scale " << scale << " seed " << seed << "\n";
+    printf("%-12s %8s %7s %10s %12s %12s %8s %8s %10s\n", "scenario", "commands", "errors", "ops/sec", "read bytes", "written", "reads", "writes", "vs base");
+
+    bool ok = true;
+    for (size_t i = 0; i < selected.size(); i++) {
+        Scenario_result result;
+        if (!run_scenario(fs_path, work_directory, *selected[i], workloads[i], &result)) {
+            ok = false;
+            continue;
+        }
+        results << format_result(result);
+
+        double ops_per_sec = result.seconds > 0 ? result.commands / result.seconds : 0.0;
+        char change[32] = "-";
+        if (baseline.count(result.scenario) && baseline[result.scenario] > 0) {
+            snprintf(change, sizeof(change), "%+.1f%%", (ops_per_sec / baseline[result.scenario] - 1) * 100);
+        }
+        printf("%-12s %8ld %7ld %10.0f %12lld %12lld %8lld %8lld %10s\n", result.scenario.c_str(), result.commands,
+                    result.error_responses, ops_per_sec, result.read_bytes, result.written_bytes,
+                    result.read_syscalls, result.write_syscalls, change);
+    }
+
+    std::ofstream output(output_name);
+    output << results.str();
+    output.close();
+    if (!output) {
+        std::cerr << "Error: Cannot write " << output_name << std::endl;
+        return 1;
+    }
+    printf("Results written to %s\n", output_name.c_str());
+
+    std::string cleanup = "rm -rf '" + work_directory + "'";
+    if (system(cleanup.c_str()) != 0) {
+        std::cerr << "Warning: Cannot remove " << work_directory << std::endl;
+    }
+    return ok ? 0 : 1;
+}
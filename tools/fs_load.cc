@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Load generator for the file system server (fs --serve). Every client connection replays the
+// same command file, keeping up to a fixed number of commands in flight, and the latency of each
+// command (from sending it to receiving its whole response) is recorded.
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct {
+    std::vector<double> latencies_us; // Latency of every command, in microseconds
+    long error_responses;             // Responses that reported an error
+    bool failed;
+} Client_result;
+
+/**
+ * @brief Connect to the server's socket
+ *
+ * @param socket_path - The path of the server's socket
+ * @return The connected socket, or -1 on failure
+ */
+static int connect_to_server(const std::string & socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Pull complete responses out of the received bytes. A response is a header line
+ * "<line number> <length>" followed by length bytes of output.
+ *
+ * @param received - The bytes received so far. Complete responses are removed.
+ * @param error_responses - Incremented for every response that mentions an error
+ * @return The number of complete responses removed
+ */
+static int take_responses(std::string & received, long & error_responses) {
+    int count = 0;
+    size_t start = 0;
+    while (true) {
+        size_t header_end = received.find('\n', start);
+        if (header_end == std::string::npos) {
+            break;
+        }
+        long line_number = 0;
+        long length = 0;
+        if (sscanf(received.c_str() + start, "%ld %ld", &line_number, &length) != 2) {
+            break;
+        }
+        if (received.size() - (header_end + 1) < (size_t) length) {
+            break;
+        }
+        if (length > 0 && received.find("Error", header_end + 1) < header_end + 1 + length) {
+            error_responses++;
+        }
+        start = header_end + 1 + length;
+        count++;
+    }
+    received.erase(0, start);
+    return count;
+}
+
+/**
+ * @brief Replay the commands over one connection, keeping up to depth commands in flight
+ *
+ * @param socket_path - The path of the server's socket
+ * @param commands - The command lines to send, in order
+ * @param depth - The maximum number of commands in flight
+ * @param result - Where to record the latencies
+ */
+static void run_client(const std::string & socket_path, const std::vector<std::string> & commands, int depth, Client_result * result) {
+    result->error_responses = 0;
+    result->failed = false;
+
+    int fd = connect_to_server(socket_path);
+    if (fd < 0) {
+        result->failed = true;
+        return;
+    }
+
+    std::vector<Clock::time_point> sent_at(commands.size());
+    size_t sent = 0;
+    size_t answered = 0;
+    std::string pending;  // Bytes of the command being sent that the socket did not take yet
+    std::string received;
+    char chunk[65536];
+
+    while (answered < commands.size()) {
+        while (sent < commands.size() && sent - answered < (size_t) depth) {
+            pending += commands[sent] + "\n";
+            sent_at[sent] = Clock::now();
+            sent++;
+        }
+
+        struct pollfd poll_fd = {fd, POLLIN, 0};
+        if (!pending.empty()) {
+            poll_fd.events |= POLLOUT;
+        }
+        if (poll(&poll_fd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result->failed = true;
+            break;
+        }
+
+        if (poll_fd.revents & POLLOUT) {
+            ssize_t sizeWritten = send(fd, pending.data(), pending.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sizeWritten > 0) {
+                pending.erase(0, sizeWritten);
+            } else if (sizeWritten < 0 && errno != EAGAIN && errno != EINTR) {
+                result->failed = true;
+                break;
+            }
+        }
+
+        if (poll_fd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t sizeRead = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (sizeRead == 0 || (sizeRead < 0 && errno != EAGAIN && errno != EINTR)) {
+                result->failed = true;
+                break;
+            }
+            if (sizeRead > 0) {
+                received.append(chunk, sizeRead);
+                int responses = take_responses(received, result->error_responses);
+                Clock::time_point now = Clock::now();
+                for (int i = 0; i < responses; i++) {
+                    std::chrono::duration<double, std::micro> latency = now - sent_at[answered];
+                    result->latencies_us.push_back(latency.count());
+                    answered++;
+                }
+            }
+        }
+    }
+
+    close(fd);
+}
+
+/**
+ * @brief Get a percentile from sorted values
+ *
+ * @param sorted - The values, sorted in increasing order. Must not be empty.
+ * @param percentile - The percentile to get, between 0 and 100
+ * @return The value at the percentile
+ */
+static double percentile_of(const std::vector<double> & sorted, double percentile) {
+    size_t index = (size_t) (percentile / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+int main(int argc, char **argv) {
+    std::string socket_path;
+    std::string command_file_name;
+    int clients = 1;
+    int depth = 1;
+    int repeat = 1;
+
+    for (int arg = 1; arg < argc; arg++) {
+        std::string option = argv[arg];
+        if (option == "--clients" && arg + 1 < argc) {
+            clients = atoi(argv[++arg]);
+        } else if (option == "--depth" && arg + 1 < argc) {
+            depth = atoi(argv[++arg]);
+        } else if (option == "--repeat" && arg + 1 < argc) {
+            repeat = atoi(argv[++arg]);
+        } else if (socket_path.empty()) {
+            socket_path = option;
+        } else if (command_file_name.empty()) {
+            command_file_name = option;
+        } else {
+            socket_path.clear();
+            break;
+        }
+    }
+
+    if (socket_path.empty() || command_file_name.empty() || clients < 1 || depth < 1 || repeat < 1) {
+        std::cerr << "Usage: fs_load <socket> <command file> [--clients N] [--depth N] [--repeat N]\n";
+        return 1;
+    }
+
+    std::ifstream command_file(command_file_name);
+    if (!command_file.is_open()) {
+        std::cerr << "Unable to open the command file.\n";
+        return 1;
+    }
+    std::vector<std::string> file_commands;
+    std::string line;
+    while (getline(command_file, line)) {
+        file_commands.push_back(line);
+    }
+    std::vector<std::string> commands;
+    for (int i = 0; i < repeat; i++) {
+        commands.insert(commands.end(), file_commands.begin(), file_commands.end());
+    }
+
+    std::vector<Client_result> results(clients);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < clients; i++) {
+        threads.push_back(std::thread(run_client, socket_path, std::cref(commands), depth, &results[i]));
+    }
+    for (auto & thread: threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    std::vector<double> latencies;
+    long error_responses = 0;
+    int failed_clients = 0;
+    for (auto & result: results) {
+        latencies.insert(latencies.end(), result.latencies_us.begin(), result.latencies_us.end());
+        error_responses += result.error_responses;
+        if (result.failed) {
+            failed_clients++;
+        }
+    }
+
+    if (latencies.empty()) {
+        std::cerr << "No responses received from " << socket_path << std::endl;
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("clients           %d\n", clients);
+    printf("pipeline depth    %d\n", depth);
+    printf("requests          %zu\n", latencies.size());
+    printf("error responses   %ld\n", error_responses);
+    printf("failed clients    %d\n", failed_clients);
+    printf("elapsed           %.3f s\n", elapsed.count());
+    printf("throughput        %.0f req/s\n", latencies.size() / elapsed.count());
+    printf("latency p50       %.1f us\n", percentile_of(latencies, 50));
+    printf("latency p90       %.1f us\n", percentile_of(latencies, 90));
+    printf("latency p99       %.1f us\n", percentile_of(latencies, 99));
+    printf("latency p99.9     %.1f us\n", percentile_of(latencies, 99.9));
+    printf("latency max       %.1f us\n", latencies.back());
+
+    return failed_clients == 0 ? 0 : 1;
+}
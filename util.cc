@@ -7,21 +7,15 @@
  * 
  * @param str - The string to tokenize
  * @param delim - The string containing delimiter character(s)
- * @return std::vector<std::string> - The list of tokenized strings. Can be empty
+ * @param tokens - The list to append the tokenized strings to. Allocated from the command arena.
  */
-std::vector<std::string> tokenize(const std::string &str, const char *delim) {
-    char* cstr = new char[str.size() + 1];
-    std::strcpy(cstr, str.c_str());
-
-    char* tokenized_string = strtok(cstr, delim);
-
-    std::vector<std::string> tokens;
-    while (tokenized_string != NULL)
+void tokenize(const std::string &str, const char *delim, Command_arguments &tokens) {
+    const char* cstr = str.c_str() + std::strspn(str.c_str(), delim);
+    while (*cstr != 0)
     {
-        tokens.push_back(std::string(tokenized_string));
-        tokenized_string = strtok(NULL, delim);
+        size_t length = std::strcspn(cstr, delim);
+        tokens.push_back(Arena_string(cstr, length));
+        cstr += length;
+        cstr += std::strspn(cstr, delim);
     }
-    delete[] cstr;
-
-    return tokens;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include <vector>
 #include <string>
 
+#include "Arena.h"
+
 #pragma once
 
 /**
@@ -8,6 +10,6 @@
  * 
  * @param str - The string to tokenize
  * @param delim - The string containing delimiter character(s)
- * @return std::vector<std::string> - The list of tokenized strings. Can be empty
+ * @param tokens - The list to append the tokenized strings to. Allocated from the command arena.
  */
-std::vector<std::string> tokenize(const std::string &str, const char *delim);
\ No newline at end of file
+void tokenize(const std::string &str, const char *delim, Command_arguments &tokens);